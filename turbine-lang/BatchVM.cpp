@@ -0,0 +1,608 @@
+#include <iostream>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <memory>
+#include <cstdint>
+#include <climits>
+
+#include "Main.h"
+#include "BatchVM.h"
+#include "SimdScan.h"
+
+#if defined( _M_X64 ) || defined( _M_IX86 ) || defined( __x86_64__ ) || defined( __i386__ )
+#define BATCH_X86 1
+#else
+#define BATCH_X86 0
+#endif
+
+#if BATCH_X86
+#include <immintrin.h>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#define TARGET_SSE2
+#define TARGET_AVX2
+#else
+#define TARGET_SSE2 __attribute__(( target( "sse2" ) ))
+#define TARGET_AVX2 __attribute__(( target( "avx2" ) ))
+#endif
+#endif
+
+static uint32_t lowest_lane( uint64_t bits ) {
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanForward64( &index, bits );
+	return index;
+#else
+	return ( uint32_t ) __builtin_ctzll( bits );
+#endif
+}
+
+static uint32_t count_lanes( uint64_t bits ) {
+#ifdef _MSC_VER
+	uint32_t count = 0;
+
+	for ( ; bits != 0; bits &= bits - 1 )
+		++count;
+
+	return count;
+#else
+	return ( uint32_t ) __builtin_popcountll( bits );
+#endif
+}
+
+// Every kernel writes only the lanes set in 'mask', other lanes may be at another instruction
+typedef void( *BatchKernel )( double* dst, const double* a, const double* b, double imm, const uint64_t* mask );
+
+// Sets the bits of the lanes in 'mask' whose value in 'a' is zero
+typedef void( *BatchZeroKernel )( const double* a, const uint64_t* mask, uint64_t* zero );
+
+struct BatchKernels {
+	BatchKernel			ops[ BatchOpCode::bop_copy + 1 ];
+	BatchZeroKernel		zero;
+};
+
+template < BatchOpCode op >
+inline double compute_scalar( const double* a, const double* b, double imm, size_t i ) {
+	switch ( op ) {
+	case BatchOpCode::bop_add: return a[ i ] + b[ i ];
+	case BatchOpCode::bop_sub: return a[ i ] - b[ i ];
+	case BatchOpCode::bop_mul: return a[ i ] * b[ i ];
+	case BatchOpCode::bop_div: return a[ i ] / b[ i ];
+	case BatchOpCode::bop_gt: return a[ i ] > b[ i ] ? 1.0 : 0.0;
+	case BatchOpCode::bop_lt: return a[ i ] < b[ i ] ? 1.0 : 0.0;
+	case BatchOpCode::bop_eq: return a[ i ] == b[ i ] ? 1.0 : 0.0;
+	case BatchOpCode::bop_ne: return a[ i ] != b[ i ] ? 1.0 : 0.0;
+	case BatchOpCode::bop_add_imm: return a[ i ] + imm;
+	case BatchOpCode::bop_sub_imm: return a[ i ] - imm;
+	case BatchOpCode::bop_mul_imm: return a[ i ] * imm;
+	case BatchOpCode::bop_div_imm: return a[ i ] / imm;
+	case BatchOpCode::bop_fill: return imm;
+	default: return a[ i ];
+	}
+}
+
+template < BatchOpCode op >
+void kernel_scalar( double* dst, const double* a, const double* b, double imm, const uint64_t* mask ) {
+	for ( size_t w = 0; w < batch_mask_words; ++w ) {
+		for ( auto bits = mask[ w ]; bits != 0; bits &= bits - 1 ) {
+			size_t i = w * 64 + lowest_lane( bits );
+			dst[ i ] = compute_scalar< op >( a, b, imm, i );
+		}
+	}
+}
+
+void zero_lanes_scalar( const double* a, const uint64_t* mask, uint64_t* zero ) {
+	for ( size_t w = 0; w < batch_mask_words; ++w ) {
+		uint64_t result = 0;
+
+		for ( size_t i = 0; i < 64; ++i ) {
+			result |= ( uint64_t ) ( a[ w * 64 + i ] == 0.0 ) << i;
+		}
+
+		zero[ w ] = result & mask[ w ];
+	}
+}
+
+#if BATCH_X86
+
+template < BatchOpCode op >
+TARGET_SSE2 inline __m128d compute_sse2( const double* a, const double* b, __m128d imm, size_t i ) {
+	auto one = _mm_set1_pd( 1.0 );
+
+	switch ( op ) {
+	case BatchOpCode::bop_add: return _mm_add_pd( _mm_load_pd( a + i ), _mm_load_pd( b + i ) );
+	case BatchOpCode::bop_sub: return _mm_sub_pd( _mm_load_pd( a + i ), _mm_load_pd( b + i ) );
+	case BatchOpCode::bop_mul: return _mm_mul_pd( _mm_load_pd( a + i ), _mm_load_pd( b + i ) );
+	case BatchOpCode::bop_div: return _mm_div_pd( _mm_load_pd( a + i ), _mm_load_pd( b + i ) );
+	case BatchOpCode::bop_gt: return _mm_and_pd( _mm_cmpgt_pd( _mm_load_pd( a + i ), _mm_load_pd( b + i ) ), one );
+	case BatchOpCode::bop_lt: return _mm_and_pd( _mm_cmplt_pd( _mm_load_pd( a + i ), _mm_load_pd( b + i ) ), one );
+	case BatchOpCode::bop_eq: return _mm_and_pd( _mm_cmpeq_pd( _mm_load_pd( a + i ), _mm_load_pd( b + i ) ), one );
+	case BatchOpCode::bop_ne: return _mm_and_pd( _mm_cmpneq_pd( _mm_load_pd( a + i ), _mm_load_pd( b + i ) ), one );
+	case BatchOpCode::bop_add_imm: return _mm_add_pd( _mm_load_pd( a + i ), imm );
+	case BatchOpCode::bop_sub_imm: return _mm_sub_pd( _mm_load_pd( a + i ), imm );
+	case BatchOpCode::bop_mul_imm: return _mm_mul_pd( _mm_load_pd( a + i ), imm );
+	case BatchOpCode::bop_div_imm: return _mm_div_pd( _mm_load_pd( a + i ), imm );
+	case BatchOpCode::bop_fill: return imm;
+	default: return _mm_load_pd( a + i );
+	}
+}
+
+template < BatchOpCode op >
+TARGET_SSE2 void kernel_sse2( double* dst, const double* a, const double* b, double imm, const uint64_t* mask ) {
+	auto imm_vector = _mm_set1_pd( imm );
+
+	for ( size_t w = 0; w < batch_mask_words; ++w ) {
+		auto bits = mask[ w ];
+		auto first = w * 64;
+
+		if ( bits == ~0ull ) {
+			for ( size_t i = first; i < first + 64; i += 2 ) {
+				_mm_store_pd( dst + i, compute_sse2< op >( a, b, imm_vector, i ) );
+			}
+		} else if ( bits != 0 ) {
+			for ( size_t i = first; i < first + 64; i += 2 ) {
+				auto lanes = ( bits >> ( i - first ) ) & 0x3;
+
+				if ( lanes == 0 ) {
+					continue;
+				}
+
+				auto value = compute_sse2< op >( a, b, imm_vector, i );
+
+				// No blendv before SSE4.1, select with and/andnot
+				if ( lanes != 0x3 ) {
+					auto select = _mm_castsi128_pd( _mm_set_epi64x( -( int64_t ) ( lanes >> 1 ), -( int64_t ) ( lanes & 1 ) ) );
+					value = _mm_or_pd( _mm_and_pd( select, value ), _mm_andnot_pd( select, _mm_load_pd( dst + i ) ) );
+				}
+
+				_mm_store_pd( dst + i, value );
+			}
+		}
+	}
+}
+
+TARGET_SSE2 void zero_lanes_sse2( const double* a, const uint64_t* mask, uint64_t* zero ) {
+	auto zero_vector = _mm_setzero_pd();
+
+	for ( size_t w = 0; w < batch_mask_words; ++w ) {
+		uint64_t result = 0;
+
+		if ( mask[ w ] != 0 ) {
+			for ( size_t i = 0; i < 64; i += 2 ) {
+				result |= ( uint64_t ) _mm_movemask_pd( _mm_cmpeq_pd( _mm_load_pd( a + w * 64 + i ), zero_vector ) ) << i;
+			}
+		}
+
+		zero[ w ] = result & mask[ w ];
+	}
+}
+
+template < BatchOpCode op >
+TARGET_AVX2 inline __m256d compute_avx2( const double* a, const double* b, __m256d imm, size_t i ) {
+	auto one = _mm256_set1_pd( 1.0 );
+
+	switch ( op ) {
+	case BatchOpCode::bop_add: return _mm256_add_pd( _mm256_load_pd( a + i ), _mm256_load_pd( b + i ) );
+	case BatchOpCode::bop_sub: return _mm256_sub_pd( _mm256_load_pd( a + i ), _mm256_load_pd( b + i ) );
+	case BatchOpCode::bop_mul: return _mm256_mul_pd( _mm256_load_pd( a + i ), _mm256_load_pd( b + i ) );
+	case BatchOpCode::bop_div: return _mm256_div_pd( _mm256_load_pd( a + i ), _mm256_load_pd( b + i ) );
+	case BatchOpCode::bop_gt: return _mm256_and_pd( _mm256_cmp_pd( _mm256_load_pd( a + i ), _mm256_load_pd( b + i ), _CMP_GT_OQ ), one );
+	case BatchOpCode::bop_lt: return _mm256_and_pd( _mm256_cmp_pd( _mm256_load_pd( a + i ), _mm256_load_pd( b + i ), _CMP_LT_OQ ), one );
+	case BatchOpCode::bop_eq: return _mm256_and_pd( _mm256_cmp_pd( _mm256_load_pd( a + i ), _mm256_load_pd( b + i ), _CMP_EQ_OQ ), one );
+	case BatchOpCode::bop_ne: return _mm256_and_pd( _mm256_cmp_pd( _mm256_load_pd( a + i ), _mm256_load_pd( b + i ), _CMP_NEQ_UQ ), one );
+	case BatchOpCode::bop_add_imm: return _mm256_add_pd( _mm256_load_pd( a + i ), imm );
+	case BatchOpCode::bop_sub_imm: return _mm256_sub_pd( _mm256_load_pd( a + i ), imm );
+	case BatchOpCode::bop_mul_imm: return _mm256_mul_pd( _mm256_load_pd( a + i ), imm );
+	case BatchOpCode::bop_div_imm: return _mm256_div_pd( _mm256_load_pd( a + i ), imm );
+	case BatchOpCode::bop_fill: return imm;
+	default: return _mm256_load_pd( a + i );
+	}
+}
+
+template < BatchOpCode op >
+TARGET_AVX2 void kernel_avx2( double* dst, const double* a, const double* b, double imm, const uint64_t* mask ) {
+	auto imm_vector = _mm256_set1_pd( imm );
+
+	// Moves lane bit n into the sign bit of element n, which is all blendv looks at
+	auto lane_shifts = _mm256_set_epi64x( 60, 61, 62, 63 );
+
+	for ( size_t w = 0; w < batch_mask_words; ++w ) {
+		auto bits = mask[ w ];
+		auto first = w * 64;
+
+		if ( bits == ~0ull ) {
+			for ( size_t i = first; i < first + 64; i += 4 ) {
+				_mm256_store_pd( dst + i, compute_avx2< op >( a, b, imm_vector, i ) );
+			}
+		} else if ( bits != 0 ) {
+			for ( size_t i = first; i < first + 64; i += 4 ) {
+				auto lanes = ( bits >> ( i - first ) ) & 0xF;
+
+				if ( lanes == 0 ) {
+					continue;
+				}
+
+				auto value = compute_avx2< op >( a, b, imm_vector, i );
+
+				if ( lanes != 0xF ) {
+					auto select = _mm256_castsi256_pd( _mm256_sllv_epi64( _mm256_set1_epi64x( ( int64_t ) lanes ), lane_shifts ) );
+					value = _mm256_blendv_pd( _mm256_load_pd( dst + i ), value, select );
+				}
+
+				_mm256_store_pd( dst + i, value );
+			}
+		}
+	}
+}
+
+TARGET_AVX2 void zero_lanes_avx2( const double* a, const uint64_t* mask, uint64_t* zero ) {
+	auto zero_vector = _mm256_setzero_pd();
+
+	for ( size_t w = 0; w < batch_mask_words; ++w ) {
+		uint64_t result = 0;
+
+		if ( mask[ w ] != 0 ) {
+			for ( size_t i = 0; i < 64; i += 4 ) {
+				result |= ( uint64_t ) _mm256_movemask_pd( _mm256_cmp_pd( _mm256_load_pd( a + w * 64 + i ), zero_vector, _CMP_EQ_OQ ) ) << i;
+			}
+		}
+
+		zero[ w ] = result & mask[ w ];
+	}
+}
+
+#endif
+
+#define batch_kernel_table( kernel ) { \
+	kernel< bop_add >, kernel< bop_sub >, kernel< bop_mul >, kernel< bop_div >, \
+	kernel< bop_gt >, kernel< bop_lt >, kernel< bop_eq >, kernel< bop_ne >, \
+	kernel< bop_add_imm >, kernel< bop_sub_imm >, kernel< bop_mul_imm >, kernel< bop_div_imm >, \
+	kernel< bop_fill >, kernel< bop_copy > \
+}
+
+BatchKernels batch_kernels_for( SimdLevel level ) {
+#if BATCH_X86
+	switch ( level ) {
+	case SimdLevel::simd_avx2: return BatchKernels{ batch_kernel_table( kernel_avx2 ), zero_lanes_avx2 };
+	case SimdLevel::simd_sse2: return BatchKernels{ batch_kernel_table( kernel_sse2 ), zero_lanes_sse2 };
+	default: break;
+	}
+#endif
+
+	return BatchKernels{ batch_kernel_table( kernel_scalar ), zero_lanes_scalar };
+}
+
+BatchKernels batch_kernels = batch_kernels_for( simd_detect() );
+
+void set_batch_simd_level( SimdLevel level ) {
+	batch_kernels = batch_kernels_for( level );
+}
+
+BatchOpCode batch_binary_op( uint32_t op ) {
+	switch ( op ) {
+	case OpCode::op_add: case OpCode::op_add_slot_imm: return BatchOpCode::bop_add;
+	case OpCode::op_sub: case OpCode::op_sub_slot_imm: return BatchOpCode::bop_sub;
+	case OpCode::op_mul: case OpCode::op_mul_slot_imm: return BatchOpCode::bop_mul;
+	case OpCode::op_div: case OpCode::op_div_slot_imm: return BatchOpCode::bop_div;
+	case OpCode::op_gt: case OpCode::op_gt_jz: return BatchOpCode::bop_gt;
+	case OpCode::op_lt: case OpCode::op_lt_jz: return BatchOpCode::bop_lt;
+	case OpCode::op_eq: case OpCode::op_eq_jz: return BatchOpCode::bop_eq;
+	default: return BatchOpCode::bop_ne;
+	}
+}
+
+BatchFunction compile_batch( const CompiledProgram& program, int function_index ) {
+	// Rows are assigned from the stack height at each instruction, which only verified code guarantees
+	if ( !program.verified ) {
+		throw std::exception( "Batch execution needs verified bytecode" );
+	}
+
+	auto& function = program.program.functions[ function_index ];
+	auto& code = function.code;
+
+	BatchFunction batch;
+	batch.arg_count = function_index == program.program.main ? 0 : function.arg_count;
+
+	if ( function_index == program.program.main ) {
+		batch.globals = program.globals;
+	}
+
+	auto frame_size = ( uint32_t ) ( batch.globals.size() + batch.arg_count );
+
+	// Depth above the frame before each reachable instruction, -1 for dead code
+	std::vector< int > depths( code.size(), -1 );
+	std::vector< size_t > pending = { 0 };
+
+	depths[ 0 ] = 0;
+
+	while ( pending.size() > 0 ) {
+		auto offset = pending.back();
+		pending.pop_back();
+
+		auto op = code[ offset ];
+		auto effect = stack_effect( &code[ offset ] );
+		auto depth = depths[ offset ] - effect.pops + effect.pushes;
+
+		auto visit = [ & ]( size_t target ) {
+			if ( depths[ target ] == -1 ) {
+				depths[ target ] = depth;
+				pending.push_back( target );
+			}
+		};
+
+		if ( is_jump( op ) ) {
+			encoded_value value;
+			value.data.uint32[ 0 ] = code[ offset + 1 ];
+			visit( offset + 2 + value.data.int32[ 0 ] );
+		}
+
+		if ( falls_through( op ) ) {
+			visit( offset + opcode_length( op ) );
+		}
+	}
+
+	// Instruction index of each code offset, removed instructions map to the one after them
+	std::vector< uint32_t > instruction_at( code.size(), 0 );
+	std::vector< std::pair< size_t, size_t > > jumps;
+
+	batch.row_count = frame_size;
+
+	auto emit = [ &batch ]( BatchOpCode op, uint32_t dst, uint32_t a, uint32_t b, double imm ) {
+		batch.code.push_back( BatchInstruction{ op, dst, a, b, 0, imm } );
+	};
+
+	for ( size_t offset = 0; offset < code.size(); offset += opcode_length( code[ offset ] ) ) {
+		instruction_at[ offset ] = ( uint32_t ) batch.code.size();
+
+		if ( depths[ offset ] == -1 ) {
+			continue;
+		}
+
+		auto op = code[ offset ];
+		auto effect = stack_effect( &code[ offset ] );
+		auto top = frame_size + ( uint32_t ) depths[ offset ];
+
+		batch.row_count = std::max( batch.row_count, top - effect.pops + effect.pushes );
+
+		encoded_value value;
+		value.data.uint32[ 0 ] = offset + 1 < code.size() ? code[ offset + 1 ] : 0;
+		value.data.uint32[ 1 ] = offset + 2 < code.size() ? code[ offset + 2 ] : 0;
+
+		switch ( op ) {
+		case OpCode::op_add:
+		case OpCode::op_sub:
+		case OpCode::op_mul:
+		case OpCode::op_div:
+		case OpCode::op_gt:
+		case OpCode::op_lt:
+		case OpCode::op_eq:
+		case OpCode::op_ne:
+			emit( batch_binary_op( op ), top - 2, top - 2, top - 1, 0.0 );
+			break;
+		case OpCode::op_add_slot_imm:
+		case OpCode::op_sub_slot_imm:
+		case OpCode::op_mul_slot_imm:
+		case OpCode::op_div_slot_imm: {
+			encoded_value imm;
+			imm.data.uint32[ 0 ] = code[ offset + 2 ];
+			imm.data.uint32[ 1 ] = code[ offset + 3 ];
+
+			emit( ( BatchOpCode ) ( batch_binary_op( op ) + BatchOpCode::bop_add_imm ), top, code[ offset + 1 ], 0, imm.data.dbl );
+			break;
+		}
+		case OpCode::op_load_number: emit( BatchOpCode::bop_fill, top, 0, 0, value.data.dbl ); break;
+		case OpCode::op_load_zero: emit( BatchOpCode::bop_fill, top, 0, 0, 0.0 ); break;
+		case OpCode::op_load_slot: emit( BatchOpCode::bop_copy, top, code[ offset + 1 ], 0, 0.0 ); break;
+		case OpCode::op_set_slot:
+		case OpCode::op_store_slot:
+			if ( code[ offset + 1 ] != top - 1 ) {
+				emit( BatchOpCode::bop_copy, code[ offset + 1 ], top - 1, 0, 0.0 );
+			}
+
+			break;
+		case OpCode::op_pop: break;
+		case OpCode::op_return: emit( BatchOpCode::bop_return, 0, top - 1, 0, 0.0 ); break;
+		case OpCode::op_gt_jz:
+		case OpCode::op_lt_jz:
+		case OpCode::op_eq_jz:
+		case OpCode::op_ne_jz:
+			emit( batch_binary_op( op ), top - 2, top - 2, top - 1, 0.0 );
+			emit( BatchOpCode::bop_jz, 0, top - 2, 0, 0.0 );
+			jumps.push_back( { batch.code.size() - 1, offset + 2 + value.data.int32[ 0 ] } );
+			break;
+		case OpCode::op_jz:
+		case OpCode::op_jz_pop:
+			emit( BatchOpCode::bop_jz, 0, top - 1, 0, 0.0 );
+			jumps.push_back( { batch.code.size() - 1, offset + 2 + value.data.int32[ 0 ] } );
+			break;
+		case OpCode::op_jmp:
+			emit( BatchOpCode::bop_jmp, 0, 0, 0, 0.0 );
+			jumps.push_back( { batch.code.size() - 1, offset + 2 + value.data.int32[ 0 ] } );
+			break;
+		default:
+			throw std::exception( ( "Batch execution does not support calls, found one in '" + symbol_name( function.name ) + "'" ).c_str() );
+		}
+	}
+
+	for ( auto& jump : jumps ) {
+		batch.code[ jump.first ].target = instruction_at[ jump.second ];
+	}
+
+	return batch;
+}
+
+// Lanes sharing an instruction, the group at the lowest instruction runs first so
+// lanes that branched apart meet again where their paths join
+struct BatchGroup {
+	uint32_t			pc;
+	uint64_t			mask[ batch_mask_words ];
+};
+
+void add_group( std::vector< BatchGroup >& groups, const BatchGroup& group ) {
+	for ( auto& other : groups ) {
+		if ( other.pc == group.pc ) {
+			for ( size_t w = 0; w < batch_mask_words; ++w ) {
+				other.mask[ w ] |= group.mask[ w ];
+			}
+
+			return;
+		}
+	}
+
+	groups.push_back( group );
+}
+
+BatchGroup take_lowest_group( std::vector< BatchGroup >& groups ) {
+	size_t lowest = 0;
+
+	for ( size_t i = 1; i < groups.size(); ++i ) {
+		if ( groups[ i ].pc < groups[ lowest ].pc ) {
+			lowest = i;
+		}
+	}
+
+	auto group = groups[ lowest ];
+	groups[ lowest ] = groups.back();
+	groups.pop_back();
+
+	return group;
+}
+
+uint32_t lowest_pc( const std::vector< BatchGroup >& groups ) {
+	uint32_t pc = UINT32_MAX;
+
+	for ( auto& group : groups ) {
+		pc = std::min( pc, group.pc );
+	}
+
+	return pc;
+}
+
+BatchStats run_batch( const BatchFunction& function, const double* arguments, size_t lane_count, double* results ) {
+	auto& kernels = batch_kernels;
+	auto code = function.code.data();
+	BatchStats stats = { 0, 0 };
+
+	// Rows are 32 byte aligned for the vector loads
+	std::vector< double > storage( ( size_t ) std::max( function.row_count, 1u ) * batch_lanes + 4, 0.0 );
+	auto rows = ( double* ) ( ( ( uintptr_t ) storage.data() + 31 ) & ~( uintptr_t ) 31 );
+	auto row = [ rows ]( uint32_t index ) { return rows + ( size_t ) index * batch_lanes; };
+
+	std::vector< BatchGroup > waiting;
+
+	for ( size_t first = 0; first < lane_count; first += batch_lanes ) {
+		auto count = std::min( batch_lanes, lane_count - first );
+
+		for ( size_t i = 0; i < function.globals.size(); ++i ) {
+			std::fill( row( ( uint32_t ) i ), row( ( uint32_t ) i ) + batch_lanes, function.globals[ i ] );
+		}
+
+		for ( int i = 0; i < function.arg_count; ++i ) {
+			std::copy( arguments + i * lane_count + first, arguments + i * lane_count + first + count, row( ( uint32_t ) i ) );
+		}
+
+		BatchGroup current;
+		current.pc = 0;
+
+		for ( size_t w = 0; w < batch_mask_words; ++w ) {
+			auto lanes = std::min( count - std::min( count, w * 64 ), ( size_t ) 64 );
+			current.mask[ w ] = lanes == 64 ? ~0ull : ( 1ull << lanes ) - 1;
+		}
+
+		waiting.clear();
+		uint32_t next_pc = UINT32_MAX;
+		bool finished = false;
+
+		while ( !finished ) {
+			// Another group is due first, or the current one caught up with it
+			if ( current.pc >= next_pc ) {
+				auto group = take_lowest_group( waiting );
+
+				if ( group.pc == current.pc ) {
+					for ( size_t w = 0; w < batch_mask_words; ++w ) {
+						current.mask[ w ] |= group.mask[ w ];
+					}
+				} else {
+					add_group( waiting, current );
+					current = group;
+				}
+
+				next_pc = lowest_pc( waiting );
+				continue;
+			}
+
+			auto& instruction = code[ current.pc ];
+
+			++stats.dispatches;
+
+			for ( size_t w = 0; w < batch_mask_words; ++w ) {
+				stats.lane_ops += count_lanes( current.mask[ w ] );
+			}
+
+			switch ( instruction.op ) {
+			case BatchOpCode::bop_jz: {
+				uint64_t zero[ batch_mask_words ];
+				uint64_t taken = 0, staying = 0;
+
+				kernels.zero( row( instruction.a ), current.mask, zero );
+
+				for ( size_t w = 0; w < batch_mask_words; ++w ) {
+					taken |= zero[ w ];
+					staying |= current.mask[ w ] & ~zero[ w ];
+				}
+
+				if ( taken == 0 ) {
+					++current.pc;
+				} else if ( staying == 0 ) {
+					current.pc = instruction.target;
+				} else {
+					// Divergent lanes, the jumping ones wait for their turn
+					BatchGroup jumped;
+					jumped.pc = instruction.target;
+
+					for ( size_t w = 0; w < batch_mask_words; ++w ) {
+						jumped.mask[ w ] = zero[ w ];
+						current.mask[ w ] &= ~zero[ w ];
+					}
+
+					add_group( waiting, jumped );
+					next_pc = std::min( next_pc, jumped.pc );
+					++current.pc;
+				}
+
+				break;
+			}
+			case BatchOpCode::bop_jmp:
+				current.pc = instruction.target;
+				break;
+			case BatchOpCode::bop_return: {
+				auto values = row( instruction.a );
+
+				for ( size_t w = 0; w < batch_mask_words; ++w ) {
+					for ( auto bits = current.mask[ w ]; bits != 0; bits &= bits - 1 ) {
+						size_t i = w * 64 + lowest_lane( bits );
+						results[ first + i ] = values[ i ];
+					}
+				}
+
+				if ( waiting.empty() ) {
+					finished = true;
+					break;
+				}
+
+				current = take_lowest_group( waiting );
+				next_pc = lowest_pc( waiting );
+				break;
+			}
+			default:
+				kernels.ops[ instruction.op ]( row( instruction.dst ), row( instruction.a ), row( instruction.b ), instruction.imm, current.mask );
+				++current.pc;
+				break;
+			}
+		}
+	}
+
+	return stats;
+}
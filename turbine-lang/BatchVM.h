@@ -0,0 +1,60 @@
+#pragma once
+
+// Lanes run together by one dispatch, every row of the batch stack holds one value per lane
+const size_t batch_lanes = 256;
+const size_t batch_mask_words = batch_lanes / 64;
+
+// Three-address lane instructions, operands are rows: frame slots first, then operand stack positions
+enum BatchOpCode : uint32_t {
+	bop_add,		// dst, a, b
+	bop_sub,
+	bop_mul,
+	bop_div,
+	bop_gt,
+	bop_lt,
+	bop_eq,
+	bop_ne,
+	bop_add_imm,	// dst, a, imm
+	bop_sub_imm,
+	bop_mul_imm,
+	bop_div_imm,
+	bop_fill,		// dst, imm
+	bop_copy,		// dst, a
+	bop_jz,			// a, target, lanes where a is zero jump
+	bop_jmp,		// target
+	bop_return,		// a
+};
+
+struct BatchInstruction {
+	BatchOpCode			op;
+	uint32_t			dst;
+	uint32_t			a;
+	uint32_t			b;
+	uint32_t			target;		// Instruction index
+	double				imm;
+};
+
+struct BatchFunction {
+	std::vector< BatchInstruction >		code;
+	int									arg_count;
+	std::vector< double >				globals;		// Frame of Main, copied into every lane
+	uint32_t							row_count;
+};
+
+enum SimdLevel : int;
+
+// Kernels used by run_batch(), the highest level the CPU supports by default
+void set_batch_simd_level( SimdLevel level );
+
+// Translates one function of verified bytecode, throws for functions that call others
+BatchFunction compile_batch( const CompiledProgram& program, int function_index );
+
+// Instructions dispatched and the lanes they ran for, lane_ops / dispatches is the average batch width
+struct BatchStats {
+	uint64_t			dispatches;
+	uint64_t			lane_ops;
+};
+
+// Runs the function once per lane. 'arguments' holds one row of 'lane_count' values per argument
+// (struct of arrays), Main takes none and starts from the globals. Writes one result per lane.
+BatchStats run_batch( const BatchFunction& function, const double* arguments, size_t lane_count, double* results );
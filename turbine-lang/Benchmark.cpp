@@ -0,0 +1,1574 @@
+#include <iostream>
+#include <vector>
+#include <string>
+#include <regex>
+#include <unordered_map>
+#include <iomanip>
+#include <chrono>
+#include <algorithm>
+#include <memory>
+#include <thread>
+#include <deque>
+#include <future>
+#include <functional>
+#include <atomic>
+#include <random>
+
+#include "Main.h"
+#include "SimdScan.h"
+#include "Benchmark.h"
+#include "RegisterVM.h"
+#include "BatchVM.h"
+#include "Profiler.h"
+#include "Executor.h"
+
+// Frozen copy of the regex based lexer, kept as the baseline for the lexer benchmarks
+namespace legacy {
+	struct Token {
+		const Keyword*		keyword;
+		std::string			token_string;
+		bool				is_last;
+		int					parse_distance;
+		int					lbp;
+		TokenId				token_type;
+	};
+
+	const std::unordered_map< std::string, Keyword > keyword_list ={
+		{ "Fn",			Keyword { "Fn",		Keyword::kw_word, 60,	TokenId::token_function } },
+		{ "Const",		Keyword { "Const",	Keyword::kw_word, 60,	TokenId::token_const } },
+		{ "Any",		Keyword { "Any",	Keyword::kw_word, 60,	TokenId::token_any } },
+		{ "End",		Keyword { "End",	Keyword::kw_word, 60,	TokenId::token_end } },
+		{ "Return",		Keyword { "Return",	Keyword::kw_word, 0,	TokenId::token_return } },
+		{ "If",			Keyword { "If",		Keyword::kw_word, 0,	TokenId::token_if } },
+		{ "Else",		Keyword { "Else",	Keyword::kw_word, 0,	TokenId::token_else } },
+		{ "Then",		Keyword { "Then",	Keyword::kw_word, 0,	TokenId::token_then } },
+		{ "While",		Keyword { "While",	Keyword::kw_word, 0,	TokenId::token_while } },
+	};
+
+	const std::unordered_map< std::string, Keyword > operator_list = {
+		{ "+",		Keyword { "+",		Keyword::kw_operator, 30,	TokenId::token_plus } },
+		{ "-",		Keyword { "-",		Keyword::kw_operator, 30,	TokenId::token_minus } },
+		{ "/",		Keyword { "/",		Keyword::kw_operator, 40,	TokenId::token_slash } },
+		{ "*",		Keyword { "*",		Keyword::kw_operator, 40,	TokenId::token_star } },
+		{ ";",		Keyword { ";",		Keyword::kw_operator, 0,	TokenId::token_semicolon } },
+		{ "=",		Keyword { "=",		Keyword::kw_operator, 10,	TokenId::token_equals } },
+		{ "(",		Keyword { "(",		Keyword::kw_operator, 50,	TokenId::token_paren_left } },
+		{ ")",		Keyword { ")",		Keyword::kw_operator, 0,	TokenId::token_paren_right } },
+		{ ":",		Keyword { ":",		Keyword::kw_operator, 0,	TokenId::token_colon } },
+		{ ",",		Keyword { ",",		Keyword::kw_operator, 0,	TokenId::token_comma } },
+		{ "<",		Keyword { "<",		Keyword::kw_operator, 20,	TokenId::token_lessthan } },
+		{ ">",		Keyword { ">",		Keyword::kw_operator, 20,	TokenId::token_morethan } },
+	};
+
+	const std::unordered_map< std::string, Keyword > double_char_operator_list ={
+		{ "==",		Keyword{ "==",		Keyword::kw_operator, 20,	TokenId::token_2equals } },
+		{ "!=",		Keyword{ "!=",		Keyword::kw_operator, 20,	TokenId::token_notequals } },
+	};
+
+	const std::regex rx_double_operator = std::regex( "(==)|(!=)" );
+	const std::regex rx_operator = std::regex( "([\\(\\)\\+\\-\\*\\/=;:,><])" );
+	const std::regex rx_identifier_char = std::regex( "[_a-zA-Z0-9]" );
+	const std::regex rx_identifier = std::regex( "[_a-zA-Z0-9]+" );
+	const std::regex rx_number_char = std::regex( "[.0-9]" );
+	const std::regex rx_number = std::regex( "[.0-9]+" );
+
+	bool scan( const std::string& input, const std::regex& mask, std::string* result ) {
+		std::smatch match;
+		auto res = std::regex_search( input, match, mask );
+
+		*result = match.str();
+		return res;
+	}
+
+	Token next_token( const std::string_view& input ) {
+		auto make_token = []( const std::string& token_string, int parse_dist, int lbp, TokenId type, const Keyword* kw ) -> Token {
+			Token token;
+
+			token.keyword = kw;
+			token.token_string = token_string;
+			token.parse_distance = parse_dist;
+			token.is_last = false;
+			token.lbp = lbp;
+			token.token_type = type;
+
+			return token;
+		};
+
+		for ( size_t i = 0; i < input.length(); ++i ) {
+			auto current_char = input.at( i );
+			std::string scan_string = std::string( input.substr( i ) );
+			std::string token_string;
+
+			bool is_whitespace = ( current_char == '\n' || current_char == ' ' || current_char == '\t' );
+
+			if ( is_whitespace )
+				continue;
+
+			if ( std::regex_match( scan_string.substr( 0, 2 ), rx_double_operator ) ) {
+				auto keyword_string = scan_string.substr( 0, 2 );
+				auto keyword = &double_char_operator_list.at( keyword_string );
+
+				return make_token( keyword_string, i + 2, keyword->lbp, keyword->token_type, keyword );
+			}
+
+			if ( std::regex_match( std::string( 1, current_char ), rx_operator ) ) {
+				auto keyword_string = std::string( 1, current_char );
+				auto keyword = &operator_list.at( keyword_string );
+
+				return make_token( keyword_string, i + 1, keyword->lbp, keyword->token_type, keyword );
+			}
+
+			if ( std::regex_match( std::string( 1, current_char ), rx_number_char ) && scan( scan_string, rx_number, &token_string ) ) {
+				return make_token( token_string, i + token_string.length(), 0, TokenId::token_number, NULL );
+			}
+
+			if ( std::regex_match( std::string( 1, current_char ), rx_identifier_char ) && scan( scan_string, rx_identifier, &token_string ) ) {
+				auto found_keyword = keyword_list.find( token_string );
+
+				if ( found_keyword != keyword_list.end() ) {
+					const Keyword* kw = &found_keyword->second;
+					return make_token( token_string, i + token_string.length(), kw->lbp, kw->token_type, kw );
+				} else {
+					return make_token( token_string, i + token_string.length(), 0, TokenId::token_identifier, NULL );
+				}
+			}
+		}
+
+		Token eofToken;
+		eofToken.keyword = NULL;
+		eofToken.token_string = "";
+		eofToken.parse_distance = input.length();
+		eofToken.is_last = true;
+		eofToken.lbp = 0;
+		eofToken.token_type = TokenId::token_eof;
+
+		return eofToken;
+	}
+
+	std::vector< Token > tokenize( const std::string& input ) {
+		std::vector< Token > tokens;
+		Token last_token;
+		int token_cursor = 0;
+
+		do {
+			last_token = next_token( std::string_view( input ).substr( token_cursor ) );
+			token_cursor += last_token.parse_distance;
+
+			tokens.push_back( last_token );
+		} while ( !last_token.is_last );
+
+		return tokens;
+	}
+}
+
+// Generates a valid script of roughly 'target_size' bytes
+std::string generate_script( size_t target_size ) {
+	std::string script;
+	int function_count = 0;
+
+	while ( script.length() < target_size ) {
+		auto name = "Func_" + std::to_string( function_count );
+
+		script += "Fn " + name + " a, b:\n";
+		script += "\tConst x_" + std::to_string( function_count ) + " = a + 12.5 * ( b - 3 ) / 4;\n";
+		script += "\tAny counter = 0;\n";
+		script += "\tWhile counter < 10 Then\n";
+		script += "\t\tcounter = counter + 1;\n";
+		script += "\tEnd While\n";
+		script += "\tIf x_" + std::to_string( function_count ) + " == 4 Then\n";
+		script += "\t\tReturn counter;\n";
+		script += "\tEnd If\n";
+
+		if ( function_count > 0 ) {
+			script += "\tReturn Func_" + std::to_string( function_count - 1 ) + "( counter, 1 ) != 0;\n";
+		} else {
+			script += "\tReturn 0;\n";
+		}
+
+		script += "End Fn\n\n";
+		++function_count;
+	}
+
+	script += "Fn Main:\n\tReturn 0;\nEnd Fn\n";
+	return script;
+}
+
+template < typename Fn >
+double measure_ms( Fn fn ) {
+	auto time_start = std::chrono::steady_clock::now();
+	fn();
+	auto time_end = std::chrono::steady_clock::now();
+
+	return std::chrono::duration< double, std::milli >( time_end - time_start ).count();
+}
+
+template < typename Fn >
+double best_of_ms( int runs, Fn fn ) {
+	double best = measure_ms( fn );
+
+	for ( int i = 1; i < runs; ++i )
+		best = std::min( best, measure_ms( fn ) );
+
+	return best;
+}
+
+void print_throughput( const std::string& label, size_t bytes, double ms ) {
+	auto mb_per_s = ( bytes / ( 1024.0 * 1024.0 ) ) / ( ms / 1000.0 );
+
+	std::cout << std::setfill( ' ' ) << std::left << std::setw( 30 ) << label
+		<< std::right << std::setw( 10 ) << bytes << " bytes "
+		<< std::setw( 10 ) << std::fixed << std::setprecision( 2 ) << ms << " ms "
+		<< std::setw( 10 ) << mb_per_s << " MB/s" << std::endl;
+}
+
+// Sample below which the fraction 'p' of 'samples' falls
+double percentile( std::vector< double > samples, double p ) {
+	if ( samples.empty() )
+		return 0.0;
+
+	std::sort( samples.begin(), samples.end() );
+	return samples[ std::min( samples.size() - 1, ( size_t ) ( p * samples.size() ) ) ];
+}
+
+struct Script {
+	std::string		name;
+	std::string		source;
+};
+
+// Parsed and optimized the same way the CLI runs a script
+Program compile_script( const std::string& source ) {
+	Program program;
+	parse( std::string_view( source ), &program );
+
+	for ( auto& fn : program.functions ) {
+		peephole_optimize( &fn );
+		fuse_superinstructions( &fn );
+	}
+
+	return program;
+}
+
+// Best of 'runs' VMInstance::run() calls. The program is compiled and the VM set up once, outside the timing
+double best_run_ms( int runs, const Program& program, const RunOptions& options, double* result ) {
+	auto compiled = compile_program( program, options );
+	VMInstance instance( options );
+
+	return best_of_ms( runs, [ & ]() { *result = instance.run( *compiled ); } );
+}
+
+// Recursive Fib, Main returns Fib( n )
+std::string fib_source( int n ) {
+	return
+		"Fn Fib n:\n"
+		"\tIf n < 2 Then\n"
+		"\t\tReturn n;\n"
+		"\tEnd If\n"
+		"\tReturn Fib( n - 1 ) + Fib( n - 2 );\n"
+		"End Fn\n"
+		"Fn Main:\n"
+		"\tReturn Fib( " + std::to_string( n ) + " );\n"
+		"End Fn\n";
+}
+
+// A single counting loop in Main, its body is straight-line code
+std::string loop_source( int iterations ) {
+	return
+		"Fn Main:\n"
+		"\tAny i = 0;\n"
+		"\tAny sum = 0;\n"
+		"\tWhile i < " + std::to_string( iterations ) + " Then\n"
+		"\t\tsum = sum + i * 2;\n"
+		"\t\ti = i + 1;\n"
+		"\tEnd While\n"
+		"\tReturn sum;\n"
+		"End Fn\n";
+}
+
+bool same_tokens( const std::vector< legacy::Token >& a, const TokenStream& b ) {
+	if ( a.size() != b.size() )
+		return false;
+
+	for ( size_t i = 0; i < a.size(); ++i ) {
+		auto token = b.get( i );
+
+		if ( a[ i ].token_type != token.token_type || a[ i ].token_string != b.text( token ) )
+			return false;
+	}
+
+	return true;
+}
+
+size_t token_memory( const std::vector< legacy::Token >& tokens ) {
+	auto bytes = tokens.capacity() * sizeof( legacy::Token );
+
+	for ( auto& token : tokens ) {
+		if ( token.token_string.capacity() > 15 )
+			bytes += token.token_string.capacity() + 1;
+	}
+
+	return bytes;
+}
+
+size_t token_memory( const TokenStream& tokens ) {
+	return tokens.types.capacity() * sizeof( uint8_t )
+		+ tokens.offsets.capacity() * sizeof( uint32_t )
+		+ tokens.lengths.capacity() * sizeof( uint32_t );
+}
+
+// bench lexer [legacy size KB] [size KB]
+int bench_lexer( const std::vector< std::string >& args ) {
+	size_t legacy_size = ( args.size() > 0 ? std::stoul( args[ 0 ] ) : 32 ) * 1024;
+	size_t size = ( args.size() > 1 ? std::stoul( args[ 1 ] ) : 8192 ) * 1024;
+
+	auto legacy_script = generate_script( legacy_size );
+	auto script = generate_script( size );
+
+	std::vector< legacy::Token > legacy_tokens;
+	TokenStream tokens;
+
+	auto legacy_ms = measure_ms( [ & ]() { legacy_tokens = legacy::tokenize( legacy_script ); } );
+	auto small_ms = measure_ms( [ & ]() { tokens = tokenize( legacy_script ); } );
+
+	if ( !same_tokens( legacy_tokens, tokens ) ) {
+		std::cout << "Token streams differ" << std::endl;
+		return 1;
+	}
+
+	auto legacy_memory = token_memory( legacy_tokens );
+	auto memory = token_memory( tokens );
+
+	auto large_ms = measure_ms( [ & ]() { tokens = tokenize( script ); } );
+
+	print_throughput( "regex lexer", legacy_script.length(), legacy_ms );
+	print_throughput( "table lexer", legacy_script.length(), small_ms );
+	print_throughput( "table lexer", script.length(), large_ms );
+
+	std::cout << "token memory: " << legacy_memory << " bytes (regex lexer), " << memory << " bytes (table lexer), "
+		<< std::fixed << std::setprecision( 1 ) << ( double ) legacy_memory / memory << "x less" << std::endl;
+	return 0;
+}
+
+// bench keywords [word count]
+int bench_keywords( const std::vector< std::string >& args ) {
+	size_t word_count = args.size() > 0 ? std::stoul( args[ 0 ] ) : 1000000;
+
+	// Identifier heavy input, mostly plain identifiers with keywords mixed in
+	const char* samples[] = { "counter", "x_12", "Const", "value", "Fn", "index_of_item", "End", "a", "Return", "Elsewhere", "While", "tmp" };
+
+	std::string source;
+	std::vector< std::pair< size_t, size_t > > ranges;
+
+	for ( size_t i = 0; i < word_count; ++i ) {
+		std::string word = samples[ ( i * 7 ) % ( sizeof( samples ) / sizeof( samples[ 0 ] ) ) ];
+		ranges.emplace_back( source.length(), word.length() );
+		source += word + " ";
+	}
+
+	std::vector< std::string_view > words;
+	for ( auto& range : ranges ) {
+		words.push_back( std::string_view( source ).substr( range.first, range.second ) );
+	}
+
+	size_t legacy_hits = 0;
+	size_t hits = 0;
+
+	auto legacy_ms = measure_ms( [ & ]() {
+		for ( auto& word : words ) {
+			if ( legacy::keyword_list.find( std::string( word ) ) != legacy::keyword_list.end() )
+				++legacy_hits;
+		}
+	} );
+
+	auto hash_ms = measure_ms( [ & ]() {
+		for ( auto& word : words ) {
+			if ( find_keyword( word ) )
+				++hits;
+		}
+	} );
+
+	if ( legacy_hits != hits ) {
+		std::cout << "Keyword lookups differ" << std::endl;
+		return 1;
+	}
+
+	std::cout << std::fixed << std::setprecision( 2 );
+	std::cout << "unordered_map lookup: " << legacy_ms << " ms (" << legacy_ms * 1e6 / word_count << " ns/word)" << std::endl;
+	std::cout << "perfect hash lookup:  " << hash_ms << " ms (" << hash_ms * 1e6 / word_count << " ns/word)" << std::endl;
+	std::cout << "keywords found: " << hits << " of " << word_count << std::endl;
+
+	auto lexer_ms = measure_ms( [ & ]() { tokenize( source ); } );
+	print_throughput( "table lexer (identifiers)", source.length(), lexer_ms );
+	return 0;
+}
+
+// Deeply nested script indented with spaces and using long identifiers
+std::string generate_indented_script( size_t target_size ) {
+	std::string script;
+	int function_count = 0;
+
+	while ( script.length() < target_size ) {
+		script += "Fn Function_with_a_rather_long_name_" + std::to_string( function_count ) + " first_argument, second_argument:\n";
+		script += "    Any accumulated_value_for_iteration = first_argument * 1000.125;\n";
+
+		const int depth = 12;
+		for ( int level = 1; level <= depth; ++level ) {
+			auto indent = std::string( level * 4, ' ' );
+			script += indent + "If accumulated_value_for_iteration > " + std::to_string( level * 100 ) + " Then\n";
+			script += indent + "    accumulated_value_for_iteration = accumulated_value_for_iteration - second_argument / 3.14159265;\n";
+		}
+
+		for ( int level = depth; level >= 1; --level ) {
+			script += std::string( level * 4, ' ' ) + "End If\n";
+		}
+
+		script += "    Return accumulated_value_for_iteration;\n";
+		script += "End Fn\n\n";
+		++function_count;
+	}
+
+	script += "Fn Main:\n    Return 0;\nEnd Fn\n";
+	return script;
+}
+
+// bench scan [size KB]
+int bench_scan( const std::vector< std::string >& args ) {
+	size_t size = ( args.size() > 0 ? std::stoul( args[ 0 ] ) : 16384 ) * 1024;
+	auto script = generate_indented_script( size );
+
+	const SimdLevel levels[] = { SimdLevel::simd_none, SimdLevel::simd_sse2, SimdLevel::simd_avx2 };
+	const char* names[] = { "scalar scan", "sse2 scan", "avx2 scan" };
+
+	auto supported = simd_detect();
+	TokenStream reference;
+
+	for ( auto level : levels ) {
+		if ( level > supported ) {
+			std::cout << names[ level ] << ": not supported by this CPU" << std::endl;
+			continue;
+		}
+
+		set_scan_simd_level( level );
+
+		TokenStream tokens;
+		auto ms = best_of_ms( 5, [ & ]() { tokens = tokenize( script ); } );
+
+		if ( level == SimdLevel::simd_none ) {
+			reference = tokens;
+		} else if ( tokens.types != reference.types || tokens.offsets != reference.offsets || tokens.lengths != reference.lengths ) {
+			std::cout << names[ level ] << ": token stream differs from the scalar scan" << std::endl;
+			return 1;
+		}
+
+		print_throughput( names[ level ], script.length(), ms );
+	}
+
+	set_scan_simd_level( supported );
+	return 0;
+}
+
+// bench parse [size KB]
+int bench_parse( const std::vector< std::string >& args ) {
+	size_t size = ( args.size() > 0 ? std::stoul( args[ 0 ] ) : 2048 ) * 1024;
+	auto script = generate_script( size );
+
+	Program batch_program;
+	Program streaming_program;
+	size_t batch_memory = 0;
+
+	auto batch_ms = best_of_ms( 3, [ & ]() {
+		auto tokens = tokenize( script );
+		batch_memory = token_memory( tokens );
+
+		batch_program = Program();
+		parse( tokens, &batch_program );
+	} );
+
+	auto streaming_ms = best_of_ms( 3, [ & ]() {
+		streaming_program = Program();
+		parse( std::string_view( script ), &streaming_program );
+	} );
+
+	if ( batch_program.functions.size() != streaming_program.functions.size() ) {
+		std::cout << "Programs differ" << std::endl;
+		return 1;
+	}
+
+	for ( size_t i = 0; i < batch_program.functions.size(); ++i ) {
+		if ( batch_program.functions[ i ].code != streaming_program.functions[ i ].code ) {
+			std::cout << "Programs differ" << std::endl;
+			return 1;
+		}
+	}
+
+	print_throughput( "tokenize + parse", script.length(), batch_ms );
+	print_throughput( "streaming parse", script.length(), streaming_ms );
+	std::cout << "token memory: " << batch_memory << " bytes (tokenize), "
+		<< sizeof( Token ) * 4 << " bytes (streaming window)" << std::endl;
+	return 0;
+}
+
+// Generates 'function_count' chained functions and a Main with 'local_count' locals
+std::string generate_scope_script( int local_count, int function_count ) {
+	std::string script;
+
+	for ( int i = 0; i < function_count; ++i ) {
+		script += "Fn F_" + std::to_string( i ) + " a:\n";
+
+		if ( i > 0 ) {
+			script += "\tReturn F_" + std::to_string( i - 1 ) + "( a ) + 1;\n";
+		} else {
+			script += "\tReturn a;\n";
+		}
+
+		script += "End Fn\n";
+	}
+
+	script += "Fn Main:\n\tConst l_0 = 0;\n";
+
+	for ( int i = 1; i < local_count; ++i ) {
+		script += "\tConst l_" + std::to_string( i ) + " = l_" + std::to_string( i - 1 ) + " + F_" + std::to_string( i % function_count ) + "( 1 );\n";
+	}
+
+	script += "\tReturn l_" + std::to_string( local_count - 1 ) + ";\nEnd Fn\n";
+	return script;
+}
+
+// bench scopes [locals] [functions]
+int bench_scopes( const std::vector< std::string >& args ) {
+	int local_count = args.size() > 0 ? std::stoi( args[ 0 ] ) : 10000;
+	int function_count = args.size() > 1 ? std::stoi( args[ 1 ] ) : 1000;
+
+	// Doubling the input should roughly double the compile time
+	for ( int scale = 1; scale <= 4; scale *= 2 ) {
+		auto script = generate_scope_script( local_count * scale, function_count * scale );
+		auto tokens = tokenize( script );
+
+		auto ms = best_of_ms( 3, [ & ]() {
+			Program program;
+			parse( tokens, &program );
+		} );
+
+		auto label = std::to_string( local_count * scale ) + " locals, " + std::to_string( function_count * scale ) + " functions";
+		print_throughput( label, script.length(), ms );
+	}
+
+	return 0;
+}
+
+// Instructions dispatched per iteration of the first loop in 'fn', its body must be straight-line code
+size_t loop_dispatches( const Function& fn ) {
+	std::vector< size_t > offsets;
+
+	for ( size_t offset = 0; offset < fn.code.size(); offset += opcode_length( fn.code[ offset ] ) ) {
+		offsets.push_back( offset );
+
+		if ( fn.code[ offset ] != OpCode::op_jmp ) {
+			continue;
+		}
+
+		encoded_value value;
+		value.data.uint32[ 0 ] = fn.code[ offset + 1 ];
+
+		if ( value.data.int32[ 0 ] < 0 ) {
+			auto target = offset + 2 + value.data.int32[ 0 ];
+			return offsets.end() - std::find( offsets.begin(), offsets.end(), target );
+		}
+	}
+
+	return 0;
+}
+
+// bench dispatch [iterations]
+int bench_dispatch( const std::vector< std::string >& args ) {
+	auto iterations = args.size() > 0 ? std::stoi( args[ 0 ] ) : 10000000;
+
+	Program plain_program;
+	parse( std::string_view( loop_source( iterations ) ), &plain_program );
+
+	for ( auto& fn : plain_program.functions ) {
+		peephole_optimize( &fn );
+	}
+
+	auto fused_program = plain_program;
+
+	for ( auto& fn : fused_program.functions ) {
+		fuse_superinstructions( &fn );
+	}
+
+	double plain_result = 0.0;
+	double fused_result = 0.0;
+
+	auto plain_ms = best_run_ms( 3, plain_program, RunOptions(), &plain_result );
+	auto fused_ms = best_run_ms( 3, fused_program, RunOptions(), &fused_result );
+
+	if ( plain_result != fused_result ) {
+		std::cout << "Results differ" << std::endl;
+		return 1;
+	}
+
+	std::cout << std::fixed << std::setprecision( 2 )
+		<< "plain: " << loop_dispatches( plain_program.functions[ plain_program.main ] ) << " dispatches/iteration, " << plain_ms << " ms" << std::endl
+		<< "fused: " << loop_dispatches( fused_program.functions[ fused_program.main ] ) << " dispatches/iteration, " << fused_ms << " ms" << std::endl;
+	return 0;
+}
+
+// Instructions dispatched per iteration of the first loop of register code, its body must be straight-line code
+size_t register_loop_dispatches( const RegisterFunction& fn ) {
+	std::vector< size_t > offsets;
+
+	for ( size_t offset = 0; offset < fn.code.size(); offset += register_opcode_length( fn.code[ offset ] ) ) {
+		offsets.push_back( offset );
+
+		if ( fn.code[ offset ] != RegisterOpCode::rop_jmp ) {
+			continue;
+		}
+
+		encoded_value value;
+		value.data.uint32[ 0 ] = fn.code[ offset + 1 ];
+
+		if ( value.data.int32[ 0 ] < 0 ) {
+			auto target = offset + 2 + value.data.int32[ 0 ];
+			return offsets.end() - std::find( offsets.begin(), offsets.end(), target );
+		}
+	}
+
+	return 0;
+}
+
+template < typename LengthFn >
+size_t instruction_count( const std::vector< uint32_t >& code, LengthFn length ) {
+	size_t count = 0;
+
+	for ( size_t offset = 0; offset < code.size(); offset += length( code[ offset ] ) ) {
+		++count;
+	}
+
+	return count;
+}
+
+// bench registers [loop iterations] [fib n]
+int bench_registers( const std::vector< std::string >& args ) {
+	auto iterations = args.size() > 0 ? std::stoi( args[ 0 ] ) : 10000000;
+	auto fib_n = args.size() > 1 ? std::stoi( args[ 1 ] ) : 27;
+
+	const Script scripts[] = {
+		{ "loop", loop_source( iterations ) },
+		{ "fib", fib_source( fib_n ) },
+	};
+
+	for ( auto& script : scripts ) {
+		auto program = compile_script( script.source );
+		auto register_program = compile_registers( program );
+
+		size_t stack_instructions = 0;
+		size_t register_instructions = 0;
+
+		for ( size_t i = 0; i < program.functions.size(); ++i ) {
+			stack_instructions += instruction_count( program.functions[ i ].code, opcode_length );
+			register_instructions += instruction_count( register_program.functions[ i ].code, register_opcode_length );
+		}
+
+		double stack_result = 0.0;
+		double register_result = 0.0;
+
+		auto stack_ms = best_run_ms( 3, program, RunOptions(), &stack_result );
+		auto register_ms = best_of_ms( 3, [ & ]() { register_result = run_registers( register_program ); } );
+
+		if ( stack_result != register_result ) {
+			std::cout << script.name << ": results differ" << std::endl;
+			return 1;
+		}
+
+		auto stack_loop = loop_dispatches( program.functions[ program.main ] );
+		auto register_loop = register_loop_dispatches( register_program.functions[ register_program.main ] );
+
+		std::cout << std::fixed << std::setprecision( 2 )
+			<< script.name << " stack:    " << stack_instructions << " instructions, " << stack_ms << " ms";
+
+		if ( stack_loop > 0 ) {
+			std::cout << ", " << stack_loop << " dispatches/iteration";
+		}
+
+		std::cout << std::endl
+			<< script.name << " register: " << register_instructions << " instructions, " << register_ms << " ms";
+
+		if ( register_loop > 0 ) {
+			std::cout << ", " << register_loop << " dispatches/iteration";
+		}
+
+		std::cout << std::endl;
+	}
+
+	return 0;
+}
+
+// bench threaded [loop iterations]
+int bench_threaded( const std::vector< std::string >& args ) {
+	auto iterations = args.size() > 0 ? std::stoi( args[ 0 ] ) : 10000000;
+	auto outer = std::to_string( std::max( 1, iterations / 1000 ) );
+
+	if ( !has_threaded_dispatch() ) {
+		std::cout << "Built without threaded dispatch, both runs use the switch loop" << std::endl;
+	}
+
+	const Script scripts[] = {
+		{ "loop", loop_source( iterations ) },
+		{ "nested",
+			"Fn Main:\n"
+			"\tAny i = 0;\n"
+			"\tAny sum = 0;\n"
+			"\tWhile i < " + outer + " Then\n"
+			"\t\tAny j = 0;\n"
+			"\t\tWhile j < 1000 Then\n"
+			"\t\t\tIf j > i Then\n"
+			"\t\t\t\tsum = sum + j;\n"
+			"\t\t\tEnd If\n"
+			"\t\t\tj = j + 1;\n"
+			"\t\tEnd While\n"
+			"\t\ti = i + 1;\n"
+			"\tEnd While\n"
+			"\tReturn sum;\n"
+			"End Fn\n" },
+	};
+
+	for ( auto& script : scripts ) {
+		auto program = compile_script( script.source );
+
+		RunOptions threaded_options;
+		threaded_options.dispatch = DispatchMode::dispatch_threaded;
+
+		double switch_result = 0.0;
+		double threaded_result = 0.0;
+
+		auto switch_ms = best_run_ms( 3, program, RunOptions(), &switch_result );
+		auto threaded_ms = best_run_ms( 3, program, threaded_options, &threaded_result );
+
+		if ( switch_result != threaded_result ) {
+			std::cout << script.name << ": results differ" << std::endl;
+			return 1;
+		}
+
+		std::cout << std::fixed << std::setprecision( 2 )
+			<< script.name << " switch:   " << switch_ms << " ms" << std::endl
+			<< script.name << " threaded: " << threaded_ms << " ms (" << switch_ms / threaded_ms << "x)" << std::endl;
+	}
+
+	return 0;
+}
+
+// bench verify [loop iterations]
+int bench_verify( const std::vector< std::string >& args ) {
+	auto iterations = args.size() > 0 ? std::stoi( args[ 0 ] ) : 10000000;
+	auto program = compile_script( loop_source( iterations ) );
+
+	RunOptions checked_options;
+	checked_options.dispatch = DispatchMode::dispatch_switch;
+	checked_options.verify = false;
+
+	RunOptions verified_options;
+	verified_options.dispatch = DispatchMode::dispatch_switch;
+
+	double checked_result = 0.0;
+	double verified_result = 0.0;
+
+	auto verify_ms = best_of_ms( 3, [ & ]() { verify_program( program ); } );
+	auto checked_ms = best_run_ms( 3, program, checked_options, &checked_result );
+	auto verified_ms = best_run_ms( 3, program, verified_options, &verified_result );
+
+	if ( checked_result != verified_result ) {
+		std::cout << "Results differ" << std::endl;
+		return 1;
+	}
+
+	std::cout << std::fixed << std::setprecision( 2 )
+		<< "verifier:  " << verify_ms << " ms" << std::endl
+		<< "checked:   " << checked_ms << " ms" << std::endl
+		<< "verified:  " << verified_ms << " ms (" << checked_ms / verified_ms << "x)" << std::endl;
+	return 0;
+}
+
+// Calls made by Ack( m, n ), counting the outer one
+double ackermann_calls( int m, int n, int* result ) {
+	if ( m == 0 ) {
+		*result = n + 1;
+		return 1;
+	}
+
+	if ( n == 0 ) {
+		return 1 + ackermann_calls( m - 1, 1, result );
+	}
+
+	int inner = 0;
+	auto calls = 1 + ackermann_calls( m, n - 1, &inner );
+	return calls + ackermann_calls( m - 1, inner, result );
+}
+
+// bench calls [fib n] [ackermann n] [ackermann repeats]
+int bench_calls( const std::vector< std::string >& args ) {
+	auto fib_n = args.size() > 0 ? std::stoi( args[ 0 ] ) : 27;
+	auto ack_n = args.size() > 1 ? std::stoi( args[ 1 ] ) : 20;
+	auto ack_repeats = args.size() > 2 ? std::stoi( args[ 2 ] ) : 2000;
+
+	// Calls( n ) = 1 + Calls( n - 1 ) + Calls( n - 2 ), one call each for n < 2
+	double fib_calls = 1.0;
+
+	for ( double previous = 1.0, i = 2; i <= fib_n; ++i ) {
+		auto calls = 1.0 + fib_calls + previous;
+		previous = fib_calls;
+		fib_calls = calls;
+	}
+
+	int ack_result = 0;
+	auto ack_calls = ackermann_calls( 2, ack_n, &ack_result ) * ack_repeats;
+
+	const Script scripts[] = {
+		{ "fib", fib_source( fib_n ) },
+		{ "ackermann",
+			"Fn Ack m, n:\n"
+			"\tIf m == 0 Then\n"
+			"\t\tReturn n + 1;\n"
+			"\tEnd If\n"
+			"\tIf n == 0 Then\n"
+			"\t\tReturn Ack( m - 1, 1 );\n"
+			"\tEnd If\n"
+			"\tReturn Ack( m - 1, Ack( m, n - 1 ) );\n"
+			"End Fn\n"
+			"Fn Main:\n"
+			"\tAny i = 0;\n"
+			"\tAny sum = 0;\n"
+			"\tWhile i < " + std::to_string( ack_repeats ) + " Then\n"
+			"\t\tsum = sum + Ack( 2, " + std::to_string( ack_n ) + " );\n"
+			"\t\ti = i + 1;\n"
+			"\tEnd While\n"
+			"\tReturn sum;\n"
+			"End Fn\n" },
+	};
+
+	const double calls[] = { fib_calls, ack_calls };
+
+	for ( size_t i = 0; i < sizeof( scripts ) / sizeof( scripts[ 0 ] ); ++i ) {
+		auto& script = scripts[ i ];
+		auto program = compile_script( script.source );
+
+		for ( int use_arena = 0; use_arena <= 1; ++use_arena ) {
+			RunOptions options;
+			options.code_arena = use_arena == 1;
+
+			double result = 0.0;
+			auto ms = best_run_ms( 3, program, options, &result );
+
+			std::cout << std::fixed << std::setprecision( 2 )
+				<< script.name << ( use_arena ? " (arena): " : ": " ) << result << ", " << calls[ i ] << " calls, " << ms << " ms, "
+				<< calls[ i ] / ms / 1000.0 << " M calls/s" << std::endl;
+		}
+	}
+
+	return 0;
+}
+
+// bench tail [sum n]
+int bench_tail( const std::vector< std::string >& args ) {
+	auto sum_n = args.size() > 0 ? std::stoi( args[ 0 ] ) : 100000;
+
+	struct TailScript {
+		Script			script;
+		double			expected;
+	};
+
+	const TailScript scripts[] = {
+		{ { "sum",
+			"Fn Sum n, acc:\n"
+			"\tIf n == 0 Then\n"
+			"\t\tReturn acc;\n"
+			"\tEnd If\n"
+			"\tReturn Sum( n - 1, acc + n );\n"
+			"End Fn\n"
+			"Fn Main:\n"
+			"\tReturn Sum( " + std::to_string( sum_n ) + ", 0 );\n"
+			"End Fn\n" }, ( double ) sum_n * ( sum_n + 1 ) / 2 },
+		// The call in the dropped If body must not become the tail call of the Return after it
+		{ { "dropped call",
+			"Fn G:\n"
+			"\tReturn 7;\n"
+			"End Fn\n"
+			"Fn F a:\n"
+			"\tIf 0 Then\n"
+			"\t\tG();\n"
+			"\tEnd If\n"
+			"\tReturn 5;\n"
+			"End Fn\n"
+			"Fn Main:\n"
+			"\tReturn F( 1 );\n"
+			"End Fn\n" }, 5.0 },
+	};
+
+	// Tail calls reuse the frame, so a handful of frames is enough for any depth of recursion
+	RunOptions options;
+	options.max_call_depth = 8;
+
+	for ( auto& tail_script : scripts ) {
+		auto& script = tail_script.script;
+
+		for ( int dispatch = 0; dispatch <= 1; ++dispatch ) {
+			options.dispatch = dispatch == 0 ? DispatchMode::dispatch_switch : DispatchMode::dispatch_threaded;
+
+			double result = 0.0;
+			double ms = 0.0;
+
+			try {
+				auto compiled = compile_program( compile_script( script.source ), options );
+				VMInstance instance( options );
+
+				ms = best_of_ms( 3, [ & ]() { result = instance.run( *compiled ); } );
+			} catch ( const std::exception& err ) {
+				std::cout << script.name << ": " << err.what() << std::endl;
+				return 1;
+			}
+
+			if ( result != tail_script.expected ) {
+				std::cout << script.name << ": returned " << result << ", expected " << tail_script.expected << std::endl;
+				return 1;
+			}
+
+			std::cout << std::fixed << std::setprecision( 2 )
+				<< script.name << ( dispatch == 0 ? " (switch): " : " (threaded): " ) << result << ", " << ms << " ms" << std::endl;
+		}
+
+		// Register frames are reused the same way, the recursion stays within the first two frames
+		double register_result = 0.0;
+
+		try {
+			register_result = run_registers( compile_registers( compile_script( script.source ) ), 1024 );
+		} catch ( const std::exception& err ) {
+			std::cout << script.name << " (register): " << err.what() << std::endl;
+			return 1;
+		}
+
+		if ( register_result != tail_script.expected ) {
+			std::cout << script.name << " (register): returned " << register_result << ", expected " << tail_script.expected << std::endl;
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+// bench threads [evaluations per thread] [loop iterations]
+int bench_threads( const std::vector< std::string >& args ) {
+	auto evaluations = args.size() > 0 ? std::stoi( args[ 0 ] ) : 200;
+	auto iterations = args.size() > 1 ? args[ 1 ] : std::string( "20000" );
+
+	std::string script =
+		"Fn Step x, i:\n"
+		"\tReturn x + i * 2;\n"
+		"End Fn\n"
+		"Fn Main:\n"
+		"\tAny i = 0;\n"
+		"\tAny sum = 0;\n"
+		"\tWhile i < " + iterations + " Then\n"
+		"\t\tsum = Step( sum, i );\n"
+		"\t\ti = i + 1;\n"
+		"\tEnd While\n"
+		"\tReturn sum;\n"
+		"End Fn\n";
+
+	// Compiled once, every thread runs the same instance on its own VM
+	auto compiled = compile_program( compile_script( script ) );
+
+	std::vector< int > thread_counts;
+	int max_threads = std::max( 1, ( int ) std::thread::hardware_concurrency() );
+
+	for ( int threads = 1; threads < max_threads; threads *= 2 ) {
+		thread_counts.push_back( threads );
+	}
+
+	thread_counts.push_back( max_threads );
+
+	double single_rate = 0.0;
+
+	for ( auto thread_count : thread_counts ) {
+		std::vector< double > results( thread_count, 0.0 );
+
+		auto ms = best_of_ms( 3, [ & ]() {
+			std::vector< std::thread > threads;
+
+			for ( int t = 0; t < thread_count; ++t ) {
+				threads.emplace_back( [ &, t ]() {
+					VMInstance instance;
+
+					for ( int i = 0; i < evaluations; ++i ) {
+						results[ t ] = instance.run( *compiled );
+					}
+				} );
+			}
+
+			for ( auto& thread : threads ) {
+				thread.join();
+			}
+		} );
+
+		if ( std::count( results.begin(), results.end(), results[ 0 ] ) != thread_count ) {
+			std::cout << "Results differ" << std::endl;
+			return 1;
+		}
+
+		auto rate = thread_count * evaluations / ( ms / 1000.0 );
+
+		if ( thread_count == 1 ) {
+			single_rate = rate;
+		}
+
+		std::cout << std::fixed << std::setprecision( 2 )
+			<< std::setw( 3 ) << thread_count << " threads: " << ms << " ms, " << rate << " runs/s ("
+			<< rate / single_rate << "x)" << std::endl;
+	}
+
+	return 0;
+}
+
+// bench batch [lanes K]
+int bench_batch( const std::vector< std::string >& args ) {
+	size_t lane_count = ( args.size() > 0 ? std::stoul( args[ 0 ] ) : 1024 ) * 1024;
+
+	// Straight line code keeps every lane together, the orbit loop runs a different trip count per lane
+	const Script scripts[] = {
+		{ "Poly",
+			"Fn Poly x, y:\n"
+			"\tAny a = x * x - y * 3 + 1;\n"
+			"\tAny b = a * 0.5 + x / y;\n"
+			"\tAny c = ( a > b ) * a + ( a < b ) * b;\n"
+			"\tReturn c * c - a * b + 2;\n"
+			"End Fn\n"
+			"Fn Main:\n"
+			"\tReturn Poly( 1, 2 );\n"
+			"End Fn\n" },
+		{ "Orbit",
+			"Fn Orbit x, y:\n"
+			"\tAny i = 0;\n"
+			"\tAny a = x;\n"
+			"\tWhile a < y Then\n"
+			"\t\ta = a * 1.5 + 1;\n"
+			"\t\ti = i + 1;\n"
+			"\tEnd While\n"
+			"\tIf a > 100 Then\n"
+			"\t\ta = a / 2;\n"
+			"\tEnd If\n"
+			"\tReturn a + i;\n"
+			"End Fn\n"
+			"Fn Main:\n"
+			"\tReturn Orbit( 1, 2 );\n"
+			"End Fn\n" },
+	};
+
+	// Struct of arrays, x in [1, 2) and y in [10, 1000)
+	std::vector< double > arguments( lane_count * 2 );
+	uint32_t seed = 12345;
+
+	for ( size_t i = 0; i < lane_count; ++i ) {
+		seed = seed * 1664525 + 1013904223;
+		arguments[ i ] = 1.0 + ( seed >> 8 ) / 16777216.0;
+		seed = seed * 1664525 + 1013904223;
+		arguments[ lane_count + i ] = 10.0 + 990.0 * ( ( seed >> 8 ) / 16777216.0 );
+	}
+
+	const SimdLevel levels[] = { SimdLevel::simd_none, SimdLevel::simd_sse2, SimdLevel::simd_avx2 };
+	const char* names[] = { "scalar lanes", "sse2 lanes", "avx2 lanes" };
+	auto supported = simd_detect();
+
+	for ( auto& script : scripts ) {
+		auto compiled = compile_program( compile_script( script.source ) );
+		int function_index = 0;
+
+		while ( symbol_name( compiled->program.functions[ function_index ].name ) != script.name ) {
+			++function_index;
+		}
+
+		// One interpreter call per parameter set is the baseline
+		std::vector< double > expected( lane_count );
+		VMInstance instance;
+
+		auto call_ms = best_of_ms( 3, [ & ]() {
+			double lane_arguments[ 2 ];
+
+			for ( size_t i = 0; i < lane_count; ++i ) {
+				lane_arguments[ 0 ] = arguments[ i ];
+				lane_arguments[ 1 ] = arguments[ lane_count + i ];
+				expected[ i ] = instance.call( *compiled, function_index, lane_arguments );
+			}
+		} );
+
+		std::cout << std::fixed << std::setprecision( 2 )
+			<< script.name << " " << std::left << std::setw( 15 ) << "calls:" << std::right << call_ms << " ms" << std::endl;
+
+		auto batch = compile_batch( *compiled, function_index );
+		std::vector< double > results( lane_count );
+
+		for ( auto level : levels ) {
+			if ( level > supported ) {
+				std::cout << script.name << " " << names[ level ] << ": not supported by this CPU" << std::endl;
+				continue;
+			}
+
+			set_batch_simd_level( level );
+
+			BatchStats stats;
+			auto ms = best_of_ms( 3, [ & ]() { stats = run_batch( batch, arguments.data(), lane_count, results.data() ); } );
+
+			if ( results != expected ) {
+				std::cout << script.name << " " << names[ level ] << ": results differ from the interpreter" << std::endl;
+				return 1;
+			}
+
+			std::cout << std::fixed << std::setprecision( 2 )
+				<< script.name << " " << std::left << std::setw( 15 ) << ( std::string( names[ level ] ) + ":" ) << std::right << ms << " ms ("
+				<< call_ms / ms << "x), " << ( double ) stats.lane_ops / stats.dispatches << " lanes/dispatch, "
+				<< std::setprecision( 3 ) << ms * 1e6 / stats.lane_ops << " ns/lane-op" << std::endl;
+		}
+
+		set_batch_simd_level( supported );
+	}
+
+	return 0;
+}
+
+// bench memo [fib n] [choose n]
+int bench_memo( const std::vector< std::string >& args ) {
+	auto fib_n = args.size() > 0 ? std::stoi( args[ 0 ] ) : 27;
+	auto choose_n = args.size() > 1 ? std::stoi( args[ 1 ] ) : 24;
+
+	const Script scripts[] = {
+		{ "fib", fib_source( fib_n ) },
+		{ "choose",
+			"Fn Choose n, k:\n"
+			"\tIf k == 0 Then\n"
+			"\t\tReturn 1;\n"
+			"\tEnd If\n"
+			"\tIf k == n Then\n"
+			"\t\tReturn 1;\n"
+			"\tEnd If\n"
+			"\tReturn Choose( n - 1, k - 1 ) + Choose( n - 1, k );\n"
+			"End Fn\n"
+			"Fn Main:\n"
+			"\tReturn Choose( " + std::to_string( choose_n ) + ", " + std::to_string( choose_n / 2 ) + " );\n"
+			"End Fn\n" },
+	};
+
+	// Choose( 24, 12 ) reaches more distinct calls than the small caches hold
+	const uint32_t capacities[] = { 0, 8, 64, 4096 };
+
+	for ( auto& script : scripts ) {
+		auto program = compile_script( script.source );
+
+		double baseline_ms = 0.0;
+		double baseline_result = 0.0;
+
+		for ( auto capacity : capacities ) {
+			RunOptions options;
+			options.memo_capacity = capacity;
+
+			auto compiled = compile_program( program, options );
+			double result = 0.0;
+			MemoStats stats = { 0, 0, 0 };
+
+			// A fresh instance each run, the caches would otherwise answer everything from the previous one
+			auto ms = best_of_ms( 3, [ & ]() {
+				VMInstance instance( options );
+				result = instance.run( *compiled );
+
+				stats = MemoStats{ 0, 0, 0 };
+
+				for ( auto& function : compiled->program.functions ) {
+					auto function_stats = instance.memo_stats( function.index );
+					stats.hits += function_stats.hits;
+					stats.misses += function_stats.misses;
+					stats.evictions += function_stats.evictions;
+				}
+			} );
+
+			if ( capacity == 0 ) {
+				baseline_ms = ms;
+				baseline_result = result;
+			} else if ( result != baseline_result ) {
+				std::cout << script.name << ": memoized result differs" << std::endl;
+				return 1;
+			}
+
+			auto label = capacity == 0 ? std::string( "no memo:" ) : "memo " + std::to_string( capacity ) + ":";
+
+			std::cout << std::fixed << std::setprecision( 3 ) << script.name << " " << std::left << std::setw( 11 ) << label << std::right << ms << " ms (" << std::setprecision( 1 ) << baseline_ms / ms << "x), "
+				<< stats.hits << " hits, " << stats.misses << " misses, " << stats.evictions << " evictions" << std::endl;
+		}
+	}
+
+	return 0;
+}
+
+// bench profile [fib n]
+int bench_profile( const std::vector< std::string >& args ) {
+	auto fib_n = args.size() > 0 ? std::stoi( args[ 0 ] ) : 27;
+
+	const Script scripts[] = {
+		{ "fib", fib_source( fib_n ) },
+		{ "loop", loop_source( 1000000 ) },
+	};
+
+	struct Mode {
+		const char*		name;
+		DispatchMode	dispatch;
+		bool			profile;
+	};
+
+	// The switch loop without profiling is the same loop the profiled build is instantiated from
+	const Mode modes[] = {
+		{ "threaded:", DispatchMode::dispatch_threaded, false },
+		{ "switch:", DispatchMode::dispatch_switch, false },
+		{ "profiled:", DispatchMode::dispatch_switch, true },
+	};
+
+	for ( auto& script : scripts ) {
+		auto program = compile_script( script.source );
+
+		double switch_ms = 0.0;
+		double expected = 0.0;
+
+		for ( auto& mode : modes ) {
+			RunOptions options;
+			options.dispatch = mode.dispatch;
+			options.profile = mode.profile;
+
+			auto compiled = compile_program( program, options );
+			double result = 0.0;
+			uint64_t dispatches = 0;
+
+			auto ms = best_of_ms( 3, [ & ]() {
+				VMInstance instance( options );
+				result = instance.run( *compiled );
+
+				if ( mode.profile ) {
+					dispatches = 0;
+
+					for ( auto count : instance.profile().opcode_counts ) {
+						dispatches += count;
+					}
+				}
+			} );
+
+			if ( &mode == &modes[ 0 ] ) {
+				expected = result;
+			} else if ( result != expected ) {
+				std::cout << script.name << " " << mode.name << " result differs" << std::endl;
+				return 1;
+			}
+
+			if ( !mode.profile ) {
+				switch_ms = ms;
+			}
+
+			std::cout << std::fixed << std::setprecision( 2 ) << script.name << " " << std::left << std::setw( 11 ) << mode.name << std::right << ms << " ms";
+
+			if ( mode.profile ) {
+				std::cout << " (" << ms / switch_ms << "x switch), " << dispatches << " instructions counted";
+			}
+
+			std::cout << std::endl;
+		}
+	}
+
+	return 0;
+}
+
+// bench schedule [tasks] [budget]
+int bench_schedule( const std::vector< std::string >& args ) {
+	auto task_count = args.size() > 0 ? std::stoi( args[ 0 ] ) : 1000;
+	uint64_t budget = args.size() > 1 ? std::stoull( args[ 1 ] ) : 1000;
+	const int long_iterations = 2000000;
+
+	const Script scripts[] = {
+		{ "short", fib_source( 12 ) },
+		{ "long", loop_source( long_iterations ) },
+		{ "runaway",
+			"Fn Main:\n"
+			"\tAny i = 0;\n"
+			"\tWhile 1 Then\n"
+			"\t\ti = i + 1;\n"
+			"\tEnd While\n"
+			"\tReturn i;\n"
+			"End Fn\n" },
+	};
+
+	const int kind_count = sizeof( scripts ) / sizeof( scripts[ 0 ] );
+
+	// Budgeted runs always take the switch loop, so that is the baseline for the cost of the checks
+	RunOptions options;
+	options.dispatch = DispatchMode::dispatch_switch;
+	options.stack_size = 1 << 12;
+	options.max_call_depth = 64;
+
+	std::vector< std::shared_ptr< const CompiledProgram > > compiled;
+
+	for ( auto& script : scripts ) {
+		compiled.push_back( compile_program( compile_script( script.source ), options ) );
+	}
+
+	{
+		auto& program = *compiled[ 1 ];
+		VMInstance instance( options );
+		double expected = 0.0;
+		double result = 0.0;
+		uint64_t slices = 0;
+
+		auto run_ms = best_of_ms( 3, [ & ]() { expected = instance.run( program ); } );
+		auto unlimited_ms = best_of_ms( 3, [ & ]() { instance.start( program, UINT64_MAX, &result ); } );
+
+		auto sliced_ms = best_of_ms( 3, [ & ]() {
+			auto status = instance.start( program, budget, &result );
+
+			for ( slices = 1; status == RunStatus::run_suspended; ++slices ) {
+				status = instance.resume( budget, &result );
+			}
+		} );
+
+		if ( result != expected ) {
+			std::cout << "Sliced result differs" << std::endl;
+			return 1;
+		}
+
+		// Main makes no calls, every iteration takes one back-edge and each slice crosses exactly 'budget' of them
+		auto expected_slices = long_iterations / std::max< uint64_t >( budget, 1 ) + 1;
+
+		if ( slices != expected_slices ) {
+			std::cout << "Took " << slices << " slices, expected " << expected_slices << std::endl;
+			return 1;
+		}
+
+		std::cout << std::fixed << std::setprecision( 2 )
+			<< std::left << std::setw( 20 ) << "long run:" << std::right << run_ms << " ms" << std::endl
+			<< std::left << std::setw( 20 ) << "long unlimited:" << std::right << unlimited_ms << " ms (" << unlimited_ms / run_ms << "x)" << std::endl
+			<< std::left << std::setw( 20 ) << ( "long budget " + std::to_string( budget ) + ":" ) << std::right << sliced_ms << " ms ("
+			<< sliced_ms / run_ms << "x), " << slices << " slices" << std::endl;
+	}
+
+	// The first task never ends and every hundredth is long, all queued ahead of the short ones behind them
+	struct Task {
+		int								kind;
+		std::unique_ptr< VMInstance >	instance;
+		double							result;
+		uint64_t						slices;
+		double							done_ms;
+	};
+
+	std::vector< Task > tasks( task_count );
+
+	for ( int i = 0; i < task_count; ++i ) {
+		tasks[ i ].kind = i == 0 ? 2 : i % 100 == 1 ? 1 : 0;
+		tasks[ i ].instance.reset( new VMInstance( options ) );
+	}
+
+	// Done times per kind, in ms from the start of the queue
+	auto print_latencies = [ & ]( const char* label, const std::vector< Task >& tasks ) {
+		std::cout << std::fixed << std::setprecision( 2 ) << std::left << std::setw( 13 ) << label << std::right;
+
+		for ( int kind = 0; kind < 2; ++kind ) {
+			std::vector< double > done;
+
+			for ( auto& task : tasks ) {
+				if ( task.kind == kind ) {
+					done.push_back( task.done_ms );
+				}
+			}
+
+			std::cout << " " << scripts[ kind ].name << " p50 " << percentile( done, 0.5 ) << " p99 " << percentile( done, 0.99 )
+				<< " max " << percentile( done, 1.0 ) << " ms" << ( kind == 0 ? "," : "" );
+		}
+
+		std::cout << std::endl;
+	};
+
+	// Run to completion in queue order, the runaway task is left out since it would never give the thread back
+	auto fifo_start = std::chrono::steady_clock::now();
+
+	for ( auto& task : tasks ) {
+		if ( task.kind != 2 ) {
+			task.result = task.instance->run( *compiled[ task.kind ] );
+			task.done_ms = std::chrono::duration< double, std::milli >( std::chrono::steady_clock::now() - fifo_start ).count();
+		}
+	}
+
+	std::vector< double > expected( kind_count );
+
+	for ( auto& task : tasks ) {
+		expected[ task.kind ] = task.result;
+	}
+
+	print_latencies( "fifo:", tasks );
+
+	// Round robin, one budget per turn. A task still running after 'max_slices' turns is cancelled.
+	const uint64_t max_slices = 10000;
+	std::deque< Task* > ready;
+
+	for ( auto& task : tasks ) {
+		task.slices = 0;
+		ready.push_back( &task );
+	}
+
+	int cancelled = 0;
+	auto queue_start = std::chrono::steady_clock::now();
+
+	while ( !ready.empty() ) {
+		auto task = ready.front();
+		ready.pop_front();
+
+		auto& program = *compiled[ task->kind ];
+		auto status = task->slices++ == 0 ? task->instance->start( program, budget, &task->result ) : task->instance->resume( budget, &task->result );
+
+		if ( status == RunStatus::run_finished ) {
+			task->done_ms = std::chrono::duration< double, std::milli >( std::chrono::steady_clock::now() - queue_start ).count();
+
+			if ( task->result != expected[ task->kind ] ) {
+				std::cout << "Scheduled result differs" << std::endl;
+				return 1;
+			}
+		} else if ( task->slices == max_slices ) {
+			++cancelled;
+		} else {
+			ready.push_back( task );
+		}
+	}
+
+	auto queue_ms = std::chrono::duration< double, std::milli >( std::chrono::steady_clock::now() - queue_start ).count();
+
+	print_latencies( "round robin:", tasks );
+
+	std::cout << task_count << " tasks in " << queue_ms << " ms, " << cancelled << " cancelled after " << max_slices << " slices" << std::endl;
+
+	return 0;
+}
+
+// bench executor [tasks] [max workers]
+int bench_executor( const std::vector< std::string >& args ) {
+	auto task_count = args.size() > 0 ? std::stoi( args[ 0 ] ) : 20000;
+	size_t max_workers = args.size() > 1 ? std::stoul( args[ 1 ] ) : std::max( 1u, std::thread::hardware_concurrency() );
+
+	auto compiled = compile_program( compile_script( fib_source( 20 ) ) );
+	int fib = 0;
+
+	while ( symbol_name( compiled->program.functions[ fib ].name ) != "Fib" ) {
+		++fib;
+	}
+
+	// Mostly small tasks with every 50th about a hundred times bigger, dealing them out round robin alone
+	// would leave the workers that drew few big ones idle
+	std::mt19937 random( 42 );
+	std::vector< double > arguments( task_count );
+	std::vector< double > expected( task_count );
+	std::vector< double > fib_values;
+	VMInstance instance;
+
+	for ( double n = 0; n <= 22; ++n ) {
+		fib_values.push_back( instance.call( *compiled, fib, &n ) );
+	}
+
+	for ( int i = 0; i < task_count; ++i ) {
+		arguments[ i ] = i % 50 == 0 ? 22 : 10 + random() % 6;
+		expected[ i ] = fib_values[ ( size_t ) arguments[ i ] ];
+	}
+
+	std::vector< size_t > worker_counts;
+
+	for ( size_t workers = 1; workers < max_workers; workers *= 2 ) {
+		worker_counts.push_back( workers );
+	}
+
+	worker_counts.push_back( max_workers );
+
+	double single_rate = 0.0;
+
+	for ( auto worker_count : worker_counts ) {
+		Executor executor( worker_count );
+
+		if ( executor.submit( compiled ).get() != fib_values[ 20 ] ) {
+			std::cout << "Main result differs" << std::endl;
+			return 1;
+		}
+
+		// All tasks are submitted at once, the latency of a task is the time from its submit to its callback
+		std::vector< std::chrono::steady_clock::time_point > submitted( task_count );
+		std::vector< double > latencies( task_count );
+		std::atomic< int > failures( 0 );
+
+		auto ms = measure_ms( [ & ]() {
+			for ( int i = 0; i < task_count; ++i ) {
+				submitted[ i ] = std::chrono::steady_clock::now();
+
+				executor.submit( compiled, fib, { arguments[ i ] }, [ &, i ]( double result, std::exception_ptr error ) {
+					latencies[ i ] = std::chrono::duration< double, std::milli >( std::chrono::steady_clock::now() - submitted[ i ] ).count();
+
+					if ( error || result != expected[ i ] ) {
+						++failures;
+					}
+				} );
+			}
+
+			executor.wait();
+		} );
+
+		if ( failures > 0 ) {
+			std::cout << failures << " tasks failed or returned the wrong result" << std::endl;
+			return 1;
+		}
+
+		auto rate = task_count / ( ms / 1000.0 );
+
+		if ( worker_count == 1 ) {
+			single_rate = rate;
+		}
+
+		std::cout << std::fixed << std::setprecision( 2 )
+			<< std::setw( 3 ) << worker_count << " workers: " << rate << " tasks/s (" << rate / single_rate << "x), latency p50 "
+			<< percentile( latencies, 0.5 ) << " p99 " << percentile( latencies, 0.99 ) << " p99.9 " << percentile( latencies, 0.999 )
+			<< " max " << percentile( latencies, 1.0 ) << " ms, " << executor.steals() << " steals" << std::endl;
+	}
+
+	return 0;
+}
+
+int run_benchmark( const std::string& name, const std::vector< std::string >& args ) {
+	struct Benchmark {
+		const char*		name;
+		int( *fn )( const std::vector< std::string >& args );
+	};
+
+	const Benchmark benchmarks[] = {
+		{ "lexer", bench_lexer },
+		{ "keywords", bench_keywords },
+		{ "scan", bench_scan },
+		{ "parse", bench_parse },
+		{ "scopes", bench_scopes },
+		{ "dispatch", bench_dispatch },
+		{ "registers", bench_registers },
+		{ "threaded", bench_threaded },
+		{ "verify", bench_verify },
+		{ "calls", bench_calls },
+		{ "tail", bench_tail },
+		{ "threads", bench_threads },
+		{ "batch", bench_batch },
+		{ "memo", bench_memo },
+		{ "profile", bench_profile },
+		{ "schedule", bench_schedule },
+		{ "executor", bench_executor },
+	};
+
+	for ( auto& benchmark : benchmarks ) {
+		if ( name == benchmark.name ) {
+			return benchmark.fn( args );
+		}
+	}
+
+	std::cout << "Unknown benchmark '" << name << "', available:" << std::endl;
+
+	for ( auto& benchmark : benchmarks ) {
+		std::cout << "  " << benchmark.name << std::endl;
+	}
+
+	return 1;
+}
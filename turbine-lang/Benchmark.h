@@ -0,0 +1,4 @@
+#pragma once
+
+// Runs the benchmark called 'name', returns the process exit code
+int run_benchmark( const std::string& name, const std::vector< std::string >& args );
@@ -0,0 +1,248 @@
+#include <vector>
+#include <string>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <future>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <exception>
+#include <algorithm>
+#include <cstdint>
+
+#include "Main.h"
+#include "Executor.h"
+
+struct ExecutorTask {
+	std::shared_ptr< const CompiledProgram >	program;
+	int											function_index;
+	std::vector< double >						arguments;
+	TaskCallback								callback;
+};
+
+// A cache line each, the owner and thieves only meet on the lock of one deque
+struct alignas( 64 ) ExecutorWorker {
+	std::mutex							mutex;
+	std::deque< ExecutorTask* >			tasks;		// The owner pushes and pops at the back, thieves take from the front
+	std::thread							thread;
+};
+
+struct ExecutorState {
+	RunOptions											options;
+	std::vector< std::unique_ptr< ExecutorWorker > >	workers;
+	std::atomic< size_t >								next_worker;	// Round robin for tasks submitted from other threads
+	std::atomic< size_t >								queued;			// Tasks in any deque
+	std::atomic< size_t >								unfinished;		// Submitted and not run yet
+	std::atomic< uint64_t >								steals;
+
+	std::mutex											sleep_mutex;
+	std::condition_variable								wake;			// Workers wait here when every deque is empty
+	std::atomic< size_t >								sleeping;
+	bool												stopping;		// Under sleep_mutex
+
+	std::mutex											idle_mutex;
+	std::condition_variable								idle;			// Signalled when unfinished drops to zero
+};
+
+// Set on worker threads, so tasks they submit stay on their own deque
+thread_local ExecutorState* current_executor = NULL;
+thread_local size_t current_worker = 0;
+
+void push_task( ExecutorState& state, size_t index, ExecutorTask* task ) {
+	auto& worker = *state.workers[ index ];
+
+	{
+		std::lock_guard< std::mutex > lock( worker.mutex );
+		worker.tasks.push_back( task );
+		++state.queued;
+	}
+
+	// A worker going to sleep counts itself before checking 'queued', one of the two sees the other
+	if ( state.sleeping > 0 ) {
+		std::lock_guard< std::mutex > lock( state.sleep_mutex );
+		state.wake.notify_one();
+	}
+}
+
+ExecutorTask* take_task( ExecutorState& state, size_t index ) {
+	{
+		auto& worker = *state.workers[ index ];
+		std::lock_guard< std::mutex > lock( worker.mutex );
+
+		if ( !worker.tasks.empty() ) {
+			auto task = worker.tasks.back();
+			worker.tasks.pop_back();
+			--state.queued;
+			return task;
+		}
+	}
+
+	// Oldest first, it is the furthest from what the victim is working on
+	auto count = state.workers.size();
+
+	for ( size_t i = 1; i < count; ++i ) {
+		auto& victim = *state.workers[ ( index + i ) % count ];
+		std::lock_guard< std::mutex > lock( victim.mutex );
+
+		if ( !victim.tasks.empty() ) {
+			auto task = victim.tasks.front();
+			victim.tasks.pop_front();
+			--state.queued;
+			state.steals.fetch_add( 1, std::memory_order_relaxed );
+			return task;
+		}
+	}
+
+	return NULL;
+}
+
+void run_task( ExecutorState& state, VMInstance& instance, ExecutorTask* task ) {
+	double result = 0.0;
+	std::exception_ptr error;
+
+	try {
+		if ( task->function_index == task->program->program.main ) {
+			result = instance.run( *task->program );
+		} else {
+			result = instance.call( *task->program, task->function_index, task->arguments.data() );
+		}
+	} catch ( ... ) {
+		error = std::current_exception();
+	}
+
+	// An exception from the callback has nowhere to go, it must not take the worker down or leave wait() hanging
+	try {
+		task->callback( result, error );
+	} catch ( ... ) {
+	}
+
+	delete task;
+
+	if ( --state.unfinished == 0 ) {
+		std::lock_guard< std::mutex > lock( state.idle_mutex );
+		state.idle.notify_all();
+	}
+}
+
+void worker_loop( ExecutorState* state, size_t index ) {
+	current_executor = state;
+	current_worker = index;
+
+	// One VM per worker, its stacks are reused by every task the worker runs
+	VMInstance instance( state->options );
+
+	while ( true ) {
+		if ( auto task = take_task( *state, index ) ) {
+			run_task( *state, instance, task );
+			continue;
+		}
+
+		std::unique_lock< std::mutex > lock( state->sleep_mutex );
+		++state->sleeping;
+
+		while ( !state->stopping && state->queued == 0 ) {
+			state->wake.wait( lock );
+		}
+
+		--state->sleeping;
+
+		if ( state->stopping && state->queued == 0 ) {
+			return;
+		}
+	}
+}
+
+Executor::Executor( size_t worker_count, const RunOptions& options ) {
+	if ( worker_count == 0 ) {
+		worker_count = std::max( 1u, std::thread::hardware_concurrency() );
+	}
+
+	state = new ExecutorState;
+	state->options = options;
+	state->next_worker = 0;
+	state->queued = 0;
+	state->unfinished = 0;
+	state->steals = 0;
+	state->sleeping = 0;
+	state->stopping = false;
+
+	// Every deque exists before the first worker may try to steal from it
+	for ( size_t i = 0; i < worker_count; ++i ) {
+		state->workers.emplace_back( new ExecutorWorker );
+	}
+
+	for ( size_t i = 0; i < worker_count; ++i ) {
+		state->workers[ i ]->thread = std::thread( worker_loop, state, i );
+	}
+}
+
+Executor::~Executor() {
+	{
+		std::lock_guard< std::mutex > lock( state->sleep_mutex );
+		state->stopping = true;
+	}
+
+	state->wake.notify_all();
+
+	for ( auto& worker : state->workers ) {
+		worker->thread.join();
+	}
+
+	delete state;
+}
+
+void Executor::submit( std::shared_ptr< const CompiledProgram > program, int function_index, std::vector< double > arguments, TaskCallback callback ) {
+	auto& functions = program->program.functions;
+
+	if ( function_index < 0 || function_index >= ( int ) functions.size() ) {
+		throw std::exception( "Invalid function index" );
+	}
+
+	if ( function_index != program->program.main && ( int ) arguments.size() != functions[ function_index ].arg_count ) {
+		throw std::exception( "Wrong number of arguments" );
+	}
+
+	auto task = new ExecutorTask{ std::move( program ), function_index, std::move( arguments ), std::move( callback ) };
+	++state->unfinished;
+
+	if ( current_executor == state ) {
+		push_task( *state, current_worker, task );
+	} else {
+		push_task( *state, state->next_worker.fetch_add( 1, std::memory_order_relaxed ) % state->workers.size(), task );
+	}
+}
+
+std::future< double > Executor::submit( std::shared_ptr< const CompiledProgram > program, int function_index, std::vector< double > arguments ) {
+	auto promise = std::make_shared< std::promise< double > >();
+	auto future = promise->get_future();
+
+	submit( std::move( program ), function_index, std::move( arguments ), [ promise ]( double result, std::exception_ptr error ) {
+		if ( error ) {
+			promise->set_exception( error );
+		} else {
+			promise->set_value( result );
+		}
+	} );
+
+	return future;
+}
+
+std::future< double > Executor::submit( std::shared_ptr< const CompiledProgram > program ) {
+	auto main = program->program.main;
+	return submit( std::move( program ), main, std::vector< double >() );
+}
+
+void Executor::wait() {
+	std::unique_lock< std::mutex > lock( state->idle_mutex );
+	state->idle.wait( lock, [ this ]() { return state->unfinished == 0; } );
+}
+
+size_t Executor::worker_count() const {
+	return state->workers.size();
+}
+
+uint64_t Executor::steals() const {
+	return state->steals.load( std::memory_order_relaxed );
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+// Called on the worker thread once a task has run, with its result or the exception it threw. Exceptions
+// thrown by the callback itself are dropped.
+typedef std::function< void( double result, std::exception_ptr error ) > TaskCallback;
+
+struct ExecutorState;
+
+// Worker threads with one VM each and a deque of tasks per worker. A worker takes its newest task
+// first and steals the oldest from another worker when its own deque runs dry.
+struct Executor {
+	// 0 workers starts one per hardware thread, every worker's VM is sized by 'options'
+	Executor( size_t worker_count = 0, const RunOptions& options = RunOptions() );
+
+	// Finishes the queued tasks first
+	~Executor();
+
+	Executor( const Executor& ) = delete;
+	Executor& operator=( const Executor& ) = delete;
+
+	// Runs Main, or one function on 'arguments' when 'function_index' isn't the index of Main. Tasks
+	// submitted from a worker thread go to the deque of that worker, others are dealt out round robin.
+	void submit( std::shared_ptr< const CompiledProgram > program, int function_index, std::vector< double > arguments, TaskCallback callback );
+
+	std::future< double > submit( std::shared_ptr< const CompiledProgram > program, int function_index, std::vector< double > arguments );
+	std::future< double > submit( std::shared_ptr< const CompiledProgram > program );
+
+	// Blocks until every task submitted so far has run
+	void wait();
+
+	size_t worker_count() const;
+
+	// Tasks a worker took from another worker's deque
+	uint64_t steals() const;
+
+	ExecutorState*			state;
+};
@@ -1,17 +1,35 @@
 #define WIN32_LEAN_AND_MEAN
 #include "windows.h"
 
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 #include <iostream>
-#include <fstream>
 #include <vector>
 #include <string>
-#include <regex>
 #include <unordered_map>
+#include <deque>
 #include <stack>
 #include <iomanip>
 #include <chrono>
+#include <climits>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <fstream>
 
 #include "Main.h"
+#include "SimdScan.h"
+#include "Benchmark.h"
+#include "RegisterVM.h"
+#include "Profiler.h"
 #include "Whirl/Decompiler.h"
 #include "Whirl/x86_64Compiler.h"
 
@@ -29,7 +47,6 @@
 */
 
 struct Disassembly;
-struct Program;
 
 void print_disassembly( const Disassembly& disasm );
 bool disassemble( const Program& program, Disassembly* disasm );
@@ -56,62 +73,55 @@ struct Disassembly {
 	std::vector< Fn > functions;
 };
 
-struct Program {
-	int										global;
-	int										main;
-	std::vector< Function >					functions;
-};
+// Symbol interner, names are stored once and referred to by their index. Shared by every parse in the
+// process and never shrinks, symbols stay valid for as long as any program may refer to them.
+struct SymbolTable {
+	SymbolTable() {
+		intern( "" );
+	}
 
-enum TokenId {
-	token_identifier,
-	token_number,
-	token_function,
-	token_while,
-	token_end,
-	token_plus,
-	token_minus,
-	token_star,
-	token_slash,
-	token_equals,
-	token_semicolon,
-	token_paren_left,
-	token_paren_right,
-	token_comma,
-	token_colon,
-	token_const,
-	token_any,
-	token_return,
-	token_if,
-	token_else,
-	token_then,
-	token_lessthan,
-	token_morethan,
-	token_2equals,
-	token_notequals,
-	token_eof,
-};
+	Symbol intern( const std::string_view& name ) {
+		std::lock_guard< std::mutex > lock( mutex );
 
-struct Keyword {
-	enum KeywordType {
-		kw_operator,
-		kw_word,
-	};
+		auto found_symbol = symbols.find( name );
 
-	std::string		string;
-	KeywordType		type;
-	int				lbp;
-	TokenId			token_type;
-};
+		if ( found_symbol != symbols.end() ) {
+			return found_symbol->second;
+		}
+
+		// Deque never moves its elements, so the views used as keys stay valid
+		names.emplace_back( name );
+
+		auto symbol = ( Symbol ) ( names.size() - 1 );
+		symbols.emplace( names.back(), symbol );
+
+		return symbol;
+	}
+
+	const std::string& name( Symbol symbol ) {
+		// Growing the deque may move its block map, but never the strings a returned reference points at
+		std::lock_guard< std::mutex > lock( mutex );
+		return names[ symbol ];
+	}
 
-struct Token {
-	const Keyword*		keyword;
-	std::string			token_string;
-	bool				is_last;
-	int					parse_distance;
-	int					lbp;
-	TokenId				token_type;
+	std::mutex										mutex;
+	std::unordered_map< std::string_view, Symbol >	symbols;
+	std::deque< std::string >						names;
 };
 
+SymbolTable& symbol_table() {
+	static SymbolTable s_symbol_table;
+	return s_symbol_table;
+}
+
+Symbol intern_symbol( const std::string_view& name ) {
+	return symbol_table().intern( name );
+}
+
+const std::string& symbol_name( Symbol symbol ) {
+	return symbol_table().name( symbol );
+}
+
 enum ParserPrecedence {
 	prec_none = 0,
 	prec_assignment = 10,
@@ -122,130 +132,290 @@ enum ParserPrecedence {
 	prec_variable = 60,
 };
 
-const std::unordered_map< std::string, Keyword > keyword_list ={
-	{ "Fn",			Keyword { "Fn",		Keyword::kw_word, ParserPrecedence::prec_variable,		TokenId::token_function } },
-	{ "Const",		Keyword { "Const",	Keyword::kw_word, ParserPrecedence::prec_variable,		TokenId::token_const } },
-	{ "Any",		Keyword { "Any",	Keyword::kw_word, ParserPrecedence::prec_variable,		TokenId::token_any } },
-	{ "End",		Keyword { "End",	Keyword::kw_word, ParserPrecedence::prec_variable,		TokenId::token_end } },
-	{ "Return",		Keyword { "Return",	Keyword::kw_word, ParserPrecedence::prec_none,			TokenId::token_return } },
-	{ "If",			Keyword { "If",		Keyword::kw_word, ParserPrecedence::prec_none,			TokenId::token_if } },
-	{ "Else",		Keyword { "Else",	Keyword::kw_word, ParserPrecedence::prec_none,			TokenId::token_else } },
-	{ "Then",		Keyword { "Then",	Keyword::kw_word, ParserPrecedence::prec_none,			TokenId::token_then } },
-	{ "While",		Keyword { "While",	Keyword::kw_word, ParserPrecedence::prec_none,			TokenId::token_while } },
+constexpr Keyword keyword_list[] = {
+	Keyword { "Fn",		Keyword::kw_word, ParserPrecedence::prec_variable,		TokenId::token_function },
+	Keyword { "Const",	Keyword::kw_word, ParserPrecedence::prec_variable,		TokenId::token_const },
+	Keyword { "Any",	Keyword::kw_word, ParserPrecedence::prec_variable,		TokenId::token_any },
+	Keyword { "End",	Keyword::kw_word, ParserPrecedence::prec_variable,		TokenId::token_end },
+	Keyword { "Return",	Keyword::kw_word, ParserPrecedence::prec_none,			TokenId::token_return },
+	Keyword { "If",		Keyword::kw_word, ParserPrecedence::prec_none,			TokenId::token_if },
+	Keyword { "Else",	Keyword::kw_word, ParserPrecedence::prec_none,			TokenId::token_else },
+	Keyword { "Then",	Keyword::kw_word, ParserPrecedence::prec_none,			TokenId::token_then },
+	Keyword { "While",	Keyword::kw_word, ParserPrecedence::prec_none,			TokenId::token_while },
+};
+
+constexpr Keyword operator_list[] = {
+	Keyword { "+",		Keyword::kw_operator, ParserPrecedence::prec_arithmetic_addsub,		TokenId::token_plus },
+	Keyword { "-",		Keyword::kw_operator, ParserPrecedence::prec_arithmetic_addsub,		TokenId::token_minus },
+	Keyword { "/",		Keyword::kw_operator, ParserPrecedence::prec_arithmetic_muldiv,		TokenId::token_slash },
+	Keyword { "*",		Keyword::kw_operator, ParserPrecedence::prec_arithmetic_muldiv,		TokenId::token_star },
+	Keyword { ";",		Keyword::kw_operator, ParserPrecedence::prec_none,					TokenId::token_semicolon },
+	Keyword { "=",		Keyword::kw_operator, ParserPrecedence::prec_assignment,			TokenId::token_equals },
+	Keyword { "(",		Keyword::kw_operator, ParserPrecedence::prec_left_paren,			TokenId::token_paren_left },
+	Keyword { ")",		Keyword::kw_operator, ParserPrecedence::prec_none,					TokenId::token_paren_right },
+	Keyword { ":",		Keyword::kw_operator, ParserPrecedence::prec_none,					TokenId::token_colon },
+	Keyword { ",",		Keyword::kw_operator, ParserPrecedence::prec_none,					TokenId::token_comma },
+
+	Keyword { "<",		Keyword::kw_operator, ParserPrecedence::prec_equality,				TokenId::token_lessthan },
+	Keyword { ">",		Keyword::kw_operator, ParserPrecedence::prec_equality,				TokenId::token_morethan },
+};
+
+constexpr Keyword double_char_operator_list[] = {
+	Keyword { "==",		Keyword::kw_operator, ParserPrecedence::prec_equality,				TokenId::token_2equals },
+	Keyword { "!=",		Keyword::kw_operator, ParserPrecedence::prec_equality,				TokenId::token_notequals },
+};
+
+// Perfect hash over length and first character of the keyword, collisions are rejected at compile time
+constexpr size_t keyword_hash( size_t length, char first_char ) {
+	return ( length * 3 + ( unsigned char ) first_char ) & 15;
+}
+
+struct KeywordHashTable {
+	constexpr KeywordHashTable() : slots(), is_perfect( true ) {
+		for ( auto& slot : slots )
+			slot = -1;
+
+		for ( int i = 0; i < ( int ) ( sizeof( keyword_list ) / sizeof( Keyword ) ); ++i ) {
+			auto& slot = slots[ keyword_hash( keyword_list[ i ].string.length(), keyword_list[ i ].string[ 0 ] ) ];
+
+			if ( slot != -1 )
+				is_perfect = false;
+
+			slot = ( int8_t ) i;
+		}
+	}
+
+	int8_t slots[ 16 ];
+	bool is_perfect;
 };
 
-const std::regex rx_double_operator = std::regex( "(==)|(!=)" );
-const std::regex rx_operator = std::regex( "([\\(\\)\\+\\-\\*\\/=;:,><])" );
-const std::regex rx_identifier_char = std::regex( "[_a-zA-Z0-9]" );
-const std::regex rx_identifier = std::regex( "[_a-zA-Z0-9]+" );
-const std::regex rx_number_char = std::regex( "[.0-9]" );
-const std::regex rx_number = std::regex( "[.0-9]+" );
-
-const std::unordered_map< std::string, Keyword > operator_list = {
-	{ "+",		Keyword { "+",		Keyword::kw_operator, ParserPrecedence::prec_arithmetic_addsub,		TokenId::token_plus } },
-	{ "-",		Keyword { "-",		Keyword::kw_operator, ParserPrecedence::prec_arithmetic_addsub,		TokenId::token_minus } },
-	{ "/",		Keyword { "/",		Keyword::kw_operator, ParserPrecedence::prec_arithmetic_muldiv,		TokenId::token_slash } },
-	{ "*",		Keyword { "*",		Keyword::kw_operator, ParserPrecedence::prec_arithmetic_muldiv,		TokenId::token_star } },
-	{ ";",		Keyword { ";",		Keyword::kw_operator, ParserPrecedence::prec_none,					TokenId::token_semicolon } },
-	{ "=",		Keyword { "=",		Keyword::kw_operator, ParserPrecedence::prec_assignment,			TokenId::token_equals } },
-	{ "(",		Keyword { "(",		Keyword::kw_operator, ParserPrecedence::prec_left_paren,			TokenId::token_paren_left } },
-	{ ")",		Keyword { ")",		Keyword::kw_operator, ParserPrecedence::prec_none,					TokenId::token_paren_right } },
-	{ ":",		Keyword { ":",		Keyword::kw_operator, ParserPrecedence::prec_none,					TokenId::token_colon } },
-	{ ",",		Keyword { ",",		Keyword::kw_operator, ParserPrecedence::prec_none,					TokenId::token_comma } },
-
-	{ "<",		Keyword { "<",		Keyword::kw_operator, ParserPrecedence::prec_equality,				TokenId::token_lessthan } },
-	{ ">",		Keyword { ">",		Keyword::kw_operator, ParserPrecedence::prec_equality,				TokenId::token_morethan } },
+// Operators indexed by their first character
+struct OperatorTable {
+	constexpr OperatorTable() : single_char(), double_char() {
+		for ( int c = 0; c < 256; ++c ) {
+			single_char[ c ] = -1;
+			double_char[ c ] = -1;
+		}
+
+		for ( int i = 0; i < ( int ) ( sizeof( operator_list ) / sizeof( Keyword ) ); ++i )
+			single_char[ ( unsigned char ) operator_list[ i ].string[ 0 ] ] = ( int8_t ) i;
+
+		for ( int i = 0; i < ( int ) ( sizeof( double_char_operator_list ) / sizeof( Keyword ) ); ++i )
+			double_char[ ( unsigned char ) double_char_operator_list[ i ].string[ 0 ] ] = ( int8_t ) i;
+	}
+
+	int8_t single_char[ 256 ];
+	int8_t double_char[ 256 ];
 };
 
-const std::unordered_map< std::string, Keyword > double_char_operator_list ={
-	{ "==",		Keyword{ "==",		Keyword::kw_operator, ParserPrecedence::prec_equality,				TokenId::token_2equals } },
-	{ "!=",		Keyword{ "!=",		Keyword::kw_operator, ParserPrecedence::prec_equality,				TokenId::token_notequals } },
+struct TokenLbpTable {
+	constexpr TokenLbpTable() : lbp() {
+		add( keyword_list );
+		add( operator_list );
+		add( double_char_operator_list );
+	}
+
+	template < size_t N >
+	constexpr void add( const Keyword( &list )[ N ] ) {
+		for ( size_t i = 0; i < N; ++i )
+			lbp[ list[ i ].token_type ] = list[ i ].lbp;
+	}
+
+	int lbp[ TokenId::token_eof + 1 ];
 };
 
-bool scan( const std::string& input, const std::regex& mask, std::string* result ) {
-	std::smatch match;
-	auto res = std::regex_search( input, match, mask );
+constexpr KeywordHashTable keyword_hash_table;
+constexpr OperatorTable operator_table;
+constexpr TokenLbpTable token_lbp_table;
+
+static_assert( keyword_hash_table.is_perfect, "keyword_hash has collisions, adjust it when adding keywords" );
+
+const Keyword* find_keyword( const std::string_view& word ) {
+	if ( word.length() == 0 )
+		return NULL;
+
+	auto slot = keyword_hash_table.slots[ keyword_hash( word.length(), word[ 0 ] ) ];
+
+	if ( slot < 0 || keyword_list[ slot ].string != word )
+		return NULL;
 
-	*result = match.str();
-	return res;
+	return &keyword_list[ slot ];
 }
 
-Token next_token( const std::string_view& input ) {
-	auto make_token = [ &input ]( const std::string& token_string, int parse_dist, int lbp, TokenId type, const Keyword* kw ) -> Token {
-		Token token;
+const Keyword* find_operator( const std::string_view& text ) {
+	if ( text.length() == 1 ) {
+		auto index = operator_table.single_char[ ( unsigned char ) text[ 0 ] ];
+		return index < 0 ? NULL : &operator_list[ index ];
+	}
 
-		token.keyword = kw;
-		token.token_string = token_string;
-		token.parse_distance = parse_dist;
-		token.is_last = false; // token.parse_distance >= ( int ) input.length();
-		token.lbp = lbp;
-		token.token_type = type;
+	if ( text.length() == 2 ) {
+		auto index = operator_table.double_char[ ( unsigned char ) text[ 0 ] ];
+		return index < 0 || double_char_operator_list[ index ].string[ 1 ] != text[ 1 ] ? NULL : &double_char_operator_list[ index ];
+	}
 
-		return token;
-	};
+	return NULL;
+}
 
-	for ( size_t i = 0; i < input.length(); ++i ) {
-		auto current_char = input.at( i );
-		std::string scan_string = std::string( input.substr( i ) );
-		std::string token_string;
+int token_lbp( TokenId token_type ) {
+	return token_lbp_table.lbp[ token_type ];
+}
 
-		bool is_whitespace = ( current_char == '\n' || current_char == ' ' || current_char == '\t' );
+// Character classes for the scanner, a character may belong to several classes
+enum CharClass : uint8_t {
+	char_whitespace = 1 << 0,
+	char_operator = 1 << 1,
+	char_number = 1 << 2,
+	char_identifier = 1 << 3,
+	char_double_operator = 1 << 4,
+};
 
-		if ( is_whitespace )
-			continue;
+struct CharClassTable {
+	constexpr CharClassTable() : classes() {
+		for ( int c = 0; c < 256; ++c ) {
+			uint8_t flags = 0;
+
+			if ( c == ' ' || c == '\t' || c == '\n' )
+				flags |= CharClass::char_whitespace;
+
+			if ( c == '(' || c == ')' || c == '+' || c == '-' || c == '*' || c == '/'
+				|| c == '=' || c == ';' || c == ':' || c == ',' || c == '>' || c == '<' )
+				flags |= CharClass::char_operator;
+
+			if ( c == '.' || ( c >= '0' && c <= '9' ) )
+				flags |= CharClass::char_number;
+
+			if ( c == '_' || ( c >= 'a' && c <= 'z' ) || ( c >= 'A' && c <= 'Z' ) || ( c >= '0' && c <= '9' ) )
+				flags |= CharClass::char_identifier;
+
+			// First character of '==' and '!='
+			if ( c == '=' || c == '!' )
+				flags |= CharClass::char_double_operator;
+
+			classes[ c ] = flags;
+		}
+	}
 
-		if ( std::regex_match( scan_string.substr( 0, 2 ), rx_double_operator ) ) {
-			auto keyword_string = scan_string.substr( 0, 2 );
-			auto keyword = &double_char_operator_list.at( keyword_string );
+	uint8_t classes[ 256 ];
+};
+
+constexpr CharClassTable char_class_table;
+
+inline uint8_t char_class( char c ) {
+	return char_class_table.classes[ ( unsigned char ) c ];
+}
+
+size_t scan_class( const std::string_view& input, size_t from, uint8_t mask ) {
+	size_t i = from;
+
+	while ( i < input.length() && ( char_class( input[ i ] ) & mask ) )
+		++i;
+
+	return i;
+}
+
+typedef size_t( *ScanKernel )( const char* data, size_t from, size_t length );
+
+// SIMD kernels for the hot runs, NULL leaves the whole run to the scalar scan
+struct ScanKernels {
+	ScanKernel		whitespace;
+	ScanKernel		identifier;
+	ScanKernel		number;
+};
+
+ScanKernels scan_kernels_for( SimdLevel level ) {
+	switch ( level ) {
+	case SimdLevel::simd_avx2: return ScanKernels{ simd_skip_whitespace_avx2, simd_skip_identifier_avx2, simd_skip_number_avx2 };
+	case SimdLevel::simd_sse2: return ScanKernels{ simd_skip_whitespace_sse2, simd_skip_identifier_sse2, simd_skip_number_sse2 };
+	default: return ScanKernels{ NULL, NULL, NULL };
+	}
+}
+
+ScanKernels scan_kernels = scan_kernels_for( simd_detect() );
+
+void set_scan_simd_level( SimdLevel level ) {
+	scan_kernels = scan_kernels_for( level );
+}
+
+size_t scan_run( const std::string_view& input, size_t from, uint8_t mask, ScanKernel kernel ) {
+	if ( kernel ) {
+		from = kernel( input.data(), from, input.length() );
+	}
+
+	return scan_class( input, from, mask );
+}
+
+Token next_token( const std::string_view& source, size_t* cursor ) {
+	auto make_token = [ cursor ]( size_t offset, size_t end, TokenId type ) -> Token {
+		*cursor = end;
+		return Token{ type, ( uint32_t ) offset, ( uint32_t ) ( end - offset ) };
+	};
+
+	size_t i = *cursor;
 
-			return make_token( keyword_string, i + 2, keyword->lbp, keyword->token_type, keyword );
+	while ( i < source.length() ) {
+		auto current_class = char_class( source[ i ] );
+
+		if ( current_class & CharClass::char_whitespace ) {
+			i = scan_run( source, i, CharClass::char_whitespace, scan_kernels.whitespace );
+			continue;
 		}
 
-		if ( std::regex_match( std::string( 1, current_char ), rx_operator ) ) {
-			auto keyword_string = std::string( 1, current_char );
-			auto keyword = &operator_list.at( keyword_string );
+		if ( ( current_class & CharClass::char_double_operator ) && i + 1 < source.length() && source[ i + 1 ] == '=' ) {
+			auto keyword = find_operator( source.substr( i, 2 ) );
+			return make_token( i, i + 2, keyword->token_type );
+		}
 
-			return make_token( keyword_string, i + 1, keyword->lbp, keyword->token_type, keyword );
+		if ( current_class & CharClass::char_operator ) {
+			auto keyword = find_operator( source.substr( i, 1 ) );
+			return make_token( i, i + 1, keyword->token_type );
 		}
 
-		if ( std::regex_match( std::string( 1, current_char ), rx_number_char ) && scan( scan_string, rx_number, &token_string ) ) {
-			return make_token( token_string, i + token_string.length(), 0, TokenId::token_number, NULL );
+		if ( current_class & CharClass::char_number ) {
+			return make_token( i, scan_run( source, i, CharClass::char_number, scan_kernels.number ), TokenId::token_number );
 		}
 
-		if ( std::regex_match( std::string( 1, current_char ), rx_identifier_char ) && scan( scan_string, rx_identifier, &token_string ) ) {
-			auto found_keyword = keyword_list.find( token_string );
+		if ( current_class & CharClass::char_identifier ) {
+			auto end = scan_run( source, i, CharClass::char_identifier, scan_kernels.identifier );
+			auto keyword = find_keyword( source.substr( i, end - i ) );
 
-			if ( found_keyword != keyword_list.end() ) {
-				const Keyword* kw = &found_keyword->second;
-				return make_token( token_string, i + token_string.length(), kw->lbp, kw->token_type, kw );
+			if ( keyword ) {
+				return make_token( i, end, keyword->token_type );
 			} else {
-				return make_token( token_string, i + token_string.length(), 0, TokenId::token_identifier, NULL );
+				return make_token( i, end, TokenId::token_identifier );
 			}
 		}
-	}
 
-	Token eofToken;
-	eofToken.keyword = NULL;
-	eofToken.token_string = "";
-	eofToken.parse_distance = input.length();
-	eofToken.is_last = true;
-	eofToken.lbp = 0;
-	eofToken.token_type = TokenId::token_eof;
+		// Lone '!' or an unknown character, skipped
+		++i;
+	}
 
-	return eofToken;
+	return make_token( source.length(), source.length(), TokenId::token_eof );
 }
 
-std::vector< Token > tokenize( const std::string& input ) {
-	std::vector< Token > tokens;
-	Token last_token;
-	int token_cursor = 0;
-	
+TokenStream tokenize( const std::string_view& source ) {
+	if ( source.length() > UINT32_MAX ) {
+		throw std::exception( "Source exceeds 4 GB" );
+	}
+
+	TokenStream tokens;
+	tokens.source = source;
+
+	// Rough guess to avoid most of the regrowth on large inputs
+	auto expected_tokens = source.length() / 6;
+	tokens.types.reserve( expected_tokens );
+	tokens.offsets.reserve( expected_tokens );
+	tokens.lengths.reserve( expected_tokens );
+
+	size_t cursor = 0;
+	Token token;
+
 	do {
-		last_token = next_token( std::string_view( input ).substr( token_cursor ) );
-		token_cursor += last_token.parse_distance;
+		token = next_token( source, &cursor );
 
-		tokens.push_back( last_token );
-	} while ( !last_token.is_last );
+		tokens.types.push_back( ( uint8_t ) token.token_type );
+		tokens.offsets.push_back( token.offset );
+		tokens.lengths.push_back( token.length );
+	} while ( token.token_type != TokenId::token_eof );
 
 	return tokens;
 }
@@ -256,8 +426,13 @@ struct Parser {
 		int							depth;
 		int							slot_index;
 		bool						is_defined;
-		std::string					name;
+		Symbol						name;
 		bool						is_const;
+		int							shadowed_slot;
+
+		// Compile-time value of a Const initialized with a constant expression
+		bool						has_value;
+		double						value;
 	};
 
 	struct Label {
@@ -270,14 +445,48 @@ struct Parser {
 		int32_t						target_location;
 	};
 
-	std::vector< Token >						tokens;
-	std::vector< Token >::const_iterator		token_iterator;
+	// Window over the tokens, the parser never looks further back than two tokens
+	struct TokenWindow {
+		static const size_t window_size = 4;
+
+		Token						tokens[ window_size ];
+		size_t						pulled;
+
+		std::string_view			source;
+		size_t						source_cursor;
+		const TokenStream*			stream;
+	};
+
+	TokenWindow									token_window;
+	size_t										token_index;
 
 	std::vector< Function >						functions;
 	int											current_function;
 
 	std::vector< Slot >							stack;
 	int											stack_depth;
+
+	// Position in 'stack' of slot 0 of the current function. Main starts under the globals, it runs on top of them
+	int											frame_start;
+
+	// Own slots of the current function are [frame_globals, frame_size), only Main addresses globals under them
+	int											frame_globals;
+	int											frame_size;
+
+	// Globals declared before Main, its own slots are moved above the later ones once all are known. -1 before Main
+	int											main_globals;
+
+	// Innermost slot and function for each symbol, indexed by symbol, -1 when there is none
+	std::vector< int >							symbol_slots;
+	std::vector< int >							symbol_functions;
+
+	// Offsets of the op_load_number instructions in the current function
+	std::vector< size_t >						constant_loads;
+
+	// Offset of the last op_call in the current function, a Return of its result becomes op_tail_call
+	size_t										last_call;
+
+	Symbol										main_symbol;
 };
 
 void parse_precedence( Parser& parser, int rbp = 0 );
@@ -311,29 +520,72 @@ void label_patch( Parser& parser, Parser::Label& label ) {
 	code[ label.patch_location ] = value.data.uint32[ 0 ];
 }
 
-const Token& advance_token( Parser& parser ) {
-	return *parser.token_iterator++;
+// Pulls tokens up to 'index' from the tokenized stream or straight from the lexer
+const Token& peek_token( Parser& parser, size_t index ) {
+	auto& window = parser.token_window;
+
+	while ( window.pulled <= index ) {
+		Token token;
+
+		if ( window.stream ) {
+			token = window.stream->get( std::min( window.pulled, window.stream->size() - 1 ) );
+		} else {
+			token = next_token( window.source, &window.source_cursor );
+		}
+
+		window.tokens[ window.pulled++ % Parser::TokenWindow::window_size ] = token;
+	}
+
+	return window.tokens[ index % Parser::TokenWindow::window_size ];
+}
+
+Token advance_token( Parser& parser ) {
+	return peek_token( parser, parser.token_index++ );
+}
+
+Token get_current_token( Parser& parser ) {
+	return peek_token( parser, parser.token_index );
+}
+
+Token get_previous_token( Parser& parser, int offset = 0 ) {
+	return peek_token( parser, parser.token_index - 1 - offset );
+}
+
+std::string_view token_text( Parser& parser, const Token& token ) {
+	return parser.token_window.source.substr( token.offset, token.length );
 }
 
-const Token& get_current_token( Parser& parser ) {
-	return *parser.token_iterator;
+Symbol token_symbol( Parser& parser, const Token& token ) {
+	return intern_symbol( token_text( parser, token ) );
 }
 
-const Token& get_previous_token( Parser& parser, int offset = 0 ) {
-	return *( parser.token_iterator - 1 - offset );
+int& symbol_entry( std::vector< int >& table, Symbol name ) {
+	if ( name >= table.size() ) {
+		table.resize( name + 1, -1 );
+	}
+
+	return table[ name ];
 }
 
-const Parser::Slot& create_variable( Parser& parser, const std::string& name, bool is_const ) {
+const Parser::Slot& create_variable( Parser& parser, Symbol name, bool is_const ) {
+	auto& innermost_slot = symbol_entry( parser.symbol_slots, name );
+
 	parser.stack.push_back(
 		Parser::Slot{
 			parser.stack_depth,
-			( int ) parser.stack.size(),
+			( int ) parser.stack.size() - parser.frame_start,
 			false,
 			name,
 			is_const,
+			innermost_slot,
+			false,
+			0.0,
 		}
 	);
 
+	innermost_slot = parser.stack.size() - 1;
+	parser.frame_size = std::max( parser.frame_size, ( int ) parser.stack.size() - parser.frame_start );
+
 	return parser.stack[ parser.stack.size() - 1 ];
 }
 
@@ -342,21 +594,41 @@ void create_scope( Parser& parser ) {
 }
 
 void destroy_scope( Parser& parser ) {
-	for ( int i = ( int ) parser.stack.size() - 1; i >= 0; --i ) {
-		if ( parser.stack[ i ].depth >= parser.stack_depth ) {
-			parser.stack.erase( parser.stack.begin() + i );
+	// Inner scopes always sit on top of the stack, so only the slots of this scope are visited
+	while ( parser.stack.size() > 0 && parser.stack.back().depth >= parser.stack_depth ) {
+		auto& slot = parser.stack.back();
+		parser.symbol_slots[ slot.name ] = slot.shadowed_slot;
+		parser.stack.pop_back();
 
-			emit( parser, OpCode::op_pop );
-		}
+		emit( parser, OpCode::op_pop );
 	}
 
 	--parser.stack_depth;
 }
 
-void create_function( Parser& parser, const std::string& name, FunctionType type = FunctionType::fn_virtual ) {
-	parser.functions.push_back( Function{ name, {}, ( int ) parser.functions.size(), type } );
+void create_function( Parser& parser, Symbol name, FunctionType type = FunctionType::fn_virtual ) {
+	auto& function_index = symbol_entry( parser.symbol_functions, name );
+
+	parser.frame_start = ( int ) parser.stack.size();
+	parser.frame_globals = 0;
+
+	// Calls resolve to the first function declared with a name
+	if ( function_index == -1 ) {
+		function_index = ( int ) parser.functions.size();
+
+		if ( name == parser.main_symbol ) {
+			parser.main_globals = parser.frame_start;
+			parser.frame_globals = parser.frame_start;
+			parser.frame_start = 0;
+		}
+	}
+
+	parser.functions.push_back( Function{ name, {}, ( int ) parser.functions.size(), type, 0, 0, false } );
+	parser.constant_loads.clear();
+	parser.last_call = SIZE_MAX;
 	create_scope( parser );
 
+	parser.frame_size = parser.frame_globals;
 	parser.current_function = parser.functions.size() - 1;
 }
 
@@ -364,42 +636,74 @@ void finish_function( Parser& parser ) {
 	emit( parser, OpCode::op_load_zero );
 	emit( parser, OpCode::op_return );
 
+	auto& function = parser.functions[ parser.current_function ];
+	function.max_stack = max_stack_depth( function );
+
+	// A function that only touches its own slots stays pure as long as everything it calls is. Main reads
+	// globals, whose values a cache keyed on the arguments would miss
+	function.pure = function.type == FunctionType::fn_virtual;
+
+	for ( size_t offset = 0; offset < function.code.size(); offset += opcode_length( function.code[ offset ] ) ) {
+		auto op = function.code[ offset ];
+
+		if ( is_slot_access( op ) && ( function.code[ offset + 1 ] < ( uint32_t ) parser.frame_globals || function.code[ offset + 1 ] >= ( uint32_t ) parser.frame_size ) ) {
+			function.pure = false;
+		}
+
+		if ( ( op == OpCode::op_call || op == OpCode::op_tail_call ) && function.code[ offset + 1 ] != ( uint32_t ) function.index ) {
+			function.pure = function.pure && parser.functions[ function.code[ offset + 1 ] ].pure;
+		}
+	}
+
 	destroy_scope( parser );
 	parser.current_function = 0;
+	parser.frame_start = 0;
+	parser.constant_loads.clear();
 }
 
-bool find_variable( Parser& parser, const std::string& name, Parser::Slot* target_slot ) {
-	auto find_result = std::find_if( parser.stack.begin(), parser.stack.end(), [ &name ]( const Parser::Slot& slot ) {
-		return slot.name == name;
-	} );
+bool find_variable( Parser& parser, Symbol name, Parser::Slot* target_slot ) {
+	auto slot_index = symbol_entry( parser.symbol_slots, name );
 
-	if ( find_result == parser.stack.end() ) {
+	if ( slot_index == -1 ) {
 		return false;
 	}
 
-	*target_slot = *find_result;
+	*target_slot = parser.stack[ slot_index ];
 	return true;
 }
 
-bool find_function( Parser& parser, const std::string& name, int* function_index ) {
-	auto find_result = std::find_if( parser.functions.begin(), parser.functions.end(), [ &name ]( const Function& slot ) {
-		return slot.name == name;
-	} );
+bool find_function( Parser& parser, Symbol name, int* function_index ) {
+	auto index = symbol_entry( parser.symbol_functions, name );
 
-	if ( find_result == parser.functions.end() ) {
+	if ( index == -1 ) {
 		return false;
 	}
 
-	*function_index = std::distance( parser.functions.begin(), find_result );
+	*function_index = index;
 	return true;
 }
 
+// Slot of the current function by its index in the frame
+Parser::Slot& frame_slot( Parser& parser, int slot_index ) {
+	return parser.stack[ parser.frame_start + slot_index ];
+}
+
 void define_variable( Parser& parser, int slot_index ) {
-	parser.stack[ slot_index ].is_defined = true;
+	frame_slot( parser, slot_index ).is_defined = true;
+}
+
+// Functions other than Main only have their own frame, a global is only visible through its constant value
+void check_frame_access( Parser& parser, const Parser::Slot& slot ) {
+	if ( symbol_entry( parser.symbol_slots, slot.name ) < parser.frame_start ) {
+		auto& function = parser.functions[ parser.current_function ];
+
+		throw std::exception( ( "Function '" + symbol_name( function.name ) + "' can not refer to global '" + symbol_name( slot.name )
+			+ "', only Main sees globals whose value is not a constant expression" ).c_str() );
+	}
 }
 
 void expect( Parser& parser, TokenId token, const std::string& error ) {
-	if ( parser.token_iterator->token_type == token ) {
+	if ( peek_token( parser, parser.token_index ).token_type == token ) {
 		advance_token( parser );
 		return;
 	}
@@ -408,7 +712,7 @@ void expect( Parser& parser, TokenId token, const std::string& error ) {
 }
 
 bool match( Parser& parser, TokenId token ) {
-	if ( parser.token_iterator->token_type == token ) {
+	if ( peek_token( parser, parser.token_index ).token_type == token ) {
 		advance_token( parser );
 		return true;
 	}
@@ -417,63 +721,136 @@ bool match( Parser& parser, TokenId token ) {
 }
 
 bool is_finished( Parser& parser ) {
-	return parser.token_iterator == parser.tokens.end();
+	return get_current_token( parser ).token_type == TokenId::token_eof;
 }
 
 void emit_load_number( Parser& parser, double number ) {
 	encoded_value value;
 	value.data.dbl = number;
 
+	parser.constant_loads.push_back( parser.functions[ parser.current_function ].code.size() );
+
 	emit( parser, OpCode::op_load_number );
 	emit( parser, value.data.uint32[ 0 ] );
 	emit( parser, value.data.uint32[ 1 ] );
 }
 
+// True when an op_load_number starts exactly at 'offset'
+bool constant_at( Parser& parser, size_t offset, double* number ) {
+	auto& code = parser.functions[ parser.current_function ].code;
+	auto& loads = parser.constant_loads;
+
+	for ( auto i = loads.size(); i > 0 && loads[ i - 1 ] >= offset; --i ) {
+		if ( loads[ i - 1 ] == offset ) {
+			encoded_value value;
+			value.data.uint32[ 0 ] = code[ offset + 1 ];
+			value.data.uint32[ 1 ] = code[ offset + 2 ];
+
+			*number = value.data.dbl;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// True when the code emitted since 'offset' is a single constant load
+bool is_constant_expression( Parser& parser, size_t offset, double* number ) {
+	auto& code = parser.functions[ parser.current_function ].code;
+	return code.size() == offset + 3 && constant_at( parser, offset, number );
+}
+
+void drop_code( Parser& parser, size_t offset ) {
+	parser.functions[ parser.current_function ].code.resize( offset );
+
+	if ( parser.last_call != SIZE_MAX && parser.last_call >= offset ) {
+		parser.last_call = SIZE_MAX;
+	}
+
+	while ( parser.constant_loads.size() > 0 && parser.constant_loads.back() >= offset ) {
+		parser.constant_loads.pop_back();
+	}
+}
+
+size_t code_offset( Parser& parser ) {
+	return parser.functions[ parser.current_function ].code.size();
+}
+
+double fold_binary( OpCode op, double a, double b ) {
+	switch ( op ) {
+	case OpCode::op_add: return a + b;
+	case OpCode::op_sub: return a - b;
+	case OpCode::op_mul: return a * b;
+	case OpCode::op_div: return a / b;
+	case OpCode::op_gt: return a > b ? 1.0 : 0.0;
+	case OpCode::op_lt: return a < b ? 1.0 : 0.0;
+	case OpCode::op_eq: return a == b ? 1.0 : 0.0;
+	case OpCode::op_ne: return a != b ? 1.0 : 0.0;
+	default: throw std::exception( "Can not fold operator" );
+	}
+}
+
 void parse_number( Parser& parser ) {
-	auto& token = get_previous_token( parser );
-	double number = std::stod( token.token_string );
+	auto text = token_text( parser, get_previous_token( parser ) );
+
+	double number = std::stod( std::string( text ) );
 
 	emit_load_number( parser, number );
 }
 
-void parse_binary( Parser& parser ) {
+void parse_binary( Parser& parser, size_t lhs_offset ) {
 	auto token = get_previous_token( parser );
+	auto rhs_offset = code_offset( parser );
 
-	parse_precedence( parser, token.lbp );
+	parse_precedence( parser, token_lbp( token.token_type ) );
+
+	OpCode op;
 
 	switch ( token.token_type ) {
-	case TokenId::token_plus: emit( parser, OpCode::op_add ); break;
-	case TokenId::token_minus: emit( parser, OpCode::op_sub );  break;
-	case TokenId::token_star: emit( parser, OpCode::op_mul ); break;
-	case TokenId::token_slash: emit( parser, OpCode::op_div ); break;
-	case TokenId::token_lessthan: emit( parser, OpCode::op_lt ); break;
-	case TokenId::token_morethan: emit( parser, OpCode::op_gt ); break;
-	case TokenId::token_2equals: emit( parser, OpCode::op_eq ); break;
-	case TokenId::token_notequals: emit( parser, OpCode::op_ne ); break;
-	default: break;
+	case TokenId::token_plus: op = OpCode::op_add; break;
+	case TokenId::token_minus: op = OpCode::op_sub;  break;
+	case TokenId::token_star: op = OpCode::op_mul; break;
+	case TokenId::token_slash: op = OpCode::op_div; break;
+	case TokenId::token_lessthan: op = OpCode::op_lt; break;
+	case TokenId::token_morethan: op = OpCode::op_gt; break;
+	case TokenId::token_2equals: op = OpCode::op_eq; break;
+	case TokenId::token_notequals: op = OpCode::op_ne; break;
+	default: return;
+	}
+
+	double lhs, rhs;
+
+	// Both operands known, replace the two loads with the result
+	if ( rhs_offset == lhs_offset + 3 && constant_at( parser, lhs_offset, &lhs ) && is_constant_expression( parser, rhs_offset, &rhs ) ) {
+		drop_code( parser, lhs_offset );
+		emit_load_number( parser, fold_binary( op, lhs, rhs ) );
+		return;
 	}
+
+	emit( parser, op );
 }
 
 void parse_assignment( Parser& parser ) {
 	auto identifier_token = get_previous_token( parser, 1 );
 
 	if ( identifier_token.token_type != TokenId::token_identifier ) {
-		throw std::exception( ( "Expected an identifier, got '" + identifier_token.token_string + "'" ).c_str() );
+		throw std::exception( ( "Expected an identifier, got '" + std::string( token_text( parser, identifier_token ) ) + "'" ).c_str() );
 	}
 
 	Parser::Slot slot;
-	if ( !find_variable( parser, identifier_token.token_string, &slot ) ) {
-		throw std::exception( ( "Identifier '" + identifier_token.token_string + "' not found" ).c_str() );
+	if ( !find_variable( parser, token_symbol( parser, identifier_token ), &slot ) ) {
+		throw std::exception( ( "Identifier '" + std::string( token_text( parser, identifier_token ) ) + "' not found" ).c_str() );
 	}
 
 	if ( !slot.is_defined ) {
-		throw std::exception( ( "Can not refer to identifier '" + slot.name + "' before it is initialized" ).c_str() );
+		throw std::exception( ( "Can not refer to identifier '" + symbol_name( slot.name ) + "' before it is initialized" ).c_str() );
 	}
 
 	if ( slot.is_const ) {
-		throw std::exception( ( "Can not reassign constant identifier '" + slot.name + "'" ).c_str() );
+		throw std::exception( ( "Can not reassign constant identifier '" + symbol_name( slot.name ) + "'" ).c_str() );
 	}
 
+	check_frame_access( parser, slot );
 	expression( parser );
 
 	emit( parser, OpCode::op_set_slot );
@@ -486,21 +863,25 @@ void parse_identifier( Parser& parser, bool can_assign ) {
 	Parser::Slot slot;
 	int function_index;
 
-	if ( find_variable( parser, identifier_token.token_string, &slot ) ) {
+	if ( find_variable( parser, token_symbol( parser, identifier_token ), &slot ) ) {
 		if ( !slot.is_defined ) {
-			throw std::exception( ( "Can not refer to identifier '" + slot.name + "' before it is initialized" ).c_str() );
+			throw std::exception( ( "Can not refer to identifier '" + symbol_name( slot.name ) + "' before it is initialized" ).c_str() );
 		}
 
 		if ( can_assign && match( parser, TokenId::token_equals ) ) {
 			parse_assignment( parser );
+		} else if ( slot.has_value ) {
+			emit_load_number( parser, slot.value );
 		} else {
+			check_frame_access( parser, slot );
+
 			emit( parser, OpCode::op_load_slot );
 			emit( parser, slot.slot_index );
 		}
-	} else if ( find_function( parser, identifier_token.token_string, &function_index ) ) {
+	} else if ( find_function( parser, token_symbol( parser, identifier_token ), &function_index ) ) {
 		// No-op
 	} else {
-		throw std::exception( ( "Identifier '" + identifier_token.token_string + "' not found" ).c_str() );
+		throw std::exception( ( "Identifier '" + std::string( token_text( parser, identifier_token ) ) + "' not found" ).c_str() );
 	}
 }
 
@@ -513,14 +894,16 @@ void parse_call( Parser& parser ) {
 	auto identifier_token = get_previous_token( parser, 1 );
 
 	if ( identifier_token.token_type != TokenId::token_identifier ) {
-		throw std::exception( ( "Expected an identifier, got '" + identifier_token.token_string + "'" ).c_str() );
+		throw std::exception( ( "Expected an identifier, got '" + std::string( token_text( parser, identifier_token ) ) + "'" ).c_str() );
 	}
 
 	int function_index;
-	if ( !find_function( parser, identifier_token.token_string, &function_index ) ) {
-		throw std::exception( ( "Identifier '" + identifier_token.token_string + "' not found" ).c_str() );
+	if ( !find_function( parser, token_symbol( parser, identifier_token ), &function_index ) ) {
+		throw std::exception( ( "Identifier '" + std::string( token_text( parser, identifier_token ) ) + "' not found" ).c_str() );
 	}
 
+	parser.last_call = code_offset( parser );
+
 	if ( match( parser, TokenId::token_paren_right ) ) {
 		emit( parser, OpCode::op_call );
 		emit( parser, function_index );
@@ -533,6 +916,7 @@ void parse_call( Parser& parser ) {
 			expression( parser );
 		} while ( match( parser, TokenId::token_comma ) );
 
+		parser.last_call = code_offset( parser );
 		emit( parser, OpCode::op_call );
 		emit( parser, function_index );
 		emit( parser, arg_count );
@@ -542,11 +926,12 @@ void parse_call( Parser& parser ) {
 }
 
 void parse_precedence( Parser& parser, int rbp ) {
-	const Token* current_token = &advance_token( parser );
+	auto current_token = advance_token( parser );
+	auto expression_offset = code_offset( parser );
 
 	auto can_assign = rbp <= ParserPrecedence::prec_assignment;
 	
-	switch ( current_token->token_type ) {
+	switch ( current_token.token_type ) {
 	case TokenId::token_number: parse_number( parser ); break;
 	case TokenId::token_identifier: parse_identifier( parser, can_assign ); break;
 	case TokenId::token_paren_left: parse_grouping( parser ); break;
@@ -554,10 +939,10 @@ void parse_precedence( Parser& parser, int rbp ) {
 		throw std::exception( "Expected oneof: token_number, token_identifier" );
 	}
 
-	while ( rbp < get_current_token( parser ).lbp ) {
-		current_token = &advance_token( parser );
+	while ( rbp < token_lbp( get_current_token( parser ).token_type ) ) {
+		current_token = advance_token( parser );
 
-		switch ( current_token->token_type ) {
+		switch ( current_token.token_type ) {
 		case TokenId::token_plus:
 		case TokenId::token_minus:
 		case TokenId::token_star:
@@ -566,7 +951,7 @@ void parse_precedence( Parser& parser, int rbp ) {
 		case TokenId::token_morethan:
 		case TokenId::token_2equals:
 		case TokenId::token_notequals:
-			parse_binary( parser );
+			parse_binary( parser, expression_offset );
 			break;
 		case TokenId::token_paren_left:
 			parse_call( parser );
@@ -585,15 +970,23 @@ void const_declaration( Parser& parser ) {
 	expect( parser, TokenId::token_identifier, "Expected identifier after 'Const'" );
 
 	auto identifier_token = get_previous_token( parser );
-	auto& slot = create_variable( parser, identifier_token.token_string, true );
+	auto& slot = create_variable( parser, token_symbol( parser, identifier_token ), true );
+	auto slot_index = slot.slot_index;
 
 	if ( match( parser, TokenId::token_equals ) ) {
+		auto expression_offset = code_offset( parser );
 		expression( parser );
+
+		auto& defined_slot = frame_slot( parser, slot_index );
+		defined_slot.has_value = is_constant_expression( parser, expression_offset, &defined_slot.value );
 	} else {
 		emit( parser, OpCode::op_load_zero );
+
+		frame_slot( parser, slot_index ).has_value = true;
+		frame_slot( parser, slot_index ).value = 0.0;
 	}
 
-	define_variable( parser, slot.slot_index );
+	define_variable( parser, slot_index );
 	expect( parser, TokenId::token_semicolon, "Expected ';' after constant declaration" );
 }
 
@@ -601,7 +994,7 @@ void any_declaration( Parser& parser ) {
 	expect( parser, TokenId::token_identifier, "Expected identifier after 'Any'" );
 
 	auto identifier_token = get_previous_token( parser );
-	auto& slot = create_variable( parser, identifier_token.token_string, false );
+	auto& slot = create_variable( parser, token_symbol( parser, identifier_token ), false );
 
 	if ( match( parser, TokenId::token_equals ) ) {
 		expression( parser );
@@ -617,15 +1010,17 @@ void function_declaration( Parser& parser ) {
 	expect( parser, TokenId::token_identifier, "Expected identifier after 'Fn'" );
 
 	auto identifier_token = get_previous_token( parser );
-	create_function( parser, identifier_token.token_string, FunctionType::fn_virtual );
+	create_function( parser, token_symbol( parser, identifier_token ), FunctionType::fn_virtual );
 
 	if ( !match( parser, TokenId::token_colon ) ) {
 		do {
 			expect( parser, TokenId::token_identifier, "Expected identifier or ':'" );
 			auto arg_identifier = get_previous_token( parser );
 
-			auto arg_variable = create_variable( parser, arg_identifier.token_string, true );
+			auto arg_variable = create_variable( parser, token_symbol( parser, arg_identifier ), true );
 			define_variable( parser, arg_variable.slot_index );
+
+			++parser.functions[ parser.current_function ].arg_count;
 		} while ( match( parser, TokenId::token_comma ) );
 
 		expect( parser, TokenId::token_colon, "Expected ':' after argument list" );
@@ -644,20 +1039,54 @@ void return_statement( Parser& parser ) {
 		emit( parser, OpCode::op_load_zero );
 		emit( parser, OpCode::op_return );
 	} else {
+		auto value_offset = code_offset( parser );
 		expression( parser );
 
-		emit( parser, OpCode::op_return );
+		auto& function = parser.functions[ parser.current_function ];
+
+		// Main and <global> keep their frame, it holds the globals
+		bool tail_call = parser.last_call != SIZE_MAX && parser.last_call >= value_offset && parser.last_call + 3 == function.code.size()
+			&& function.code[ parser.last_call ] == OpCode::op_call && function.type != FunctionType::fn_global && function.name != parser.main_symbol;
+
+		if ( tail_call ) {
+			function.code[ parser.last_call ] = OpCode::op_tail_call;
+		} else {
+			emit( parser, OpCode::op_return );
+		}
+
 		expect( parser, TokenId::token_semicolon, "Expected ';' after return value" );
 	}
 }
 
 void if_statement( Parser& parser ) {
+	auto condition_offset = code_offset( parser );
 	expression( parser );
 
 	match( parser, TokenId::token_paren_right ); // skip ')'
 
 	expect( parser, TokenId::token_then, "Expected 'Then'" );
 
+	double condition;
+
+	// Known condition, emit the body unconditionally or not at all
+	if ( is_constant_expression( parser, condition_offset, &condition ) ) {
+		drop_code( parser, condition_offset );
+		create_scope( parser );
+
+		while ( !match( parser, TokenId::token_end ) ) {
+			statement( parser );
+		}
+
+		destroy_scope( parser );
+
+		if ( condition == 0.0 ) {
+			drop_code( parser, condition_offset );
+		}
+
+		expect( parser, TokenId::token_if, "Expected 'If' after 'End'" );
+		return;
+	}
+
 	Parser::Label jzLabel( "jz_label" );
 	Parser::Label jmpLabel( "jmp_Label" );
 
@@ -752,30 +1181,44 @@ void declaration( Parser& parser ) {
 	}  else if ( match( parser, TokenId::token_function ) ) {
 		function_declaration( parser );
 	} else {
-		throw std::exception( ( "Expected a declaration, got: '" + get_current_token( parser ).token_string + "'" ).c_str() );
+		throw std::exception( ( "Expected a declaration, got: '" + std::string( token_text( parser, get_current_token( parser ) ) ) + "'" ).c_str() );
 	}
 }
 
-void parse( const std::vector< Token >& tokens, Program* program ) {
-	Parser parser;
-
-	parser.tokens = tokens;
-	parser.token_iterator = parser.tokens.begin();
+void parse_program( Parser& parser, Program* program ) {
+	parser.token_index = 0;
+	parser.token_window.pulled = 0;
 	parser.stack_depth = 0;
+	parser.main_globals = -1;
+	parser.main_symbol = intern_symbol( "Main" );
 
-	create_function( parser, "<global>", FunctionType::fn_global );
+	create_function( parser, intern_symbol( "<global>" ), FunctionType::fn_global );
 
 	while ( !match( parser, token_eof ) ) {
 		declaration( parser );
 	}
 
+	// Main runs on top of all globals, including the ones declared after it
+	auto later_globals = ( uint32_t ) ( parser.stack.size() - parser.main_globals );
+
+	if ( parser.main_globals != -1 && later_globals > 0 ) {
+		auto& code = parser.functions[ parser.symbol_functions[ parser.main_symbol ] ].code;
+
+		for ( size_t offset = 0; offset < code.size(); offset += opcode_length( code[ offset ] ) ) {
+			if ( is_slot_access( code[ offset ] ) && code[ offset + 1 ] >= ( uint32_t ) parser.main_globals ) {
+				code[ offset + 1 ] += later_globals;
+			}
+		}
+	}
+
 	finish_function( parser );
 
 	program->functions = parser.functions;
 	program->global = 0;
 
-	auto main_function = std::find_if( program->functions.begin(), program->functions.end(), []( const Function& fn ) {
-		return fn.name == "Main";
+	auto main_symbol = parser.main_symbol;
+	auto main_function = std::find_if( program->functions.begin(), program->functions.end(), [ main_symbol ]( const Function& fn ) {
+		return fn.name == main_symbol;
 	} );
 
 	if ( main_function == program->functions.end() ) {
@@ -786,190 +1229,2030 @@ void parse( const std::vector< Token >& tokens, Program* program ) {
 	program->main = std::distance( program->functions.begin(), main_function );
 }
 
-struct VM {
-	struct Frame {
-		const uint32_t*		code;
-		const uint32_t*		ip;
-		double*				base;
-	};
+void parse( const TokenStream& tokens, Program* program ) {
+	Parser parser;
 
-	double*							stack;
-	double*							stack_top;
-	std::vector< Frame >			frames;
-	Program							program;
-};
+	parser.token_window.source = tokens.source;
+	parser.token_window.source_cursor = 0;
+	parser.token_window.stream = &tokens;
 
-double stack_pop( VM& vm ) {
-	--vm.stack_top;
+	parse_program( parser, program );
+}
 
-	if ( vm.stack_top < vm.stack ) {
-		throw std::exception( "Stack underflow" );
+void parse( const std::string_view& source, Program* program ) {
+	if ( source.length() > UINT32_MAX ) {
+		throw std::exception( "Source exceeds 4 GB" );
 	}
 
-	return *vm.stack_top;
+	Parser parser;
+
+	parser.token_window.source = source;
+	parser.token_window.source_cursor = 0;
+	parser.token_window.stream = NULL;
+
+	parse_program( parser, program );
 }
 
-void stack_push( VM& vm, double value ) {
-	*vm.stack_top = value;
-	++vm.stack_top;
+// Peephole optimizer
+struct PeepholeInstruction {
+	uint32_t					op;
+	uint32_t					operands[ 3 ];
+	uint32_t					length;
+	size_t						target;
+	bool						removed;
+};
 
-	if ( vm.stack_top - vm.stack >= 255 ) {
-		throw std::exception( "Maximum VM stack size exceeded" );
+uint32_t opcode_length( uint32_t op ) {
+	switch ( op ) {
+	case OpCode::op_add_slot_imm:
+	case OpCode::op_sub_slot_imm:
+	case OpCode::op_mul_slot_imm:
+	case OpCode::op_div_slot_imm:
+		return 4;
+	case OpCode::op_load_number:
+	case OpCode::op_call:
+	case OpCode::op_tail_call:
+		return 3;
+	case OpCode::op_load_slot:
+	case OpCode::op_set_slot:
+	case OpCode::op_store_slot:
+	case OpCode::op_jz:
+	case OpCode::op_jz_pop:
+	case OpCode::op_jmp:
+	case OpCode::op_gt_jz:
+	case OpCode::op_lt_jz:
+	case OpCode::op_eq_jz:
+	case OpCode::op_ne_jz:
+		return 2;
+	default:
+		return 1;
 	}
 }
 
-#define arit_op( op ) { \
-	auto b = stack_pop( vm ); \
-	auto a = stack_pop( vm ); \
-	stack_push( vm, a op b ); \
+const char* opcode_name( uint32_t op ) {
+	switch ( op ) {
+	case OpCode::op_add: return "op_add";
+	case OpCode::op_sub: return "op_sub";
+	case OpCode::op_mul: return "op_mul";
+	case OpCode::op_div: return "op_div";
+	case OpCode::op_load_number: return "op_load_number";
+	case OpCode::op_load_zero: return "op_load_zero";
+	case OpCode::op_load_slot: return "op_load_slot";
+	case OpCode::op_pop: return "op_pop";
+	case OpCode::op_return: return "op_return";
+	case OpCode::op_call: return "op_call";
+	case OpCode::op_jz: return "op_jz";
+	case OpCode::op_jmp: return "op_jmp";
+	case OpCode::op_gt: return "op_gt";
+	case OpCode::op_lt: return "op_lt";
+	case OpCode::op_eq: return "op_eq";
+	case OpCode::op_ne: return "op_ne";
+	case OpCode::op_set_slot: return "op_set_slot";
+	case OpCode::op_jz_pop: return "op_jz_pop";
+	case OpCode::op_tail_call: return "op_tail_call";
+	case OpCode::op_add_slot_imm: return "op_add_slot_imm";
+	case OpCode::op_sub_slot_imm: return "op_sub_slot_imm";
+	case OpCode::op_mul_slot_imm: return "op_mul_slot_imm";
+	case OpCode::op_div_slot_imm: return "op_div_slot_imm";
+	case OpCode::op_gt_jz: return "op_gt_jz";
+	case OpCode::op_lt_jz: return "op_lt_jz";
+	case OpCode::op_eq_jz: return "op_eq_jz";
+	case OpCode::op_ne_jz: return "op_ne_jz";
+	case OpCode::op_store_slot: return "op_store_slot";
+	default: return "op_invalid";
+	}
 }
 
-#define binary_op( op ) { \
-	auto b = stack_pop( vm ); \
-	auto a = stack_pop( vm ); \
-	stack_push( vm, a op b ? 1.0 : 0.0 ); \
+bool is_jump( uint32_t op ) {
+	switch ( op ) {
+	case OpCode::op_jz:
+	case OpCode::op_jz_pop:
+	case OpCode::op_jmp:
+	case OpCode::op_gt_jz:
+	case OpCode::op_lt_jz:
+	case OpCode::op_eq_jz:
+	case OpCode::op_ne_jz:
+		return true;
+	default:
+		return false;
+	}
 }
 
-double execute( VM& vm, const Function& fn ) {
-	const uint32_t* code = fn.code.data();
-	double* base = vm.stack;
+bool falls_through( uint32_t op ) {
+	return op != OpCode::op_jmp && op != OpCode::op_return && op != OpCode::op_tail_call;
+}
 
-	for ( const uint32_t* ip = code;; ++ip ) {
-		switch ( *ip ) {
-		case OpCode::op_add: arit_op( + ); break;
-		case OpCode::op_sub: arit_op( - ); break;
+// Removed instructions are skipped, a jump to one lands on the next live instruction
+size_t live_index( const std::vector< PeepholeInstruction >& instructions, size_t index ) {
+	while ( index < instructions.size() && instructions[ index ].removed ) {
+		++index;
+	}
+
+	return index;
+}
+
+size_t next_live( const std::vector< PeepholeInstruction >& instructions, size_t index ) {
+	return live_index( instructions, index + 1 );
+}
+
+std::vector< PeepholeInstruction > decode_instructions( const std::vector< uint32_t >& code ) {
+	std::vector< PeepholeInstruction > instructions;
+	std::vector< size_t > instruction_at( code.size() + 1, SIZE_MAX );
+
+	for ( size_t offset = 0; offset < code.size(); ) {
+		PeepholeInstruction instruction{ code[ offset ], { 0, 0, 0 }, opcode_length( code[ offset ] ), SIZE_MAX, false };
+
+		for ( uint32_t i = 1; i < instruction.length; ++i ) {
+			instruction.operands[ i - 1 ] = code[ offset + i ];
+		}
+
+		instruction_at[ offset ] = instructions.size();
+		instructions.push_back( instruction );
+		offset += instruction.length;
+	}
+
+	instruction_at[ code.size() ] = instructions.size();
+
+	size_t instruction_offset = 0;
+	for ( auto& instruction : instructions ) {
+		if ( is_jump( instruction.op ) ) {
+			encoded_value value;
+			value.data.uint32[ 0 ] = instruction.operands[ 0 ];
+
+			instruction.target = instruction_at[ instruction_offset + 2 + value.data.int32[ 0 ] ];
+		}
+
+		instruction_offset += instruction.length;
+	}
+
+	return instructions;
+}
+
+// Re-encodes the live instructions with every jump relinked to the new offsets
+std::vector< uint32_t > encode_instructions( std::vector< PeepholeInstruction >& instructions ) {
+	auto count = instructions.size();
+	std::vector< uint32_t > new_offsets( count + 1, 0 );
+	uint32_t new_size = 0;
+
+	for ( size_t i = 0; i < count; ++i ) {
+		new_offsets[ i ] = new_size;
+
+		if ( !instructions[ i ].removed ) {
+			new_size += instructions[ i ].length;
+		}
+	}
+
+	new_offsets[ count ] = new_size;
+
+	std::vector< uint32_t > new_code;
+	new_code.reserve( new_size );
+
+	for ( size_t i = 0; i < count; ++i ) {
+		auto& instruction = instructions[ i ];
+
+		if ( instruction.removed ) {
+			continue;
+		}
+
+		if ( is_jump( instruction.op ) ) {
+			encoded_value value;
+			value.data.int32[ 0 ] = ( int32_t ) new_offsets[ live_index( instructions, instruction.target ) ] - ( int32_t ) ( new_code.size() + 2 );
+			instruction.operands[ 0 ] = value.data.uint32[ 0 ];
+		}
+
+		new_code.push_back( instruction.op );
+
+		for ( uint32_t j = 1; j < instruction.length; ++j ) {
+			new_code.push_back( instruction.operands[ j - 1 ] );
+		}
+	}
+
+	return new_code;
+}
+
+// Number of live jumps landing on each instruction
+std::vector< int > count_jumps_to( const std::vector< PeepholeInstruction >& instructions ) {
+	std::vector< int > jumps_to( instructions.size() + 1, 0 );
+
+	for ( auto& instruction : instructions ) {
+		if ( !instruction.removed && is_jump( instruction.op ) ) {
+			++jumps_to[ live_index( instructions, instruction.target ) ];
+		}
+	}
+
+	return jumps_to;
+}
+
+size_t peephole_optimize( Function* function ) {
+	auto instructions = decode_instructions( function->code );
+	auto count = instructions.size();
+	bool changed = true;
+
+	while ( changed ) {
+		changed = false;
+
+		// Reachability from the entry, everything not reached is dead code
+		std::vector< bool > reachable( count + 1, false );
+		std::vector< size_t > work{ live_index( instructions, 0 ) };
+
+		while ( work.size() > 0 ) {
+			auto index = work.back();
+			work.pop_back();
+
+			if ( index >= count || reachable[ index ] ) {
+				continue;
+			}
+
+			reachable[ index ] = true;
+			auto& instruction = instructions[ index ];
+
+			if ( is_jump( instruction.op ) ) {
+				work.push_back( live_index( instructions, instruction.target ) );
+			}
+
+			if ( falls_through( instruction.op ) ) {
+				work.push_back( next_live( instructions, index ) );
+			}
+		}
+
+		for ( size_t i = 0; i < count; ++i ) {
+			if ( !instructions[ i ].removed && !reachable[ i ] ) {
+				instructions[ i ].removed = true;
+				changed = true;
+			}
+		}
+
+		auto jumps_to = count_jumps_to( instructions );
+
+		for ( size_t i = live_index( instructions, 0 ); i < count; i = next_live( instructions, i ) ) {
+			auto& instruction = instructions[ i ];
+			auto next = next_live( instructions, i );
+
+			// Jump to the next instruction, jumps to it fall through to the same place
+			if ( instruction.op == OpCode::op_jmp && live_index( instructions, instruction.target ) == next ) {
+				instruction.removed = true;
+				jumps_to[ next ] += jumps_to[ i ] - 1;
+				changed = true;
+				continue;
+			}
+
+			if ( next >= count ) {
+				continue;
+			}
+
+			auto& next_instruction = instructions[ next ];
+
+			// Value loaded only to be discarded
+			bool is_load = instruction.op == OpCode::op_load_slot
+				|| instruction.op == OpCode::op_load_number
+				|| instruction.op == OpCode::op_load_zero;
+
+			if ( is_load && next_instruction.op == OpCode::op_pop && jumps_to[ next ] == 0 ) {
+				instruction.removed = true;
+				next_instruction.removed = true;
+				jumps_to[ next_live( instructions, next ) ] += jumps_to[ i ];
+				changed = true;
+				continue;
+			}
+
+			// Both arms of a jz start by popping the condition, pop it in the jump instead
+			if ( instruction.op == OpCode::op_jz && next_instruction.op == OpCode::op_pop && jumps_to[ next ] == 0 ) {
+				auto target = live_index( instructions, instruction.target );
+
+				if ( target >= count || instructions[ target ].op != OpCode::op_pop || jumps_to[ target ] != 1 ) {
+					continue;
+				}
+
+				// The pop at the target must only be reachable through this jump
+				auto before_target = target - 1;
+				while ( before_target > i && instructions[ before_target ].removed ) {
+					--before_target;
+				}
+
+				auto before_op = instructions[ before_target ].op;
+				if ( before_target == i || falls_through( before_op ) ) {
+					continue;
+				}
+
+				instruction.op = OpCode::op_jz_pop;
+				next_instruction.removed = true;
+				instructions[ target ].removed = true;
+				++jumps_to[ next_live( instructions, target ) ];
+				changed = true;
+			}
+		}
+	}
+
+	auto new_code = encode_instructions( instructions );
+	auto removed_words = function->code.size() - new_code.size();
+	function->code = new_code;
+	function->max_stack = max_stack_depth( *function );
+
+	return removed_words;
+}
+
+bool fused_slot_imm( uint32_t op, OpCode* fused ) {
+	switch ( op ) {
+	case OpCode::op_add: *fused = OpCode::op_add_slot_imm; return true;
+	case OpCode::op_sub: *fused = OpCode::op_sub_slot_imm; return true;
+	case OpCode::op_mul: *fused = OpCode::op_mul_slot_imm; return true;
+	case OpCode::op_div: *fused = OpCode::op_div_slot_imm; return true;
+	default: return false;
+	}
+}
+
+bool fused_compare_jz( uint32_t op, OpCode* fused ) {
+	switch ( op ) {
+	case OpCode::op_gt: *fused = OpCode::op_gt_jz; return true;
+	case OpCode::op_lt: *fused = OpCode::op_lt_jz; return true;
+	case OpCode::op_eq: *fused = OpCode::op_eq_jz; return true;
+	case OpCode::op_ne: *fused = OpCode::op_ne_jz; return true;
+	default: return false;
+	}
+}
+
+size_t fuse_superinstructions( Function* function ) {
+	auto instructions = decode_instructions( function->code );
+	auto jumps_to = count_jumps_to( instructions );
+	auto count = instructions.size();
+
+	// Only the first instruction of a fused sequence may be a jump target
+	for ( size_t i = 0; i < count; ++i ) {
+		auto& instruction = instructions[ i ];
+
+		// Already folded into an earlier fusion
+		if ( instruction.removed ) {
+			continue;
+		}
+
+		auto next = next_live( instructions, i );
+		auto after_next = next < count ? next_live( instructions, next ) : count;
+		OpCode fused;
+
+		// load_slot, load_number, arithmetic
+		if ( instruction.op == OpCode::op_load_slot && after_next < count
+			&& instructions[ next ].op == OpCode::op_load_number
+			&& fused_slot_imm( instructions[ after_next ].op, &fused )
+			&& jumps_to[ next ] == 0 && jumps_to[ after_next ] == 0 ) {
+			instruction.op = fused;
+			instruction.length = 4;
+			instruction.operands[ 1 ] = instructions[ next ].operands[ 0 ];
+			instruction.operands[ 2 ] = instructions[ next ].operands[ 1 ];
+
+			instructions[ next ].removed = true;
+			instructions[ after_next ].removed = true;
+			continue;
+		}
+
+		if ( next >= count || jumps_to[ next ] != 0 ) {
+			continue;
+		}
+
+		// Comparison, branch on its result
+		if ( fused_compare_jz( instruction.op, &fused ) && instructions[ next ].op == OpCode::op_jz_pop ) {
+			instruction.op = fused;
+			instruction.length = 2;
+			instruction.target = instructions[ next ].target;
+
+			instructions[ next ].removed = true;
+			continue;
+		}
+
+		// set_slot, pop
+		if ( instruction.op == OpCode::op_set_slot && instructions[ next ].op == OpCode::op_pop ) {
+			instruction.op = OpCode::op_store_slot;
+			instructions[ next ].removed = true;
+		}
+	}
+
+	auto new_code = encode_instructions( instructions );
+	auto removed_words = function->code.size() - new_code.size();
+	function->code = new_code;
+	function->max_stack = max_stack_depth( *function );
+
+	return removed_words;
+}
+
+StackEffect stack_effect( const uint32_t* instruction ) {
+	switch ( instruction[ 0 ] ) {
+	case OpCode::op_load_number:
+	case OpCode::op_load_zero:
+	case OpCode::op_load_slot:
+	case OpCode::op_add_slot_imm:
+	case OpCode::op_sub_slot_imm:
+	case OpCode::op_mul_slot_imm:
+	case OpCode::op_div_slot_imm:
+		return { 0, 1 };
+	case OpCode::op_add:
+	case OpCode::op_sub:
+	case OpCode::op_mul:
+	case OpCode::op_div:
+	case OpCode::op_gt:
+	case OpCode::op_lt:
+	case OpCode::op_eq:
+	case OpCode::op_ne:
+		return { 2, 1 };
+	case OpCode::op_call:
+		return { ( int ) instruction[ 2 ], 1 };
+	case OpCode::op_tail_call:
+		return { ( int ) instruction[ 2 ], 0 };
+	case OpCode::op_gt_jz:
+	case OpCode::op_lt_jz:
+	case OpCode::op_eq_jz:
+	case OpCode::op_ne_jz:
+		return { 2, 0 };
+	case OpCode::op_set_slot:
+	case OpCode::op_jz:
+		return { 1, 1 };
+	case OpCode::op_jmp:
+		return { 0, 0 };
+	default:
+		return { 1, 0 };
+	}
+}
+
+uint32_t max_stack_depth( const Function& function ) {
+	auto& code = function.code;
+
+	// Depth before each reachable instruction, -1 until a path reaches it
+	std::vector< int > depths( code.size(), -1 );
+	std::vector< size_t > pending = { 0 };
+	int max_depth = 0;
+
+	depths[ 0 ] = 0;
+
+	while ( pending.size() > 0 ) {
+		auto offset = pending.back();
+		pending.pop_back();
+
+		auto op = code[ offset ];
+		auto effect = stack_effect( &code[ offset ] );
+
+		if ( depths[ offset ] < effect.pops ) {
+			throw std::exception( "Stack underflow in function" );
+		}
+
+		auto depth = depths[ offset ] - effect.pops + effect.pushes;
+		max_depth = std::max( max_depth, depth );
+
+		auto visit = [ & ]( size_t target ) {
+			if ( target >= code.size() ) {
+				throw std::exception( "Jump outside of function" );
+			}
+
+			if ( depths[ target ] == -1 ) {
+				depths[ target ] = depth;
+				pending.push_back( target );
+			}
+		};
+
+		if ( is_jump( op ) ) {
+			encoded_value value;
+			value.data.uint32[ 0 ] = code[ offset + 1 ];
+			visit( offset + 2 + value.data.int32[ 0 ] );
+		}
+
+		if ( falls_through( op ) ) {
+			visit( offset + opcode_length( op ) );
+		}
+	}
+
+	return ( uint32_t ) max_depth;
+}
+
+// Bytecode verifier
+
+bool is_slot_access( uint32_t op ) {
+	switch ( op ) {
+	case OpCode::op_load_slot:
+	case OpCode::op_set_slot:
+	case OpCode::op_store_slot:
+	case OpCode::op_add_slot_imm:
+	case OpCode::op_sub_slot_imm:
+	case OpCode::op_mul_slot_imm:
+	case OpCode::op_div_slot_imm:
+		return true;
+	default:
+		return false;
+	}
+}
+
+void verify_error( const Function& function, size_t offset, const std::string& message ) {
+	throw std::exception( ( "Invalid bytecode in '" + symbol_name( function.name ) + "' at " + std::to_string( offset ) + ": " + message ).c_str() );
+}
+
+// 'frame_size' is the number of slots below the operand stack on entry. Returns the lowest depth
+// left under the return value by a return, the globals <global> leaves behind for Main.
+int verify_function( const Program& program, const Function& function, int frame_size ) {
+	auto& code = function.code;
+
+	if ( code.size() == 0 ) {
+		verify_error( function, 0, "empty function" );
+	}
+
+	std::vector< bool > boundaries( code.size(), false );
+
+	for ( size_t offset = 0; offset < code.size(); offset += opcode_length( code[ offset ] ) ) {
+		if ( code[ offset ] > OpCode::op_store_slot ) {
+			verify_error( function, offset, "invalid instruction '" + std::to_string( code[ offset ] ) + "'" );
+		}
+
+		if ( offset + opcode_length( code[ offset ] ) > code.size() ) {
+			verify_error( function, offset, "missing operands" );
+		}
+
+		boundaries[ offset ] = true;
+	}
+
+	// Depth above the frame before each reachable instruction, -1 until a path reaches it
+	std::vector< int > depths( code.size(), -1 );
+	std::vector< size_t > pending = { 0 };
+	int max_depth = 0;
+	int return_depth = INT_MAX;
+
+	depths[ 0 ] = 0;
+
+	while ( pending.size() > 0 ) {
+		auto offset = pending.back();
+		pending.pop_back();
+
+		auto op = code[ offset ];
+		auto effect = stack_effect( &code[ offset ] );
+
+		if ( depths[ offset ] < effect.pops ) {
+			verify_error( function, offset, "stack underflow" );
+		}
+
+		if ( is_slot_access( op ) ) {
+			// A stored value is popped before the slot is written, so the slot must lie below it
+			auto slot_limit = frame_size + depths[ offset ] - ( op == OpCode::op_store_slot ? 1 : 0 );
+
+			if ( code[ offset + 1 ] >= ( uint32_t ) slot_limit ) {
+				verify_error( function, offset, "slot " + std::to_string( code[ offset + 1 ] ) + " outside of the frame" );
+			}
+		}
+
+		if ( op == OpCode::op_call || op == OpCode::op_tail_call ) {
+			auto function_index = code[ offset + 1 ];
+
+			if ( function_index >= program.functions.size() ) {
+				verify_error( function, offset, "call to unknown function " + std::to_string( function_index ) );
+			}
+
+			if ( ( int ) code[ offset + 2 ] != program.functions[ function_index ].arg_count ) {
+				verify_error( function, offset, "wrong argument count for '" + symbol_name( program.functions[ function_index ].name ) + "'" );
+			}
+		}
+
+		if ( op == OpCode::op_return ) {
+			return_depth = std::min( return_depth, depths[ offset ] - 1 );
+		}
+
+		auto depth = depths[ offset ] - effect.pops + effect.pushes;
+		max_depth = std::max( max_depth, depth );
+
+		auto visit = [ & ]( size_t target, const char* what ) {
+			if ( target >= code.size() || !boundaries[ target ] ) {
+				verify_error( function, offset, what );
+			}
+
+			if ( depths[ target ] == -1 ) {
+				depths[ target ] = depth;
+				pending.push_back( target );
+			} else if ( depths[ target ] != depth ) {
+				verify_error( function, target, "stack height " + std::to_string( depth ) + " from " + std::to_string( offset ) + " differs from " + std::to_string( depths[ target ] ) );
+			}
+		};
+
+		if ( is_jump( op ) ) {
+			encoded_value value;
+			value.data.uint32[ 0 ] = code[ offset + 1 ];
+			visit( offset + 2 + value.data.int32[ 0 ], "jump target is not an instruction" );
+		}
+
+		if ( falls_through( op ) ) {
+			visit( offset + opcode_length( op ), "execution runs past the end" );
+		}
+	}
+
+	// The interpreter pushes without checks up to this depth
+	if ( ( uint32_t ) max_depth > function.max_stack ) {
+		verify_error( function, 0, "stack depth " + std::to_string( max_depth ) + " exceeds max_stack " + std::to_string( function.max_stack ) );
+	}
+
+	return return_depth;
+}
+
+void verify_program( const Program& program ) {
+	if ( program.global < 0 || program.global >= ( int ) program.functions.size() || program.main < 0 || program.main >= ( int ) program.functions.size() ) {
+		throw std::exception( "Invalid bytecode: missing <global> or Main" );
+	}
+
+	// Main runs on top of the globals, other functions only see their arguments
+	auto global_slots = verify_function( program, program.functions[ program.global ], 0 );
+
+	for ( size_t i = 0; i < program.functions.size(); ++i ) {
+		if ( ( int ) i == program.global ) {
+			continue;
+		}
+
+		auto& function = program.functions[ i ];
+		verify_function( program, function, ( int ) i == program.main ? global_slots : function.arg_count );
+	}
+}
+
+void link_program( const Program& program, bool use_arena, LinkedProgram* linked ) {
+	linked->functions.clear();
+	linked->arena.clear();
+
+	if ( use_arena ) {
+		size_t arena_size = 0;
+
+		for ( auto& fn : program.functions ) {
+			arena_size += fn.code.size();
+		}
+
+		linked->arena.reserve( arena_size );
+
+		for ( auto& fn : program.functions ) {
+			linked->arena.insert( linked->arena.end(), fn.code.begin(), fn.code.end() );
+		}
+	}
+
+	size_t arena_offset = 0;
+
+	for ( auto& fn : program.functions ) {
+		const uint32_t* code = fn.code.data();
+
+		if ( use_arena ) {
+			code = linked->arena.data() + arena_offset;
+			arena_offset += fn.code.size();
+		}
+
+		linked->functions.push_back( LinkedFunction{ code, code + fn.code.size(), NULL, fn.max_stack, fn.arg_count } );
+	}
+}
+
+// Threaded dispatch needs labels as values, other compilers always use the switch loop. It is
+// experimental and opt in through RunOptions::dispatch, the switch loop is the default.
+#if defined( __GNUC__ ) && !defined( TURBINE_SWITCH_DISPATCH )
+#define THREADED_DISPATCH 1
+#else
+#define THREADED_DISPATCH 0
+#endif
+
+#ifdef _MSC_VER
+#define vm_unreachable() __assume( 0 )
+#else
+#define vm_unreachable() __builtin_unreachable()
+#endif
+
+// Address space for the whole stack is reserved up front, memory is only committed as the stack
+// grows. Overflow is caught by check_stack_space() when a function is entered, which throws. The
+// page after the committed part stays inaccessible, so an overrun that slipped past it crashes
+// right away instead of corrupting memory. Nothing handles that fault.
+struct OperandStack {
+	OperandStack( size_t size );
+	~OperandStack();
+
+	OperandStack( const OperandStack& ) = delete;
+	OperandStack& operator=( const OperandStack& ) = delete;
+
+	// Commits at least up to 'end', false when that is past the reserved size
+	bool commit( const double* end );
+
+	double*				values;
+	size_t				capacity;		// Values that fit in the reservation
+	size_t				committed;		// Values backed by memory
+	size_t				page_size;
+	size_t				reserved_bytes;
+};
+
+size_t round_up( size_t value, size_t alignment ) {
+	return ( value + alignment - 1 ) / alignment * alignment;
+}
+
+OperandStack::OperandStack( size_t size ) {
+#ifdef _WIN32
+	SYSTEM_INFO system_info;
+	GetSystemInfo( &system_info );
+	page_size = system_info.dwPageSize;
+#else
+	page_size = ( size_t ) sysconf( _SC_PAGESIZE );
+#endif
+
+	// One more page than needed, it is never committed
+	reserved_bytes = round_up( size * sizeof( double ), page_size ) + page_size;
+	capacity = size;
+	committed = 0;
+
+#ifdef _WIN32
+	values = ( double* ) VirtualAlloc( NULL, reserved_bytes, MEM_RESERVE, PAGE_NOACCESS );
+#else
+	void* address = mmap( NULL, reserved_bytes, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0 );
+	values = address != MAP_FAILED ? ( double* ) address : NULL;
+#endif
+
+	if ( !values ) {
+		throw std::exception( "Failed to reserve the VM stack" );
+	}
+
+	// Enough for most programs without ever growing
+	commit( values + std::min< size_t >( capacity, 64 * 1024 / sizeof( double ) ) );
+}
+
+OperandStack::~OperandStack() {
+#ifdef _WIN32
+	VirtualFree( values, 0, MEM_RELEASE );
+#else
+	munmap( values, reserved_bytes );
+#endif
+}
+
+bool OperandStack::commit( const double* end ) {
+	size_t required = end - values;
+
+	if ( required > capacity ) {
+		return false;
+	}
+
+	if ( required <= committed ) {
+		return true;
+	}
+
+	// Doubling keeps the number of commits logarithmic in the final depth
+	auto committed_bytes = committed * sizeof( double );
+	auto new_bytes = round_up( std::max( required * sizeof( double ), committed_bytes * 2 ), page_size );
+	new_bytes = std::min( new_bytes, reserved_bytes - page_size );
+
+	auto from = ( char* ) values + committed_bytes;
+
+#ifdef _WIN32
+	if ( !VirtualAlloc( from, new_bytes - committed_bytes, MEM_COMMIT, PAGE_READWRITE ) ) {
+		return false;
+	}
+#else
+	if ( mprotect( from, new_bytes - committed_bytes, PROT_READ | PROT_WRITE ) != 0 ) {
+		return false;
+	}
+#endif
+
+	committed = std::min( new_bytes / sizeof( double ), capacity );
+	return true;
+}
+
+// Results of one pure function keyed by the bits of its arguments. Set associative, each set
+// evicts with a clock over its ways: a hit marks an entry, the hand skips marked entries once.
+struct MemoCache {
+	static const uint32_t ways = 4;
+
+	bool							enabled;		// Only pure functions have a cache
+	uint32_t						arg_count;
+	uint32_t						set_mask;		// Set count - 1, the count is a power of two
+	std::vector< uint64_t >			keys;			// arg_count words per entry
+	std::vector< double >			values;
+	std::vector< uint8_t >			valid;
+	std::vector< uint8_t >			referenced;
+	std::vector< uint8_t >			hands;			// Clock hand of each set
+	MemoStats						stats;
+};
+
+uint32_t memo_set( const MemoCache& cache, const uint64_t* key ) {
+	uint64_t hash = 0;
+
+	// Small integers only set the high bits of a double, fold them down before mixing
+	for ( uint32_t i = 0; i < cache.arg_count; ++i ) {
+		hash = ( hash ^ key[ i ] ^ ( key[ i ] >> 32 ) ) * 0x9E3779B97F4A7C15ull;
+	}
+
+	return ( uint32_t ) ( hash ^ ( hash >> 32 ) ) & cache.set_mask;
+}
+
+bool memo_lookup( MemoCache& cache, const uint64_t* key, double* value ) {
+	auto entry = memo_set( cache, key ) * MemoCache::ways;
+
+	for ( auto end = entry + MemoCache::ways; entry < end; ++entry ) {
+		if ( cache.valid[ entry ] && std::equal( key, key + cache.arg_count, &cache.keys[ ( size_t ) entry * cache.arg_count ] ) ) {
+			cache.referenced[ entry ] = 1;
+			++cache.stats.hits;
+
+			*value = cache.values[ entry ];
+			return true;
+		}
+	}
+
+	++cache.stats.misses;
+	return false;
+}
+
+void memo_insert( MemoCache& cache, const uint64_t* key, double value ) {
+	auto set = memo_set( cache, key );
+	auto first = set * MemoCache::ways;
+	auto entry = first;
+
+	// Free way first, otherwise the first entry the hand finds unmarked
+	while ( entry < first + MemoCache::ways && cache.valid[ entry ] ) {
+		++entry;
+	}
+
+	if ( entry == first + MemoCache::ways ) {
+		auto& hand = cache.hands[ set ];
+
+		while ( cache.referenced[ first + hand ] ) {
+			cache.referenced[ first + hand ] = 0;
+			hand = ( hand + 1 ) % MemoCache::ways;
+		}
+
+		entry = first + hand;
+		hand = ( hand + 1 ) % MemoCache::ways;
+		++cache.stats.evictions;
+	}
+
+	std::copy( key, key + cache.arg_count, &cache.keys[ ( size_t ) entry * cache.arg_count ] );
+	cache.values[ entry ] = value;
+	cache.valid[ entry ] = 1;
+	cache.referenced[ entry ] = 0;
+}
+
+// A memoized call still running, its result is cached when the frame returns
+struct MemoPending {
+	const void*						frame;
+	uint32_t						function_index;
+	size_t							key_offset;
+};
+
+struct VM {
+	struct Frame {
+		const uint32_t*		code;
+		const uint32_t*		code_end;
+		const uint32_t*		ip;
+		double*				base;
+	};
+
+	struct ThreadedFrame {
+		const ThreadedCell*	ip;
+		double*				base;
+	};
+
+	double*							stack;
+	double*							stack_top;
+	double*							stack_end;		// End of the committed part of operand_stack
+	OperandStack*					operand_stack;
+	std::vector< Frame >			frames;			// Sized once per instance, calls only move frame_top
+	Frame*							frame_top;
+	Frame*							frame_end;
+	const CompiledProgram*			program;		// Program of the current run
+	const LinkedFunction*			entry;			// Function the current run started in
+
+	uint64_t						budget;			// Back-edges and calls a budgeted run may still take
+	Frame							resume;			// Where a suspended run continues, ip is NULL when there is none
+
+	uint32_t						memo_capacity;
+	std::vector< MemoCache >		memo_caches;	// One per function of the program memo_program names, disabled unless pure
+	uint64_t						memo_program;	// CompiledProgram::id, 0 before the first memoized run
+	std::vector< uint64_t >			memo_keys;		// Arguments of the pending calls
+	std::vector< MemoPending >		memo_pending;
+
+	struct ProfileFrame {
+		uint32_t			function_index;
+		uint64_t			start;
+		uint64_t			child_ticks;
+	};
+
+	bool							profiling;
+	Profile							profile;
+	uint64_t						profile_suspended;	// Tick the run was suspended at, the frames don't count the pause
+	uint64_t						profile_program;	// CompiledProgram::id the counters are sized for, 0 before the first profiled run
+	std::vector< ProfileFrame >		profile_frames;
+	std::vector< uint32_t >			profile_active;		// Frames of each function on the call stack
+
+	std::vector< ThreadedFrame >				threaded_frames;
+	ThreadedFrame*								threaded_frame_top;
+	ThreadedFrame*								threaded_frame_end;
+};
+
+// Slow path of check_stack_space(), commits more of the reserved stack
+void grow_stack( VM& vm, size_t count ) {
+	if ( !vm.operand_stack->commit( vm.stack_top + count ) ) {
+		throw std::exception( "Maximum VM stack size exceeded" );
+	}
+
+	vm.stack_end = vm.stack + vm.operand_stack->committed;
+}
+
+// Only checked for unverified code, otherwise check_stack_space() has made room for the whole function on entry
+template < bool checked = false >
+double stack_pop( VM& vm ) {
+	if ( checked && vm.stack_top == vm.stack ) {
+		throw std::exception( "Stack underflow" );
+	}
+
+	return *--vm.stack_top;
+}
+
+template < bool checked = false >
+void stack_push( VM& vm, double value ) {
+	if ( checked && vm.stack_top == vm.stack_end ) {
+		grow_stack( vm, 1 );
+	}
+
+	*vm.stack_top++ = value;
+}
+
+template < bool checked = false >
+double stack_peek( VM& vm ) {
+	if ( checked && vm.stack_top == vm.stack ) {
+		throw std::exception( "Stack underflow" );
+	}
+
+	return vm.stack_top[ -1 ];
+}
+
+void check_stack_space( VM& vm, uint32_t max_stack ) {
+	if ( vm.stack_end - vm.stack_top < max_stack ) {
+		grow_stack( vm, max_stack );
+	}
+}
+
+// The checks below only exist in the interpreter for unverified code, see verify_program()
+#define check_slot( slot, extra ) { \
+	if ( checked && base + ( slot ) + ( extra ) >= vm.stack_top ) { \
+		throw std::exception( "Slot outside of frame" ); \
+	} \
+}
+
+#define check_jump() { \
+	if ( checked && ( ip + 1 < code || ip + 1 >= code_end ) ) { \
+		throw std::exception( "Jump outside of function" ); \
+	} \
+}
+
+#define arit_op( op ) { \
+	auto b = stack_pop< checked >( vm ); \
+	auto a = stack_pop< checked >( vm ); \
+	stack_push< checked >( vm, a op b ); \
+}
+
+#define binary_op( op ) { \
+	auto b = stack_pop< checked >( vm ); \
+	auto a = stack_pop< checked >( vm ); \
+	stack_push< checked >( vm, a op b ? 1.0 : 0.0 ); \
+}
+
+#define slot_imm_op( op ) { \
+	auto slot = *++ip; \
+	check_slot( slot, 0 ); \
+	encoded_value value; \
+	value.data.uint32[ 0 ] = *++ip; \
+	value.data.uint32[ 1 ] = *++ip; \
+	stack_push< checked >( vm, base[ slot ] op value.data.dbl ); \
+}
+
+// After a back-edge or call has moved ip, so a resumed run starts right after it. The one that uses up the
+// budget still counts, so a slice crosses exactly 'budget' of them
+#define check_budget() { \
+	if ( budgeted && vm.budget <= 1 ) { \
+		vm.resume = VM::Frame{ code, code_end, ip + 1, base }; \
+		if ( profiled ) { \
+			vm.profile_suspended = profile_ticks(); \
+		} \
+		return 0.0; \
+	} \
+	if ( budgeted ) { \
+		--vm.budget; \
+	} \
+}
+
+// Loops close with a jump back to their condition, forward jumps can't run forever
+#define check_back_edge( offset ) { \
+	if ( budgeted && ( offset ) < 0 ) { \
+		check_budget(); \
+	} \
+}
+
+// 'at' is the opcode of the conditional jump, its offset keys the branch counters
+#define profile_branch( at, is_taken ) { \
+	if ( profiled ) { \
+		auto& site = vm.profile.branches[ vm.profile_frames.back().function_index ][ ( at ) - code ]; \
+		++( ( is_taken ) ? site.taken : site.not_taken ); \
+	} \
+}
+
+#define compare_jz_op( op ) { \
+	auto b = stack_pop< checked >( vm ); \
+	auto a = stack_pop< checked >( vm ); \
+	encoded_value value; \
+	value.data.uint32[ 0 ] = *++ip; \
+	profile_branch( ip - 1, !( a op b ) ); \
+	if ( !( a op b ) ) { \
+		ip += value.data.int32[ 0 ]; \
+		check_jump(); \
+		check_back_edge( value.data.int32[ 0 ] ); \
+	} \
+}
+
+void profile_enter( VM& vm, uint32_t function_index, uint64_t now ) {
+	++vm.profile.functions[ function_index ].calls;
+	++vm.profile_active[ function_index ];
+	vm.profile_frames.push_back( VM::ProfileFrame{ function_index, now, 0 } );
+}
+
+void profile_leave( VM& vm, uint64_t now ) {
+	auto frame = vm.profile_frames.back();
+	vm.profile_frames.pop_back();
+
+	auto inclusive = now - frame.start;
+	auto& function = vm.profile.functions[ frame.function_index ];
+	function.exclusive_ticks += inclusive - frame.child_ticks;
+
+	// Recursive frames are already inside the time of the outermost one
+	if ( --vm.profile_active[ frame.function_index ] == 0 ) {
+		function.inclusive_ticks += inclusive;
+	}
+
+	if ( !vm.profile_frames.empty() ) {
+		vm.profile_frames.back().child_ticks += inclusive;
+	}
+}
+
+// 'memoize' looks up calls to pure functions in the result caches of the VM first,
+// 'profiled' fills vm.profile. 'budgeted' suspends the run into vm.resume once vm.budget is used up,
+// and picks up from there when vm.resume is set. All compile to nothing when false.
+template < bool checked, bool memoize = false, bool profiled = false, bool budgeted = false >
+double execute( VM& vm, const LinkedFunction& fn ) {
+	const LinkedFunction* functions = vm.program->linked.functions.data();
+	const uint32_t* code = fn.code;
+	const uint32_t* code_end = fn.code_end;
+	const uint32_t* ip = code;
+	double* base = vm.stack;
+
+	if ( budgeted && vm.resume.ip != NULL ) {
+		code = vm.resume.code;
+		code_end = vm.resume.code_end;
+		ip = vm.resume.ip;
+		base = vm.resume.base;
+		vm.resume.ip = NULL;
+
+		if ( profiled ) {
+			auto paused = profile_ticks() - vm.profile_suspended;
+
+			for ( auto& frame : vm.profile_frames ) {
+				frame.start += paused;
+			}
+		}
+	} else {
+		check_stack_space( vm, fn.max_stack );
+
+		if ( profiled ) {
+			profile_enter( vm, ( uint32_t ) ( &fn - functions ), profile_ticks() );
+		}
+	}
+
+	for ( ;; ++ip ) {
+		// Unverified code may hold any opcode, the default case rejects it after this
+		if ( profiled && ( !checked || *ip <= OpCode::op_store_slot ) ) {
+			++vm.profile.opcode_counts[ *ip ];
+		}
+
+		switch ( *ip ) {
+		case OpCode::op_add: arit_op( + ); break;
+		case OpCode::op_sub: arit_op( - ); break;
 		case OpCode::op_mul: arit_op( * ); break;
 		case OpCode::op_div: arit_op( / ); break;
 		case OpCode::op_gt: binary_op( > ); break;
 		case OpCode::op_lt: binary_op( < ); break;
 		case OpCode::op_eq: binary_op( == ); break;
 		case OpCode::op_ne: binary_op( != ); break;
+		case OpCode::op_add_slot_imm: slot_imm_op( + ); break;
+		case OpCode::op_sub_slot_imm: slot_imm_op( - ); break;
+		case OpCode::op_mul_slot_imm: slot_imm_op( * ); break;
+		case OpCode::op_div_slot_imm: slot_imm_op( / ); break;
+		case OpCode::op_gt_jz: compare_jz_op( > ); break;
+		case OpCode::op_lt_jz: compare_jz_op( < ); break;
+		case OpCode::op_eq_jz: compare_jz_op( == ); break;
+		case OpCode::op_ne_jz: compare_jz_op( != ); break;
 		case OpCode::op_load_number: {
 			encoded_value value;
 			value.data.uint32[ 0 ] = *++ip;
 			value.data.uint32[ 1 ] = *++ip;
 
-			stack_push( vm, value.data.dbl );
-			break;
+			stack_push< checked >( vm, value.data.dbl );
+			break;
+		}
+		case OpCode::op_load_zero: stack_push< checked >( vm, 0.0 ); break;
+		case OpCode::op_load_slot: check_slot( ip[ 1 ], 0 ); stack_push< checked >( vm, base[ *++ip ] ); break;
+		case OpCode::op_set_slot: check_slot( ip[ 1 ], 0 ); base[ *++ip ] = stack_peek< checked >( vm ); break;
+		case OpCode::op_store_slot: check_slot( ip[ 1 ], 1 ); base[ *++ip ] = stack_pop< checked >( vm ); break;
+		case OpCode::op_pop: stack_pop< checked >( vm ); break;
+		case OpCode::op_return: {
+			auto return_value = stack_pop< checked >( vm );
+
+			if ( profiled ) {
+				profile_leave( vm, profile_ticks() );
+			}
+
+			if ( vm.frame_top == vm.frames.data() ) {
+				return return_value;
+			}
+
+			auto& return_frame = *--vm.frame_top;
+
+			if ( memoize && !vm.memo_pending.empty() && vm.memo_pending.back().frame == vm.frame_top ) {
+				auto& pending = vm.memo_pending.back();
+
+				memo_insert( vm.memo_caches[ pending.function_index ], vm.memo_keys.data() + pending.key_offset, return_value );
+				vm.memo_keys.resize( pending.key_offset );
+				vm.memo_pending.pop_back();
+			}
+
+			vm.stack_top = base;
+			base = return_frame.base;
+			code = return_frame.code;
+			code_end = return_frame.code_end;
+			ip = return_frame.ip;
+
+			stack_push< checked >( vm, return_value );
+			break;
+		}
+		case OpCode::op_call: {
+			auto function_index = *++ip;
+			auto arg_count = *++ip;
+
+			if ( checked && ( function_index >= vm.program->linked.functions.size() || ( int ) arg_count != functions[ function_index ].arg_count || arg_count > ( size_t ) ( vm.stack_top - vm.stack ) ) ) {
+				throw std::exception( "Invalid call" );
+			}
+
+			if ( memoize && vm.memo_caches[ function_index ].enabled ) {
+				auto& cache = vm.memo_caches[ function_index ];
+				auto args = vm.stack_top - arg_count;
+				auto key_offset = vm.memo_keys.size();
+
+				// Keyed by bits, the callee may overwrite its argument slots before it returns
+				vm.memo_keys.resize( key_offset + arg_count );
+				std::memcpy( vm.memo_keys.data() + key_offset, args, arg_count * sizeof( double ) );
+
+				double value;
+				if ( memo_lookup( cache, vm.memo_keys.data() + key_offset, &value ) ) {
+					vm.memo_keys.resize( key_offset );
+					vm.stack_top = args;
+					stack_push< checked >( vm, value );
+					break;
+				}
+
+				if ( vm.frame_top != vm.frame_end ) {
+					vm.memo_pending.push_back( MemoPending{ vm.frame_top, function_index, key_offset } );
+				}
+			}
+
+			if ( vm.frame_top == vm.frame_end ) {
+				throw std::exception( "Maximum call depth exceeded" );
+			}
+
+			*vm.frame_top++ = VM::Frame{ code, code_end, ip, base };
+
+			auto& function = functions[ function_index ];
+			check_stack_space( vm, function.max_stack );
+
+			if ( profiled ) {
+				profile_enter( vm, function_index, profile_ticks() );
+			}
+
+			base = vm.stack_top - arg_count;
+			code = function.code;
+			code_end = function.code_end;
+			ip = code - 1;
+			check_budget();
+			break;
+		}
+		case OpCode::op_tail_call: {
+			auto function_index = *++ip;
+			auto arg_count = *++ip;
+
+			if ( checked && ( function_index >= vm.program->linked.functions.size() || ( int ) arg_count != functions[ function_index ].arg_count || base + arg_count > vm.stack_top ) ) {
+				throw std::exception( "Invalid call" );
+			}
+
+			// The arguments slide down to the base of the current frame, its return address stays
+			auto& function = functions[ function_index ];
+			auto args = vm.stack_top - arg_count;
+
+			for ( uint32_t i = 0; i < arg_count; ++i ) {
+				base[ i ] = args[ i ];
+			}
+
+			vm.stack_top = base + arg_count;
+			check_stack_space( vm, function.max_stack );
+
+			// The callee's time no longer belongs to the frame it replaces
+			if ( profiled ) {
+				auto now = profile_ticks();
+				profile_leave( vm, now );
+				profile_enter( vm, function_index, now );
+			}
+
+			code = function.code;
+			code_end = function.code_end;
+			ip = code - 1;
+			check_budget();
+			break;
+		}
+		case OpCode::op_jz: {
+			encoded_value value;
+			value.data.uint32[ 0 ] = *++ip;
+			profile_branch( ip - 1, stack_peek< checked >( vm ) == 0.0 );
+
+			if ( stack_peek< checked >( vm ) == 0.0 ) {
+				ip += value.data.int32[ 0 ];
+				check_jump();
+				check_back_edge( value.data.int32[ 0 ] );
+			}
+
+			break;
+		}
+		case OpCode::op_jz_pop: {
+			encoded_value value;
+			value.data.uint32[ 0 ] = *++ip;
+			auto condition = stack_pop< checked >( vm );
+			profile_branch( ip - 1, condition == 0.0 );
+
+			if ( condition == 0.0 ) {
+				ip += value.data.int32[ 0 ];
+				check_jump();
+				check_back_edge( value.data.int32[ 0 ] );
+			}
+
+			break;
+		}
+		case OpCode::op_jmp: {
+			encoded_value value;
+			value.data.uint32[ 0 ] = *++ip;
+			ip += value.data.int32[ 0 ];
+			check_jump();
+			check_back_edge( value.data.int32[ 0 ] );
+			break;
+		}
+		default:
+			if ( checked ) {
+				throw std::exception( ( "Invalid instruction '" + std::to_string( *ip ) + "'" ).c_str() );
+			}
+
+			vm_unreachable();
+		}
+	}
+}
+
+bool has_threaded_dispatch() {
+	return THREADED_DISPATCH;
+}
+
+#if THREADED_DISPATCH
+
+#define threaded_next( length ) { \
+	ip += length; \
+	goto *ip->handler; \
+}
+
+#define threaded_arit_op( op ) { \
+	auto b = stack_pop( vm ); \
+	auto a = stack_pop( vm ); \
+	stack_push( vm, a op b ); \
+	threaded_next( 1 ); \
+}
+
+#define threaded_binary_op( op ) { \
+	auto b = stack_pop( vm ); \
+	auto a = stack_pop( vm ); \
+	stack_push( vm, a op b ? 1.0 : 0.0 ); \
+	threaded_next( 1 ); \
+}
+
+#define threaded_slot_imm_op( op ) { \
+	encoded_value value; \
+	value.data.uint32[ 0 ] = ip[ 2 ].operand; \
+	value.data.uint32[ 1 ] = ip[ 3 ].operand; \
+	stack_push( vm, base[ ip[ 1 ].operand ] op value.data.dbl ); \
+	threaded_next( 4 ); \
+}
+
+#define threaded_compare_jz_op( op ) { \
+	auto b = stack_pop( vm ); \
+	auto a = stack_pop( vm ); \
+	threaded_next( !( a op b ) ? 2 + ( int32_t ) ip[ 1 ].operand : 2 ); \
+}
+
+// With 'handler_table' set only hands out the handler addresses, they are local to this function
+double execute_threaded( VM& vm, const LinkedFunction* fn, const void* const** handler_table ) {
+	static const void* const handlers[] = {
+		&&handle_add,
+		&&handle_sub,
+		&&handle_mul,
+		&&handle_div,
+		&&handle_load_number,
+		&&handle_load_zero,
+		&&handle_load_slot,
+		&&handle_pop,
+		&&handle_return,
+		&&handle_call,
+		&&handle_jz,
+		&&handle_jmp,
+		&&handle_gt,
+		&&handle_lt,
+		&&handle_eq,
+		&&handle_ne,
+		&&handle_set_slot,
+		&&handle_jz_pop,
+		&&handle_tail_call,
+		&&handle_add_slot_imm,
+		&&handle_sub_slot_imm,
+		&&handle_mul_slot_imm,
+		&&handle_div_slot_imm,
+		&&handle_gt_jz,
+		&&handle_lt_jz,
+		&&handle_eq_jz,
+		&&handle_ne_jz,
+		&&handle_store_slot,
+	};
+
+	static_assert( sizeof( handlers ) / sizeof( handlers[ 0 ] ) == OpCode::op_store_slot + 1, "Missing threaded handler" );
+
+	if ( handler_table ) {
+		*handler_table = handlers;
+		return 0.0;
+	}
+
+	const LinkedFunction* functions = vm.program->linked.functions.data();
+	const ThreadedCell* ip = ( const ThreadedCell* ) fn->threaded_code;
+	double* base = vm.stack;
+
+	check_stack_space( vm, fn->max_stack );
+
+	goto *ip->handler;
+
+handle_add: threaded_arit_op( + );
+handle_sub: threaded_arit_op( - );
+handle_mul: threaded_arit_op( * );
+handle_div: threaded_arit_op( / );
+handle_gt: threaded_binary_op( > );
+handle_lt: threaded_binary_op( < );
+handle_eq: threaded_binary_op( == );
+handle_ne: threaded_binary_op( != );
+handle_add_slot_imm: threaded_slot_imm_op( + );
+handle_sub_slot_imm: threaded_slot_imm_op( - );
+handle_mul_slot_imm: threaded_slot_imm_op( * );
+handle_div_slot_imm: threaded_slot_imm_op( / );
+handle_gt_jz: threaded_compare_jz_op( > );
+handle_lt_jz: threaded_compare_jz_op( < );
+handle_eq_jz: threaded_compare_jz_op( == );
+handle_ne_jz: threaded_compare_jz_op( != );
+handle_load_number: {
+	encoded_value value;
+	value.data.uint32[ 0 ] = ip[ 1 ].operand;
+	value.data.uint32[ 1 ] = ip[ 2 ].operand;
+
+	stack_push( vm, value.data.dbl );
+	threaded_next( 3 );
+}
+handle_load_zero:
+	stack_push( vm, 0.0 );
+	threaded_next( 1 );
+handle_load_slot:
+	stack_push( vm, base[ ip[ 1 ].operand ] );
+	threaded_next( 2 );
+handle_set_slot:
+	base[ ip[ 1 ].operand ] = vm.stack_top[ -1 ];
+	threaded_next( 2 );
+handle_store_slot:
+	base[ ip[ 1 ].operand ] = stack_pop( vm );
+	threaded_next( 2 );
+handle_pop:
+	stack_pop( vm );
+	threaded_next( 1 );
+handle_return: {
+	auto return_value = stack_pop( vm );
+
+	if ( vm.threaded_frame_top == vm.threaded_frames.data() ) {
+		return return_value;
+	}
+
+	auto& return_frame = *--vm.threaded_frame_top;
+
+	vm.stack_top = base;
+	base = return_frame.base;
+	ip = return_frame.ip;
+
+	stack_push( vm, return_value );
+	threaded_next( 0 );
+}
+handle_call: {
+	auto function_index = ip[ 1 ].operand;
+	auto arg_count = ip[ 2 ].operand;
+
+	auto& function = functions[ function_index ];
+	check_stack_space( vm, function.max_stack );
+
+	if ( vm.threaded_frame_top == vm.threaded_frame_end ) {
+		throw std::exception( "Maximum call depth exceeded" );
+	}
+
+	*vm.threaded_frame_top++ = VM::ThreadedFrame{ ip + 3, base };
+
+	base = vm.stack_top - arg_count;
+	ip = ( const ThreadedCell* ) function.threaded_code;
+	threaded_next( 0 );
+}
+handle_tail_call: {
+	auto function_index = ip[ 1 ].operand;
+	auto arg_count = ip[ 2 ].operand;
+	auto args = vm.stack_top - arg_count;
+
+	for ( uint32_t i = 0; i < arg_count; ++i ) {
+		base[ i ] = args[ i ];
+	}
+
+	auto& function = functions[ function_index ];
+
+	vm.stack_top = base + arg_count;
+	check_stack_space( vm, function.max_stack );
+
+	ip = ( const ThreadedCell* ) function.threaded_code;
+	threaded_next( 0 );
+}
+handle_jz:
+	threaded_next( vm.stack_top[ -1 ] == 0.0 ? 2 + ( int32_t ) ip[ 1 ].operand : 2 );
+handle_jz_pop:
+	threaded_next( stack_pop( vm ) == 0.0 ? 2 + ( int32_t ) ip[ 1 ].operand : 2 );
+handle_jmp:
+	threaded_next( 2 + ( int32_t ) ip[ 1 ].operand );
+}
+
+// Done once at load time, the interpreter never sees an opcode number
+void translate_threaded( VM& vm, CompiledProgram* compiled, bool use_arena ) {
+	const void* const* handlers;
+	execute_threaded( vm, NULL, &handlers );
+
+	auto& functions = compiled->linked.functions;
+	auto& threaded_code = compiled->threaded_code;
+	std::vector< size_t > block_offsets;
+
+	// Blocks are sized first, cells must not move once the table points at them
+	for ( auto& fn : functions ) {
+		if ( !use_arena || threaded_code.size() == 0 ) {
+			threaded_code.emplace_back();
 		}
-		case OpCode::op_load_zero: stack_push( vm, 0.0 ); break;
-		case OpCode::op_load_slot: stack_push( vm, base[ *++ip ] ); break;
-		case OpCode::op_set_slot: base[ *++ip ] = vm.stack_top[ -1 ]; break;
-		case OpCode::op_pop: stack_pop( vm ); break;
-		case OpCode::op_return: {
-			auto return_value = stack_pop( vm );
 
-			if ( vm.frames.size() == 0 ) {
-				return return_value;
+		auto& block = threaded_code.back();
+		block_offsets.push_back( block.size() );
+		block.resize( block.size() + ( fn.code_end - fn.code ) );
+	}
+
+	for ( size_t i = 0; i < functions.size(); ++i ) {
+		auto& fn = functions[ i ];
+		auto cells = threaded_code[ use_arena ? 0 : i ].data() + block_offsets[ i ];
+		size_t length = fn.code_end - fn.code;
+
+		for ( size_t offset = 0; offset < length; ) {
+			auto op = fn.code[ offset ];
+
+			if ( op > OpCode::op_store_slot ) {
+				throw std::exception( ( "Invalid instruction '" + std::to_string( op ) + "'" ).c_str() );
 			}
-			
-			auto& return_frame = vm.frames[ vm.frames.size() - 1 ];
 
-			vm.stack_top = base;
-			base = return_frame.base;
-			code = return_frame.code;
-			ip = return_frame.ip;
+			cells[ offset ].handler = handlers[ op ];
 
-			stack_push( vm, return_value );
+			for ( uint32_t i = 1; i < opcode_length( op ); ++i ) {
+				cells[ offset + i ].operand = fn.code[ offset + i ];
+			}
 
-			vm.frames.pop_back();
-			break;
+			offset += opcode_length( op );
 		}
-		case OpCode::op_call: {
-			auto function_index = *++ip;
-			auto arg_count = *++ip;
 
-			vm.frames.push_back( VM::Frame{ code, ip, base } );
+		fn.threaded_code = cells;
+	}
+}
 
-			auto& function = vm.program.functions[ function_index ];
+#endif
 
-			base = vm.stack_top - arg_count;
-			code = function.code.data();
-			ip = code - 1;
-			break;
-		}
-		case OpCode::op_jz: {
-			encoded_value value;
-			value.data.uint32[ 0 ] = *++ip;
+VMInstance::VMInstance( const RunOptions& options ) {
+	if ( options.memo_capacity > max_memo_capacity ) {
+		throw std::exception( ( "Memo capacity exceeds " + std::to_string( max_memo_capacity ) + " entries" ).c_str() );
+	}
 
-			if ( vm.stack_top[ -1 ] == 0.0 ) {
-				ip += value.data.int32[ 0 ];
-			}
+	vm = new VM;
+	vm->operand_stack = new OperandStack( options.stack_size );
+	vm->stack = vm->operand_stack->values;
+	vm->stack_top = vm->stack;
+	vm->stack_end = vm->stack + vm->operand_stack->committed;
+	vm->program = NULL;
+	vm->entry = NULL;
+	vm->resume.ip = NULL;
 
-			break;
+	vm->memo_capacity = options.memo_capacity;
+	vm->memo_program = 0;
+
+	vm->profiling = options.profile;
+	vm->profile_program = 0;
+
+	vm->frames.resize( options.max_call_depth );
+	vm->frame_top = vm->frames.data();
+	vm->frame_end = vm->frame_top + options.max_call_depth;
+
+	vm->threaded_frames.resize( options.max_call_depth );
+	vm->threaded_frame_top = vm->threaded_frames.data();
+	vm->threaded_frame_end = vm->threaded_frame_top + options.max_call_depth;
+}
+
+VMInstance::~VMInstance() {
+	delete vm->operand_stack;
+	delete vm;
+}
+
+// Empty caches for the pure functions of 'program', the others get none. The capacity is at most
+// max_memo_capacity, so the set count can't overflow while it is rounded up
+void reset_memo_caches( VM& vm, const CompiledProgram& program ) {
+	uint32_t sets = 1;
+
+	while ( sets * MemoCache::ways < vm.memo_capacity ) {
+		sets *= 2;
+	}
+
+	vm.memo_program = program.id;
+	vm.memo_caches.clear();
+	vm.memo_caches.resize( program.program.functions.size() );
+
+	for ( auto& function : program.program.functions ) {
+		auto& cache = vm.memo_caches[ function.index ];
+		cache.enabled = function.pure;
+		cache.arg_count = ( uint32_t ) function.arg_count;
+		cache.set_mask = sets - 1;
+		cache.stats = MemoStats{ 0, 0, 0 };
+
+		if ( !cache.enabled ) {
+			continue;
 		}
-		case OpCode::op_jmp: {
-			encoded_value value;
-			value.data.uint32[ 0 ] = *++ip;
-			ip += value.data.int32[ 0 ];
-			break;
+
+		auto entries = sets * MemoCache::ways;
+		cache.keys.resize( ( size_t ) entries * cache.arg_count );
+		cache.values.resize( entries );
+		cache.valid.assign( entries, 0 );
+		cache.referenced.assign( entries, 0 );
+		cache.hands.assign( entries / MemoCache::ways, 0 );
+	}
+}
+
+template < bool memoize, bool profiled, bool budgeted >
+double execute_switch( VM& vm, const CompiledProgram& program, const LinkedFunction& function ) {
+	return program.verified ? execute< false, memoize, profiled, budgeted >( vm, function ) : execute< true, memoize, profiled, budgeted >( vm, function );
+}
+
+// Picks the interpreter loop for the options of the VM and runs vm.entry, or continues it from vm.resume
+template < bool budgeted >
+double execute_loop( VM& vm ) {
+	auto& program = *vm.program;
+	auto& function = *vm.entry;
+
+	if ( vm.profiling ) {
+		auto time_start = std::chrono::steady_clock::now();
+		auto ticks_start = profile_ticks();
+
+		auto return_value = vm.memo_capacity != 0 ? execute_switch< true, true, budgeted >( vm, program, function ) : execute_switch< false, true, budgeted >( vm, program, function );
+
+		vm.profile.total_ticks += profile_ticks() - ticks_start;
+		vm.profile.total_seconds += std::chrono::duration< double >( std::chrono::steady_clock::now() - time_start ).count();
+
+		return return_value;
+	}
+
+	if ( vm.memo_capacity != 0 ) {
+		return execute_switch< true, false, budgeted >( vm, program, function );
+	}
+
+#if THREADED_DISPATCH
+	if ( !budgeted && program.threaded ) {
+		return execute_threaded( vm, &function, NULL );
+	}
+#endif
+
+	return execute_switch< false, false, budgeted >( vm, program, function );
+}
+
+// Sets up a run of one function from an empty call stack, on top of whatever is on the operand stack
+void prepare_entry( VM& vm, const CompiledProgram& program, int function_index ) {
+	vm.program = &program;
+	vm.entry = &program.linked.functions[ function_index ];
+	vm.resume.ip = NULL;
+	vm.frame_top = vm.frames.data();
+	vm.threaded_frame_top = vm.threaded_frames.data();
+
+	if ( vm.memo_capacity != 0 ) {
+		if ( vm.memo_program != program.id ) {
+			reset_memo_caches( vm, program );
 		}
-		default:
-			throw std::exception( ( "Invalid instruction '" + std::to_string( *ip ) + "'" ).c_str() );
+
+		vm.memo_keys.clear();
+		vm.memo_pending.clear();
+	}
+
+	if ( vm.profiling ) {
+		if ( vm.profile_program != program.id ) {
+			reset_profile( &vm.profile, program.program );
+			vm.profile_program = program.id;
 		}
+
+		vm.profile_frames.clear();
+		vm.profile_active.assign( program.program.functions.size(), 0 );
+	}
+}
+
+double execute_entry( VM& vm, const CompiledProgram& program, int function_index ) {
+	prepare_entry( vm, program, function_index );
+	return execute_loop< false >( vm );
+}
+
+// Main sees the globals at the bottom of its frame
+void push_globals( VM& vm, const CompiledProgram& program ) {
+	vm.stack_top = vm.stack;
+	check_stack_space( vm, ( uint32_t ) program.globals.size() );
+
+	std::copy( program.globals.begin(), program.globals.end(), vm.stack );
+	vm.stack_top = vm.stack + program.globals.size();
+}
+
+double VMInstance::run( const CompiledProgram& program ) {
+	push_globals( *vm, program );
+	return execute_entry( *vm, program, program.program.main );
+}
+
+// Runs the prepared entry or continues it from vm.resume until it returns or the budget is used up
+RunStatus execute_slice( VM& vm, uint64_t budget, double* result ) {
+	vm.budget = budget;
+	auto return_value = execute_loop< true >( vm );
+
+	if ( vm.resume.ip != NULL ) {
+		return RunStatus::run_suspended;
+	}
+
+	*result = return_value;
+	return RunStatus::run_finished;
+}
+
+RunStatus VMInstance::start( const CompiledProgram& program, uint64_t budget, double* result ) {
+	push_globals( *vm, program );
+	prepare_entry( *vm, program, program.program.main );
+
+	return execute_slice( *vm, budget, result );
+}
+
+RunStatus VMInstance::resume( uint64_t budget, double* result ) {
+	if ( vm->resume.ip == NULL ) {
+		throw std::exception( "No suspended run to resume" );
+	}
+
+	return execute_slice( *vm, budget, result );
+}
+
+bool VMInstance::suspended() const {
+	return vm->resume.ip != NULL;
+}
+
+const Profile& VMInstance::profile() const {
+	return vm->profile;
+}
+
+MemoStats VMInstance::memo_stats( int function_index ) const {
+	if ( vm->memo_program == 0 ) {
+		return MemoStats{ 0, 0, 0 };
 	}
+
+	return vm->memo_caches[ function_index ].stats;
+}
+
+double VMInstance::call( const CompiledProgram& program, int function_index, const double* arguments ) {
+	auto arg_count = program.program.functions[ function_index ].arg_count;
+
+	vm->stack_top = vm->stack;
+	check_stack_space( *vm, ( uint32_t ) arg_count );
+
+	std::copy( arguments, arguments + arg_count, vm->stack );
+	vm->stack_top = vm->stack + arg_count;
+
+	return execute_entry( *vm, program, function_index );
 }
 
-double run( Program program ) {
-	VM vm;
-	vm.program = program;
-	vm.stack = new double[ 255 ];
-	vm.stack_top = &vm.stack[ 0 ];
+std::shared_ptr< const CompiledProgram > compile_program( Program program, const RunOptions& options ) {
+	if ( options.verify ) {
+		verify_program( program );
+	}
+
+	// Linked and threaded code point into the program, so it is built in place
+	static std::atomic< uint64_t > next_id( 1 );
+
+	auto compiled = std::make_shared< CompiledProgram >();
+	compiled->program = std::move( program );
+	compiled->id = next_id++;
+	compiled->verified = options.verify;
+	compiled->threaded = false;
+
+	link_program( compiled->program, options.code_arena, &compiled->linked );
+
+	VMInstance instance( options );
+
+#if THREADED_DISPATCH
+	// Threaded code has no checks of its own, so it only runs verified bytecode
+	if ( options.verify && options.dispatch == DispatchMode::dispatch_threaded ) {
+		translate_threaded( *instance.vm, compiled.get(), options.code_arena );
+		compiled->threaded = true;
+	}
+#endif
+
+	auto vm = instance.vm;
+	execute_entry( *vm, *compiled, compiled->program.global );
+	compiled->globals.assign( vm->stack, vm->stack_top );
+
+	return compiled;
+}
 
-	execute( vm, vm.program.functions[ vm.program.global ] );
+double run( Program program, const RunOptions& options ) {
+	auto compiled = compile_program( std::move( program ), options );
+	VMInstance instance( options );
 
 	auto time_start = std::chrono::steady_clock::now();
-	auto return_value = execute( vm, vm.program.functions[ vm.program.main ] );
+	double return_value = 0.0;
+	uint64_t slices = 0;
+
+	if ( options.slice_budget != 0 ) {
+		auto status = instance.start( *compiled, options.slice_budget, &return_value );
+
+		for ( slices = 1; status == RunStatus::run_suspended; ++slices ) {
+			status = instance.resume( options.slice_budget, &return_value );
+		}
+	} else {
+		return_value = instance.run( *compiled );
+	}
+
 	auto time_end = std::chrono::steady_clock::now();
 
 	auto d_s = std::chrono::duration_cast< std::chrono::milliseconds >( time_end - time_start );
-	std::cout << "Interpreter took " << d_s.count() << " ms" << std::endl;
+	std::cout << "Interpreter took " << d_s.count() << " ms";
+
+	if ( slices != 0 ) {
+		std::cout << " (" << slices << " slices)";
+	} else if ( compiled->threaded && options.memo_capacity == 0 && !options.profile ) {
+		std::cout << " (threaded)";
+	}
+
+	std::cout << std::endl;
+
+	if ( options.profile ) {
+		print_profile( compiled->program, instance.profile() );
+
+		if ( !options.profile_json.empty() ) {
+			std::ofstream file( options.profile_json );
+			file << profile_json( compiled->program, instance.profile() );
+
+			if ( !file ) {
+				throw std::exception( ( "Could not write profile to '" + options.profile_json + "'" ).c_str() );
+			}
+		}
+	}
+
+	if ( options.memo_capacity != 0 ) {
+		for ( auto& function : compiled->program.functions ) {
+			auto stats = instance.memo_stats( function.index );
+
+			if ( stats.hits + stats.misses > 0 ) {
+				std::cout << "Memo (" << symbol_name( function.name ) << "): " << stats.hits << " hits, " << stats.misses << " misses, "
+					<< stats.evictions << " evictions" << std::endl;
+			}
+		}
+	}
 
-	delete vm.stack;
 	return return_value;
 }
 
-std::string read_file( const std::string& path ) {
-	std::string content = "";
-	std::ifstream file_stream;
+#ifdef _WIN32
+// The system's text for a GetLastError() code, without the trailing line break
+std::string windows_error( DWORD code ) {
+	char* text = NULL;
+	DWORD size = FormatMessageA( FORMAT_MESSAGE_ALLOCATE_BUFFER | FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS,
+		NULL, code, 0, ( LPSTR ) &text, 0, NULL );
 
-	file_stream.open( path );
+	if ( size == 0 ) {
+		return "error " + std::to_string( code );
+	}
 
-	if ( file_stream.is_open() )
-	{
-		std::string line;
-		while ( std::getline( file_stream, line ) )
-			content += line + "\n";
+	std::string message( text, size );
+	LocalFree( text );
 
-		file_stream.close();
-	} else
-	{
-		throw std::exception( "File not found" );
+	while ( !message.empty() && ( message.back() == '\r' || message.back() == '\n' || message.back() == '.' ) ) {
+		message.pop_back();
 	}
 
-	return content;
+	return message;
 }
+#endif
+
+SourceFile::SourceFile( const std::string& path ) {
+	data = NULL;
+	length = 0;
+	mapping = NULL;
+
+#ifdef _WIN32
+	file_handle = INVALID_HANDLE_VALUE;
+	mapping_handle = NULL;
+
+	HANDLE handle = path == "-"
+		? GetStdHandle( STD_INPUT_HANDLE )
+		: CreateFileA( path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL );
+
+	if ( handle == INVALID_HANDLE_VALUE ) {
+		throw std::exception( ( "Could not open " + path + ": " + windows_error( GetLastError() ) ).c_str() );
+	}
+
+	if ( path != "-" ) {
+		file_handle = handle;
+	}
+
+	LARGE_INTEGER file_size;
+	if ( GetFileType( handle ) == FILE_TYPE_DISK && GetFileSizeEx( handle, &file_size ) && file_size.QuadPart > 0 ) {
+		mapping_handle = CreateFileMappingA( handle, NULL, PAGE_READONLY, 0, 0, NULL );
+		mapping = mapping_handle ? MapViewOfFile( mapping_handle, FILE_MAP_READ, 0, 0, 0 ) : NULL;
+
+		if ( mapping ) {
+			data = ( const char* ) mapping;
+			length = ( size_t ) file_size.QuadPart;
+			return;
+		}
+	}
+
+	// Pipes and consoles, read everything in one go. The writer closing a pipe is the end of input, not an error
+	char chunk[ 64 * 1024 ];
+	DWORD bytes_read;
 
-int main( int argc, char** argv ) {
 	while ( true ) {
-		std::string input = read_file( "F:\\Projects\\turbine-lang\\test.tb" );
-		//std::getline( std::cin, input );
+		if ( !ReadFile( handle, chunk, sizeof( chunk ), &bytes_read, NULL ) ) {
+			DWORD code = GetLastError();
+
+			if ( code == ERROR_BROKEN_PIPE )
+				break;
+
+			if ( mapping_handle )
+				CloseHandle( mapping_handle );
+
+			if ( file_handle != INVALID_HANDLE_VALUE )
+				CloseHandle( file_handle );
+
+			throw std::exception( ( "Could not read " + path + ": " + windows_error( code ) ).c_str() );
+		}
+
+		if ( bytes_read == 0 )
+			break;
+
+		buffer.append( chunk, bytes_read );
+	}
+#else
+	int fd = path == "-" ? STDIN_FILENO : open( path.c_str(), O_RDONLY );
+
+	if ( fd < 0 ) {
+		throw std::exception( ( "Could not open " + path + ": " + std::strerror( errno ) ).c_str() );
+	}
+
+	struct stat file_stat;
+	if ( fstat( fd, &file_stat ) == 0 && S_ISREG( file_stat.st_mode ) && file_stat.st_size > 0 ) {
+		void* address = mmap( NULL, ( size_t ) file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
 
+		if ( address != MAP_FAILED ) {
+			mapping = address;
+			data = ( const char* ) address;
+			length = ( size_t ) file_stat.st_size;
+
+			madvise( address, length, MADV_SEQUENTIAL );
+
+			if ( fd != STDIN_FILENO )
+				close( fd );
+
+			return;
+		}
+	}
+
+	// Pipes and stdin, read everything in one go. A signal may interrupt the read before any data arrives
+	char chunk[ 64 * 1024 ];
+	ssize_t bytes_read;
+
+	while ( ( bytes_read = read( fd, chunk, sizeof( chunk ) ) ) != 0 ) {
+		if ( bytes_read > 0 ) {
+			buffer.append( chunk, ( size_t ) bytes_read );
+			continue;
+		}
+
+		if ( errno == EINTR )
+			continue;
+
+		std::string error = std::strerror( errno );
+
+		if ( fd != STDIN_FILENO )
+			close( fd );
+
+		throw std::exception( ( "Could not read " + path + ": " + error ).c_str() );
+	}
+
+	if ( fd != STDIN_FILENO )
+		close( fd );
+#endif
+
+	data = buffer.data();
+	length = buffer.length();
+}
+
+SourceFile::~SourceFile() {
+#ifdef _WIN32
+	if ( mapping )
+		UnmapViewOfFile( mapping );
+
+	if ( mapping_handle )
+		CloseHandle( mapping_handle );
+
+	if ( file_handle != INVALID_HANDLE_VALUE )
+		CloseHandle( file_handle );
+#else
+	if ( mapping )
+		munmap( mapping, length );
+#endif
+}
+
+int main( int argc, char** argv ) {
+	if ( argc > 2 && std::string( argv[ 1 ] ) == "-bench" ) {
+		return run_benchmark( argv[ 2 ], std::vector< std::string >( argv + 3, argv + argc ) );
+	}
+
+	// turbine-lang [-tokens] [-registers] [-threaded] [-noverify] [-stack values] [-depth calls] [-memo entries] [-profile] [-profile-json file] [-budget count] [script], '-' reads the script from stdin
+	std::string path = "test.tb";
+	bool dump_tokens = false;
+	bool use_registers = false;
+	RunOptions run_options;
+
+	for ( int i = 1; i < argc; ++i ) {
+		std::string arg = argv[ i ];
+
+		if ( arg == "-tokens" ) {
+			dump_tokens = true;
+		} else if ( arg == "-registers" ) {
+			use_registers = true;
+		} else if ( arg == "-threaded" ) {
+			run_options.dispatch = DispatchMode::dispatch_threaded;
+		} else if ( arg == "-noverify" ) {
+			run_options.verify = false;
+		} else if ( arg == "-stack" && i + 1 < argc ) {
+			run_options.stack_size = std::stoull( argv[ ++i ] );
+		} else if ( arg == "-depth" && i + 1 < argc ) {
+			run_options.max_call_depth = std::stoull( argv[ ++i ] );
+		} else if ( arg == "-memo" && i + 1 < argc ) {
+			run_options.memo_capacity = ( uint32_t ) std::min< unsigned long long >( std::stoull( argv[ ++i ] ), UINT32_MAX );
+		} else if ( arg == "-profile" ) {
+			run_options.profile = true;
+		} else if ( arg == "-profile-json" && i + 1 < argc ) {
+			run_options.profile = true;
+			run_options.profile_json = argv[ ++i ];
+		} else if ( arg == "-budget" && i + 1 < argc ) {
+			run_options.slice_budget = std::stoull( argv[ ++i ] );
+		} else {
+			path = arg;
+		}
+	}
+
+	while ( true ) {
 		try {
-			auto tokens = tokenize( input );
+			auto load_start = std::chrono::steady_clock::now();
+			SourceFile source( path );
+			auto load_end = std::chrono::steady_clock::now();
 
-			std::cout << "========== Tokenization ==========" << std::endl;
+			auto load_ms = std::chrono::duration_cast< std::chrono::milliseconds >( load_end - load_start );
+			std::cout << "Loading " << source.length << " bytes took " << load_ms.count() << " ms" << std::endl;
 
-			for ( auto token : tokens ) {
-				std::cout << ( token.keyword ? token.keyword->string : token.token_string ) << std::endl;
-			}
+			if ( dump_tokens ) {
+				auto tokens = tokenize( source.view() );
 
-			std::cout << "# of tokens: " << tokens.size() << std::endl;
+				std::cout << "========== Tokenization ==========" << std::endl;
+
+				for ( size_t i = 0; i < tokens.size(); ++i ) {
+					std::cout << tokens.text( tokens.get( i ) ) << std::endl;
+				}
+
+				std::cout << "# of tokens: " << tokens.size() << std::endl;
+			}
 
 			std::cout << "========== Compiler ==========" << std::endl;
 
+			// Tokens are pulled by the parser on demand
 			Program program;
-			parse( tokens, &program );
+			parse( source.view(), &program );
+
+			std::vector< size_t > peephole_saved;
+			for ( auto& fn : program.functions ) {
+				auto saved = peephole_optimize( &fn );
+				saved += fuse_superinstructions( &fn );
+
+				peephole_saved.push_back( saved );
+			}
 
 			Disassembly disasm;
 			if ( disassemble( program, &disasm ) ) {
@@ -979,32 +3262,56 @@ int main( int argc, char** argv ) {
 				std::cout << "Disassembler: invalid bytecode" << std::endl;
 			}
 
-			uint32_t global_size = program.functions[ program.global ].code.size();
-			uint32_t main_size = program.functions[ program.main ].code.size();
-
 			std::cout << "# of functions " << program.functions.size() << std::endl;
-			std::cout << "size of code (global scope): " << global_size << " (" << ( global_size * sizeof( uint32_t ) ) << " bytes)" << std::endl;
-			std::cout << "size of code (Main): " << main_size << " (" << ( main_size * sizeof( uint32_t ) ) << " bytes)" << std::endl;
+
+			for ( auto& fn : program.functions ) {
+				auto size = fn.code.size();
+				auto name = fn.index == program.global ? std::string( "global scope" ) : symbol_name( fn.name );
+
+				std::cout << "size of code (" << name << "): " << size << " (" << ( size * sizeof( uint32_t ) ) << " bytes, "
+					<< ( peephole_saved[ fn.index ] * sizeof( uint32_t ) ) << " bytes saved by peephole)" << std::endl;
+			}
 
 			std::cout << "========== Decompilation ==========" << std::endl;
 
-			std::vector< AstNode* > ast;
-			jit_decompile( program.functions[ program.main ], &ast );
+			// The JIT only handles a subset of Main, the VM still runs whatever it can not compile
+			try {
+				std::vector< AstNode* > ast;
+				jit_decompile( program.functions[ program.main ], &ast );
+
+				JitFunction jit_function;
+				jit_compile( ast, &jit_function );
+
+				auto time_start = std::chrono::steady_clock::now();
+				DebugBreak();
+				std::cout << "Jit result: " << jit_function.fn() << std::endl;
+				auto time_end = std::chrono::steady_clock::now();
+				auto d_s = std::chrono::duration_cast< std::chrono::milliseconds >( time_end - time_start );
+				std::cout << "JIT took " << d_s.count() << " ms" << std::endl;
+			} catch ( const std::exception& err ) {
+				std::cout << "JIT unsupported: " << err.what() << std::endl;
+			}
+
+			if ( use_registers ) {
+				std::cout << "========== Execution (register VM) ==========" << std::endl;
 
-			JitFunction jit_function;
-			jit_compile( ast, &jit_function );
+				auto register_program = compile_registers( program );
+				size_t register_code_size = 0;
 
-			auto time_start = std::chrono::steady_clock::now();
-			DebugBreak();
-			std::cout << "Jit result: " << jit_function.fn() << std::endl;
-			auto time_end = std::chrono::steady_clock::now();
-			auto d_s = std::chrono::duration_cast< std::chrono::milliseconds >( time_end - time_start );
-			std::cout << "JIT took " << d_s.count() << " ms" << std::endl;
+				for ( auto& fn : register_program.functions ) {
+					register_code_size += fn.code.size();
+				}
 
-			std::cout << "========== Execution (VM) ==========" << std::endl;
+				std::cout << "size of register code: " << register_code_size << " (" << ( register_code_size * sizeof( uint32_t ) ) << " bytes)" << std::endl;
 
-			auto result = run( program );
-			std::cout << "Return: " << result << std::endl;
+				auto result = run_registers( register_program );
+				std::cout << "Return: " << result << std::endl;
+			} else {
+				std::cout << "========== Execution (VM) ==========" << std::endl;
+
+				auto result = run( program, run_options );
+				std::cout << "Return: " << result << std::endl;
+			}
 		} catch ( const std::exception& err ) {
 			std::cout << "Error: " << err.what() << std::endl;
 		}
@@ -1019,7 +3326,7 @@ int main( int argc, char** argv ) {
 
 bool disassemble( const Program& program, Disassembly* disasm ) {
 	for ( auto fn : program.functions ) {
-		disasm->functions.push_back( Disassembly::Fn{ fn.name, {} } );
+		disasm->functions.push_back( Disassembly::Fn{ symbol_name( fn.name ), {} } );
 
 		auto& opcodes = disasm->functions[ disasm->functions.size() - 1 ].opcodes;
 
@@ -1057,6 +3364,32 @@ bool disassemble( const Program& program, Disassembly* disasm ) {
 				opcodes.push_back( Disassembly::OpCode( 2, "op_set_slot", std::to_string( slot_index ) ) );
 				break;
 			}
+			case OpCode::op_store_slot: {
+				auto slot_index = *++ip;
+				opcodes.push_back( Disassembly::OpCode( 2, "op_store_slot", std::to_string( slot_index ) ) );
+				break;
+			}
+			case OpCode::op_add_slot_imm:
+			case OpCode::op_sub_slot_imm:
+			case OpCode::op_mul_slot_imm:
+			case OpCode::op_div_slot_imm: {
+				auto op = *ip;
+				auto slot_index = *++ip;
+
+				encoded_value value;
+				value.data.uint32[ 0 ] = *++ip;
+				value.data.uint32[ 1 ] = *++ip;
+
+				const char* name = "op_add_slot_imm";
+				switch ( op ) {
+				case OpCode::op_sub_slot_imm: name = "op_sub_slot_imm"; break;
+				case OpCode::op_mul_slot_imm: name = "op_mul_slot_imm"; break;
+				case OpCode::op_div_slot_imm: name = "op_div_slot_imm"; break;
+				}
+
+				opcodes.push_back( Disassembly::OpCode( 4, name, std::to_string( slot_index ) + ", " + std::to_string( value.data.dbl ) ) );
+				break;
+			}
 			case OpCode::op_pop: opcodes.push_back( Disassembly::OpCode( 1, "op_pop", "" ) ); break;
 			case OpCode::op_return: opcodes.push_back( Disassembly::OpCode( 1, "op_return", "" ) ); break;
 			case OpCode::op_call: {
@@ -1066,15 +3399,37 @@ bool disassemble( const Program& program, Disassembly* disasm ) {
 				opcodes.push_back( Disassembly::OpCode( 3, "op_call", std::to_string( function_index ) + ", " + std::to_string( arg_count ) ) );
 				break;
 			}
+			case OpCode::op_tail_call: {
+				auto function_index = *++ip;
+				auto arg_count = *++ip;
+
+				opcodes.push_back( Disassembly::OpCode( 3, "op_tail_call", std::to_string( function_index ) + ", " + std::to_string( arg_count ) ) );
+				break;
+			}
 			case OpCode::op_jmp:
-			case OpCode::op_jz: {
+			case OpCode::op_jz:
+			case OpCode::op_jz_pop:
+			case OpCode::op_gt_jz:
+			case OpCode::op_lt_jz:
+			case OpCode::op_eq_jz:
+			case OpCode::op_ne_jz: {
 				encoded_value value;
 				value.data.uint32[ 0 ] = *++ip;
 
 				uint32_t address = ( uint32_t ) ip + ( value.data.int32[ 0 ] * sizeof( uint32_t ) );
 				uint32_t relative_address = address - ( uint32_t ) fn.code.data() + sizeof( uint32_t );
 
-				opcodes.push_back( Disassembly::OpCode( 2, ip[ -1 ] == OpCode::op_jz ? "op_jz" : "op_jmp",
+				const char* name = "op_jmp";
+				switch ( ip[ -1 ] ) {
+				case OpCode::op_jz: name = "op_jz"; break;
+				case OpCode::op_jz_pop: name = "op_jz_pop"; break;
+				case OpCode::op_gt_jz: name = "op_gt_jz"; break;
+				case OpCode::op_lt_jz: name = "op_lt_jz"; break;
+				case OpCode::op_eq_jz: name = "op_eq_jz"; break;
+				case OpCode::op_ne_jz: name = "op_ne_jz"; break;
+				}
+
+				opcodes.push_back( Disassembly::OpCode( 2, name,
 					std::to_string( value.data.int32[ 0 ] ) +", -> " + std::to_string( relative_address ) ) );
 				break;
 			}
@@ -18,6 +18,19 @@ enum OpCode : uint32_t {
 	op_eq,
 	op_ne,
 	op_set_slot,
+	op_jz_pop,
+	op_tail_call,		// Like op_call, but the callee takes over the current frame and returns to its caller
+
+	// Superinstructions, selected by fuse_superinstructions()
+	op_add_slot_imm,
+	op_sub_slot_imm,
+	op_mul_slot_imm,
+	op_div_slot_imm,
+	op_gt_jz,
+	op_lt_jz,
+	op_eq_jz,
+	op_ne_jz,
+	op_store_slot,
 };
 
 enum FunctionType {
@@ -26,11 +39,25 @@ enum FunctionType {
 	fn_virtual,
 };
 
+// Dense id of an interned name, equal names always map to the same symbol
+typedef uint32_t Symbol;
+
+// Symbol of the empty name
+const Symbol symbol_none = 0;
+
+// The symbol table is shared by the whole process and safe to use from any thread. It lives until the process
+// exits and keeps every name it has seen, so a long running host grows it by the distinct identifiers it parses.
+Symbol intern_symbol( const std::string_view& name );
+const std::string& symbol_name( Symbol symbol );
+
 struct Function {
-	std::string								name;
+	Symbol									name;
 	std::vector< uint32_t >					code;
 	int										index;
 	FunctionType							type;
+	int										arg_count;
+	uint32_t								max_stack;		// Operand stack words used above the arguments, see max_stack_depth()
+	bool									pure;			// Result depends only on the arguments, calls may be memoized
 };
 
 struct encoded_value {
@@ -43,3 +70,258 @@ struct encoded_value {
 		double		dbl;
 	} data;
 };
+
+struct Program {
+	int										global;
+	int										main;
+	std::vector< Function >					functions;
+};
+
+enum TokenId {
+	token_identifier,
+	token_number,
+	token_function,
+	token_while,
+	token_end,
+	token_plus,
+	token_minus,
+	token_star,
+	token_slash,
+	token_equals,
+	token_semicolon,
+	token_paren_left,
+	token_paren_right,
+	token_comma,
+	token_colon,
+	token_const,
+	token_any,
+	token_return,
+	token_if,
+	token_else,
+	token_then,
+	token_lessthan,
+	token_morethan,
+	token_2equals,
+	token_notequals,
+	token_eof,
+};
+
+struct Keyword {
+	enum KeywordType {
+		kw_operator,
+		kw_word,
+	};
+
+	std::string_view	string;
+	KeywordType			type;
+	int					lbp;
+	TokenId				token_type;
+};
+
+// Compact token, the token text is a view into the source buffer
+struct Token {
+	TokenId				token_type;
+	uint32_t			offset;
+	uint32_t			length;
+};
+
+// Tokens stored as struct-of-arrays, borrows the source buffer it was created from
+struct TokenStream {
+	Token get( size_t index ) const {
+		return Token{ ( TokenId ) types[ index ], offsets[ index ], lengths[ index ] };
+	}
+
+	std::string_view text( const Token& token ) const {
+		return source.substr( token.offset, token.length );
+	}
+
+	size_t size() const {
+		return types.size();
+	}
+
+	std::string_view				source;
+	std::vector< uint8_t >			types;
+	std::vector< uint32_t >			offsets;
+	std::vector< uint32_t >			lengths;
+};
+
+// Script source, memory mapped for regular files and read in one go for pipes/stdin
+struct SourceFile {
+	SourceFile( const std::string& path );
+	~SourceFile();
+
+	SourceFile( const SourceFile& ) = delete;
+	SourceFile& operator=( const SourceFile& ) = delete;
+
+	std::string_view view() const {
+		return std::string_view( data, length );
+	}
+
+	const char*				data;
+	size_t					length;
+	void*					mapping;
+	std::string				buffer;
+
+#ifdef _WIN32
+	void*					file_handle;
+	void*					mapping_handle;
+#endif
+};
+
+enum SimdLevel : int;
+
+void set_scan_simd_level( SimdLevel level );
+const Keyword* find_keyword( const std::string_view& word );
+const Keyword* find_operator( const std::string_view& text );
+int token_lbp( TokenId token_type );
+Token next_token( const std::string_view& source, size_t* cursor );
+TokenStream tokenize( const std::string_view& source );
+void parse( const TokenStream& tokens, Program* program );
+void parse( const std::string_view& source, Program* program );
+
+// Number of code words taken by an instruction, including its operands
+uint32_t opcode_length( uint32_t op );
+
+const char* opcode_name( uint32_t op );
+
+// Rewrites redundant instruction sequences, returns the number of code words removed
+size_t peephole_optimize( Function* function );
+
+// Replaces common instruction sequences with fused superinstructions, returns the number of code words removed
+size_t fuse_superinstructions( Function* function );
+
+// Operand stack words an instruction reads and writes, a peek counts as both
+struct StackEffect {
+	int		pops;
+	int		pushes;
+};
+
+StackEffect stack_effect( const uint32_t* instruction );
+
+// Jumps keep their relative offset in the first operand
+bool is_jump( uint32_t op );
+
+// Instructions whose first operand is a slot of the current frame
+bool is_slot_access( uint32_t op );
+
+// False when control never continues with the next instruction
+bool falls_through( uint32_t op );
+
+// Highest operand stack depth reached by the code, a call only counts its result, the callee checks its own depth
+uint32_t max_stack_depth( const Function& function );
+
+enum DispatchMode {
+	dispatch_switch,
+	dispatch_threaded,		// Experimental, computed goto is GCC/Clang only and the MSVC project never builds it
+};
+
+// Throws on malformed bytecode: bad opcodes or operands, jumps between instructions, slots outside
+// the frame, calls with the wrong arguments or stack heights that differ where control flow merges
+void verify_program( const Program& program );
+
+// Call data of one function, 32 bytes so two entries share a cache line and none straddles one
+struct alignas( 32 ) LinkedFunction {
+	const uint32_t*		code;
+	const uint32_t*		code_end;
+	const void*			threaded_code;		// Filled in by the threaded interpreter when it translates the code
+	uint32_t			max_stack;
+	int					arg_count;
+};
+
+struct LinkedProgram {
+	std::vector< LinkedFunction >	functions;		// Indexed by the function operand of op_call
+	std::vector< uint32_t >			arena;			// All function bodies back to back, when linked with 'use_arena'
+};
+
+// Resolves call targets into a table of code pointers. Without 'use_arena' the table points into
+// the code of 'program', which then has to outlive it.
+void link_program( const Program& program, bool use_arena, LinkedProgram* linked );
+
+// False when the build has no computed goto or was built with TURBINE_SWITCH_DISPATCH, run() then always uses the switch
+bool has_threaded_dispatch();
+
+// Largest RunOptions::memo_capacity, VMInstance throws above it
+const uint32_t max_memo_capacity = 1 << 24;
+
+struct RunOptions {
+	DispatchMode		dispatch = DispatchMode::dispatch_switch;
+	bool				verify = true;				// Verified programs run without runtime checks, off runs the checked switch loop instead
+	size_t				max_call_depth = 1024;		// Frames allocated up front, a deeper call throws
+	size_t				stack_size = 1 << 20;		// Operand stack values, reserved up front and committed as the stack grows
+	bool				code_arena = false;			// Lay out all function bodies in one contiguous arena
+	uint32_t			memo_capacity = 0;			// Cached results per pure function, rounded up to 4 times a power of two. 0 disables memoization. Memoized runs use the switch loop
+	bool				profile = false;			// Count opcodes, calls, time and branches. Profiled runs use the switch loop
+	std::string			profile_json;				// File run() writes the profile to, none when empty
+	uint64_t			slice_budget = 0;			// run() suspends and resumes Main every so many back-edges and calls, 0 runs it in one go
+};
+
+enum RunStatus {
+	run_finished,
+	run_suspended,		// Out of budget, the frames stay in the VM until resume()
+};
+
+struct MemoStats {
+	uint64_t			hits;
+	uint64_t			misses;
+	uint64_t			evictions;
+};
+
+// One cell per code word so jump offsets stay valid, opcodes are replaced by their handler address
+union ThreadedCell {
+	const void*		handler;
+	uint32_t		operand;
+};
+
+// Everything needed to run a program. Immutable once compiled, any number of VMs can run it at once.
+struct CompiledProgram {
+	Program											program;
+	LinkedProgram									linked;
+	std::vector< std::vector< ThreadedCell > >		threaded_code;		// Empty unless compiled for threaded dispatch
+	std::vector< double >							globals;			// Stack left by <global>, Main runs on top of a copy
+	bool											verified;
+	bool											threaded;
+	uint64_t										id;					// Unique per compile, state a VM keeps for a program is keyed by it, never by address
+};
+
+// Verifies, links and translates 'program' and runs <global> once to snapshot the globals
+std::shared_ptr< const CompiledProgram > compile_program( Program program, const RunOptions& options = RunOptions() );
+
+struct VM;
+struct Profile;
+
+// Operand stack and call frames of one thread, sized by the options and reused by every run
+struct VMInstance {
+	VMInstance( const RunOptions& options = RunOptions() );
+	~VMInstance();
+
+	VMInstance( const VMInstance& ) = delete;
+	VMInstance& operator=( const VMInstance& ) = delete;
+
+	// Runs Main, the program is only read so other instances may run it at the same time
+	double run( const CompiledProgram& program );
+
+	// Runs one function on the given arguments, without the globals
+	double call( const CompiledProgram& program, int function_index, const double* arguments );
+
+	// Runs Main like run(), but suspends right after the 'budget'th back-edge or call, 0 counts as 1. Only those
+	// are counted, straight line code between them always runs to the next one. Budgeted runs use the switch
+	// loop. 'result' is set once the run finishes, the program has to stay alive until then.
+	RunStatus start( const CompiledProgram& program, uint64_t budget, double* result );
+
+	// Continues a suspended run with a fresh budget, throws when there is none
+	RunStatus resume( uint64_t budget, double* result );
+
+	// A run() or call() abandons a suspended run
+	bool suspended() const;
+
+	// Counters of the result cache of one function, kept across runs of the same program
+	MemoStats memo_stats( int function_index ) const;
+
+	// Accumulated over the profiled runs of the same program
+	const Profile& profile() const;
+
+	VM*						vm;
+};
+
+// Compiles and runs once, printing the time taken by Main
+double run( Program program, const RunOptions& options = RunOptions() );
@@ -0,0 +1,205 @@
+#include <iostream>
+#include <vector>
+#include <string>
+#include <sstream>
+#include <iomanip>
+#include <chrono>
+#include <algorithm>
+#include <memory>
+#include <cstdint>
+
+#if defined( _MSC_VER )
+#include <intrin.h>
+#elif defined( __x86_64__ ) || defined( __i386__ )
+#include <x86intrin.h>
+#endif
+
+#include "Main.h"
+#include "Profiler.h"
+
+uint64_t profile_ticks() {
+#if defined( _M_X64 ) || defined( _M_IX86 ) || defined( __x86_64__ ) || defined( __i386__ )
+	return __rdtsc();
+#else
+	return ( uint64_t ) std::chrono::duration_cast< std::chrono::nanoseconds >( std::chrono::steady_clock::now().time_since_epoch() ).count();
+#endif
+}
+
+void reset_profile( Profile* profile, const Program& program ) {
+	profile->opcode_counts.assign( OpCode::op_store_slot + 1, 0 );
+	profile->functions.assign( program.functions.size(), FunctionProfile{ 0, 0, 0 } );
+	profile->branches.resize( program.functions.size() );
+
+	for ( auto& function : program.functions ) {
+		profile->branches[ function.index ].assign( function.code.size(), BranchProfile{ 0, 0 } );
+	}
+
+	profile->total_ticks = 0;
+	profile->total_seconds = 0.0;
+}
+
+struct BranchSite {
+	int					function_index;
+	size_t				offset;
+	BranchProfile		counts;
+};
+
+double ticks_to_ms( const Profile& profile, uint64_t ticks ) {
+	return profile.total_ticks == 0 ? 0.0 : ticks * profile.total_seconds * 1000.0 / profile.total_ticks;
+}
+
+std::vector< std::pair< uint32_t, uint64_t > > sorted_opcodes( const Profile& profile ) {
+	std::vector< std::pair< uint32_t, uint64_t > > opcodes;
+
+	for ( uint32_t op = 0; op < profile.opcode_counts.size(); ++op ) {
+		if ( profile.opcode_counts[ op ] > 0 ) {
+			opcodes.push_back( { op, profile.opcode_counts[ op ] } );
+		}
+	}
+
+	std::sort( opcodes.begin(), opcodes.end(), []( const auto& a, const auto& b ) { return a.second > b.second; } );
+	return opcodes;
+}
+
+std::vector< int > sorted_functions( const Profile& profile ) {
+	std::vector< int > functions;
+
+	for ( size_t i = 0; i < profile.functions.size(); ++i ) {
+		if ( profile.functions[ i ].calls > 0 ) {
+			functions.push_back( ( int ) i );
+		}
+	}
+
+	std::sort( functions.begin(), functions.end(), [ &profile ]( int a, int b ) {
+		return profile.functions[ a ].exclusive_ticks > profile.functions[ b ].exclusive_ticks;
+	} );
+
+	return functions;
+}
+
+std::vector< BranchSite > sorted_branches( const Profile& profile ) {
+	std::vector< BranchSite > sites;
+
+	for ( size_t i = 0; i < profile.branches.size(); ++i ) {
+		for ( size_t offset = 0; offset < profile.branches[ i ].size(); ++offset ) {
+			auto& counts = profile.branches[ i ][ offset ];
+
+			if ( counts.taken + counts.not_taken > 0 ) {
+				sites.push_back( BranchSite{ ( int ) i, offset, counts } );
+			}
+		}
+	}
+
+	std::sort( sites.begin(), sites.end(), []( const BranchSite& a, const BranchSite& b ) {
+		return a.counts.taken + a.counts.not_taken > b.counts.taken + b.counts.not_taken;
+	} );
+
+	return sites;
+}
+
+void print_profile( const Program& program, const Profile& profile ) {
+	uint64_t dispatches = 0;
+
+	for ( auto count : profile.opcode_counts ) {
+		dispatches += count;
+	}
+
+	// Formatted on its own stream, the flags set here must not leak into std::cout
+	std::ostringstream report;
+
+	report << "========== Profile ==========" << std::endl;
+	report << std::fixed << std::setprecision( 3 ) << "Total: " << profile.total_seconds * 1000.0 << " ms, " << dispatches << " instructions" << std::endl;
+
+	report << std::endl << std::left << std::setw( 20 ) << "Opcode" << std::right << std::setw( 14 ) << "Count" << std::setw( 9 ) << "%" << std::endl;
+
+	for ( auto& opcode : sorted_opcodes( profile ) ) {
+		report << std::left << std::setw( 20 ) << opcode_name( opcode.first ) << std::right << std::setw( 14 ) << opcode.second
+			<< std::setw( 8 ) << std::setprecision( 2 ) << opcode.second * 100.0 / dispatches << "%" << std::endl;
+	}
+
+	report << std::endl << std::left << std::setw( 20 ) << "Function" << std::right << std::setw( 14 ) << "Calls"
+		<< std::setw( 16 ) << "Inclusive ms" << std::setw( 16 ) << "Exclusive ms" << std::endl;
+
+	for ( auto index : sorted_functions( profile ) ) {
+		auto& function = profile.functions[ index ];
+
+		report << std::left << std::setw( 20 ) << symbol_name( program.functions[ index ].name ) << std::right << std::setw( 14 ) << function.calls
+			<< std::setprecision( 3 ) << std::setw( 16 ) << ticks_to_ms( profile, function.inclusive_ticks )
+			<< std::setw( 16 ) << ticks_to_ms( profile, function.exclusive_ticks ) << std::endl;
+	}
+
+	auto sites = sorted_branches( profile );
+
+	if ( sites.size() > 0 ) {
+		report << std::endl << std::left << std::setw( 28 ) << "Branch" << std::right << std::setw( 14 ) << "Taken"
+			<< std::setw( 14 ) << "Not taken" << std::setw( 9 ) << "Taken %" << std::endl;
+	}
+
+	for ( auto& site : sites ) {
+		auto& function = program.functions[ site.function_index ];
+		auto label = symbol_name( function.name ) + " @" + std::to_string( site.offset ) + " " + opcode_name( function.code[ site.offset ] );
+		auto total = site.counts.taken + site.counts.not_taken;
+
+		report << std::left << std::setw( 28 ) << label << std::right << std::setw( 14 ) << site.counts.taken
+			<< std::setw( 14 ) << site.counts.not_taken << std::setw( 8 ) << std::setprecision( 2 ) << site.counts.taken * 100.0 / total << "%" << std::endl;
+	}
+
+	std::cout << report.str();
+}
+
+std::string json_string( const std::string& text ) {
+	std::string quoted = "\"";
+
+	for ( auto c : text ) {
+		if ( c == '"' || c == '\\' ) {
+			quoted += '\\';
+		}
+
+		quoted += c;
+	}
+
+	return quoted + "\"";
+}
+
+std::string profile_json( const Program& program, const Profile& profile ) {
+	std::ostringstream json;
+	json << std::setprecision( 17 );
+
+	json << "{\n\t\"total_ms\": " << profile.total_seconds * 1000.0 << ",\n\t\"opcodes\": [";
+
+	auto opcodes = sorted_opcodes( profile );
+
+	for ( size_t i = 0; i < opcodes.size(); ++i ) {
+		json << ( i > 0 ? "," : "" ) << "\n\t\t{ \"name\": " << json_string( opcode_name( opcodes[ i ].first ) ) << ", \"count\": " << opcodes[ i ].second << " }";
+	}
+
+	json << "\n\t],\n\t\"functions\": [";
+
+	auto functions = sorted_functions( profile );
+
+	for ( size_t i = 0; i < functions.size(); ++i ) {
+		auto& function = profile.functions[ functions[ i ] ];
+
+		json << ( i > 0 ? "," : "" ) << "\n\t\t{ \"name\": " << json_string( symbol_name( program.functions[ functions[ i ] ].name ) )
+			<< ", \"calls\": " << function.calls
+			<< ", \"inclusive_ms\": " << ticks_to_ms( profile, function.inclusive_ticks )
+			<< ", \"exclusive_ms\": " << ticks_to_ms( profile, function.exclusive_ticks ) << " }";
+	}
+
+	json << "\n\t],\n\t\"branches\": [";
+
+	auto sites = sorted_branches( profile );
+
+	for ( size_t i = 0; i < sites.size(); ++i ) {
+		auto& function = program.functions[ sites[ i ].function_index ];
+
+		json << ( i > 0 ? "," : "" ) << "\n\t\t{ \"function\": " << json_string( symbol_name( function.name ) )
+			<< ", \"offset\": " << sites[ i ].offset
+			<< ", \"opcode\": " << json_string( opcode_name( function.code[ sites[ i ].offset ] ) )
+			<< ", \"taken\": " << sites[ i ].counts.taken
+			<< ", \"not_taken\": " << sites[ i ].counts.not_taken << " }";
+	}
+
+	json << "\n\t]\n}\n";
+	return json.str();
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+struct FunctionProfile {
+	uint64_t			calls;
+	uint64_t			inclusive_ticks;	// Recursive calls only count the outermost one
+	uint64_t			exclusive_ticks;
+};
+
+struct BranchProfile {
+	uint64_t			taken;
+	uint64_t			not_taken;
+};
+
+// Counters filled by a profiled run, see RunOptions::profile. Ticks come from profile_ticks().
+struct Profile {
+	std::vector< uint64_t >							opcode_counts;		// Indexed by OpCode
+	std::vector< FunctionProfile >					functions;
+	std::vector< std::vector< BranchProfile > >		branches;			// Per function, indexed by the code offset of the conditional jump
+	uint64_t										total_ticks;
+	double											total_seconds;
+};
+
+// Time stamp counter where there is one, steady_clock nanoseconds otherwise
+uint64_t profile_ticks();
+
+// Empty counters sized for 'program'
+void reset_profile( Profile* profile, const Program& program );
+
+// Opcodes by count, functions by exclusive time and branches by executions
+void print_profile( const Program& program, const Profile& profile );
+
+std::string profile_json( const Program& program, const Profile& profile );
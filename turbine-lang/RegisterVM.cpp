@@ -0,0 +1,638 @@
+#include <iostream>
+#include <vector>
+#include <string>
+#include <unordered_map>
+#include <chrono>
+#include <algorithm>
+#include <cstring>
+#include <memory>
+
+#include "Main.h"
+#include "RegisterVM.h"
+
+uint32_t register_opcode_length( uint32_t op ) {
+	switch ( op ) {
+	case RegisterOpCode::rop_add:
+	case RegisterOpCode::rop_sub:
+	case RegisterOpCode::rop_mul:
+	case RegisterOpCode::rop_div:
+	case RegisterOpCode::rop_gt:
+	case RegisterOpCode::rop_lt:
+	case RegisterOpCode::rop_eq:
+	case RegisterOpCode::rop_ne:
+	case RegisterOpCode::rop_gt_jz:
+	case RegisterOpCode::rop_lt_jz:
+	case RegisterOpCode::rop_eq_jz:
+	case RegisterOpCode::rop_ne_jz:
+	case RegisterOpCode::rop_call:
+	case RegisterOpCode::rop_tail_call:
+		return 4;
+	case RegisterOpCode::rop_move:
+	case RegisterOpCode::rop_jz:
+		return 3;
+	default:
+		return 2;
+	}
+}
+
+// Constants are numbered until the frame size is known, then rebased behind the stack positions
+const uint32_t constant_flag = 0x80000000;
+
+struct RegisterCompiler {
+	const Function*									function;
+	RegisterFunction*								out;
+
+	// Register holding the value of each stack position, a position is materialized when it holds its own value
+	std::vector< uint32_t >							stack;
+	uint32_t										max_depth;
+
+	std::unordered_map< uint64_t, uint32_t >		constant_index;
+	std::vector< size_t >							constant_operands;
+
+	// Register code offset of each stack instruction and the jumps still to be linked
+	std::unordered_map< size_t, size_t >			code_offsets;
+	std::vector< std::pair< size_t, size_t > >		jump_patches;
+	std::unordered_map< size_t, size_t >			target_depths;
+
+	// Stack height left behind by the first return, the globals for the global scope
+	int												return_depth;
+
+	// Offset of the last emitted instruction when it computed a temporary, SIZE_MAX otherwise
+	size_t											last_result;
+};
+
+void emit_operand( RegisterCompiler& compiler, uint32_t operand ) {
+	if ( operand & constant_flag ) {
+		compiler.constant_operands.push_back( compiler.out->code.size() );
+	}
+
+	compiler.out->code.push_back( operand );
+}
+
+void emit_instruction( RegisterCompiler& compiler, RegisterOpCode op, std::initializer_list< uint32_t > operands ) {
+	compiler.last_result = SIZE_MAX;
+	compiler.out->code.push_back( op );
+
+	for ( auto operand : operands ) {
+		emit_operand( compiler, operand );
+	}
+}
+
+void emit_jump( RegisterCompiler& compiler, RegisterOpCode op, std::initializer_list< uint32_t > operands, size_t target ) {
+	emit_instruction( compiler, op, operands );
+
+	compiler.jump_patches.push_back( std::make_pair( compiler.out->code.size(), target ) );
+	compiler.out->code.push_back( 0 );
+
+	compiler.target_depths[ target ] = compiler.stack.size();
+}
+
+void push_register( RegisterCompiler& compiler, uint32_t reg ) {
+	compiler.stack.push_back( reg );
+	compiler.max_depth = std::max( compiler.max_depth, ( uint32_t ) compiler.stack.size() );
+}
+
+uint32_t pop_register( RegisterCompiler& compiler ) {
+	if ( compiler.stack.size() == 0 ) {
+		throw std::exception( "Stack underflow in register translation" );
+	}
+
+	auto reg = compiler.stack.back();
+	compiler.stack.pop_back();
+
+	return reg;
+}
+
+uint32_t constant_register( RegisterCompiler& compiler, double number ) {
+	encoded_value value;
+	value.data.dbl = number;
+
+	auto found = compiler.constant_index.find( value.data.uint64[ 0 ] );
+
+	if ( found != compiler.constant_index.end() ) {
+		return found->second | constant_flag;
+	}
+
+	auto index = ( uint32_t ) compiler.out->constants.size();
+	compiler.out->constants.push_back( number );
+	compiler.constant_index[ value.data.uint64[ 0 ] ] = index;
+
+	return index | constant_flag;
+}
+
+// Nothing refers to a position while it is not materialized, so the move never clobbers a live value
+void materialize( RegisterCompiler& compiler, uint32_t position ) {
+	if ( compiler.stack[ position ] != position ) {
+		emit_instruction( compiler, RegisterOpCode::rop_move, { position, compiler.stack[ position ] } );
+		compiler.stack[ position ] = position;
+	}
+}
+
+// Control flow edges always see every stack position in its own register
+void materialize_all( RegisterCompiler& compiler, size_t count ) {
+	for ( uint32_t i = 0; i < count; ++i ) {
+		materialize( compiler, i );
+	}
+}
+
+void load_slot( RegisterCompiler& compiler, uint32_t slot ) {
+	if ( slot < compiler.stack.size() ) {
+		materialize( compiler, slot );
+	}
+
+	push_register( compiler, slot );
+}
+
+void set_slot( RegisterCompiler& compiler, uint32_t slot ) {
+	// Pending reads of the slot keep its old value
+	for ( uint32_t i = 0; i < compiler.stack.size(); ++i ) {
+		if ( i != slot && compiler.stack[ i ] == slot ) {
+			materialize( compiler, i );
+		}
+	}
+
+	auto value = compiler.stack.back();
+	auto top = ( uint32_t ) compiler.stack.size() - 1;
+
+	// The temporary was computed right before, write the result to the slot directly
+	if ( value == top && value != slot && compiler.last_result != SIZE_MAX ) {
+		compiler.out->code[ compiler.last_result + 1 ] = slot;
+		compiler.stack[ top ] = slot;
+		value = slot;
+	}
+
+	if ( value != slot ) {
+		emit_instruction( compiler, RegisterOpCode::rop_move, { slot, value } );
+	}
+
+	if ( slot < compiler.stack.size() ) {
+		compiler.stack[ slot ] = slot;
+	}
+}
+
+void binary( RegisterCompiler& compiler, RegisterOpCode op ) {
+	auto b = pop_register( compiler );
+	auto a = pop_register( compiler );
+	auto dst = ( uint32_t ) compiler.stack.size();
+
+	emit_instruction( compiler, op, { dst, a, b } );
+	push_register( compiler, dst );
+
+	compiler.last_result = compiler.out->code.size() - 4;
+}
+
+void compare_jump( RegisterCompiler& compiler, RegisterOpCode op, size_t target ) {
+	auto b = pop_register( compiler );
+	auto a = pop_register( compiler );
+
+	materialize_all( compiler, compiler.stack.size() );
+	emit_jump( compiler, op, { a, b }, target );
+}
+
+bool register_binary_op( uint32_t op, RegisterOpCode* register_op ) {
+	switch ( op ) {
+	case OpCode::op_add: *register_op = RegisterOpCode::rop_add; return true;
+	case OpCode::op_sub: *register_op = RegisterOpCode::rop_sub; return true;
+	case OpCode::op_mul: *register_op = RegisterOpCode::rop_mul; return true;
+	case OpCode::op_div: *register_op = RegisterOpCode::rop_div; return true;
+	case OpCode::op_gt: *register_op = RegisterOpCode::rop_gt; return true;
+	case OpCode::op_lt: *register_op = RegisterOpCode::rop_lt; return true;
+	case OpCode::op_eq: *register_op = RegisterOpCode::rop_eq; return true;
+	case OpCode::op_ne: *register_op = RegisterOpCode::rop_ne; return true;
+	default: return false;
+	}
+}
+
+bool register_compare_jump_op( uint32_t op, RegisterOpCode* register_op ) {
+	switch ( op ) {
+	case OpCode::op_gt:
+	case OpCode::op_gt_jz: *register_op = RegisterOpCode::rop_gt_jz; return true;
+	case OpCode::op_lt:
+	case OpCode::op_lt_jz: *register_op = RegisterOpCode::rop_lt_jz; return true;
+	case OpCode::op_eq:
+	case OpCode::op_eq_jz: *register_op = RegisterOpCode::rop_eq_jz; return true;
+	case OpCode::op_ne:
+	case OpCode::op_ne_jz: *register_op = RegisterOpCode::rop_ne_jz; return true;
+	default: return false;
+	}
+}
+
+size_t jump_target( const std::vector< uint32_t >& code, size_t offset ) {
+	encoded_value value;
+	value.data.uint32[ 0 ] = code[ offset + 1 ];
+
+	return offset + 2 + value.data.int32[ 0 ];
+}
+
+bool is_stack_jump( uint32_t op ) {
+	switch ( op ) {
+	case OpCode::op_jz:
+	case OpCode::op_jz_pop:
+	case OpCode::op_jmp:
+	case OpCode::op_gt_jz:
+	case OpCode::op_lt_jz:
+	case OpCode::op_eq_jz:
+	case OpCode::op_ne_jz:
+		return true;
+	default:
+		return false;
+	}
+}
+
+void compile_function( RegisterCompiler& compiler, int entry_depth ) {
+	auto& code = compiler.function->code;
+
+	std::unordered_map< size_t, bool > jump_targets;
+	for ( size_t offset = 0; offset < code.size(); offset += opcode_length( code[ offset ] ) ) {
+		if ( is_stack_jump( code[ offset ] ) ) {
+			jump_targets[ jump_target( code, offset ) ] = true;
+		}
+	}
+
+	for ( int i = 0; i < entry_depth; ++i ) {
+		push_register( compiler, i );
+	}
+
+	bool reachable = true;
+
+	for ( size_t offset = 0; offset < code.size(); offset += opcode_length( code[ offset ] ) ) {
+		if ( jump_targets.find( offset ) != jump_targets.end() ) {
+			compiler.last_result = SIZE_MAX;
+
+			if ( reachable ) {
+				materialize_all( compiler, compiler.stack.size() );
+			} else {
+				// Only reached through jumps, which left every position materialized
+				auto depth = compiler.target_depths.find( offset );
+
+				if ( depth != compiler.target_depths.end() ) {
+					compiler.stack.clear();
+
+					for ( uint32_t i = 0; i < depth->second; ++i ) {
+						push_register( compiler, i );
+					}
+
+					reachable = true;
+				}
+			}
+		}
+
+		compiler.code_offsets[ offset ] = compiler.out->code.size();
+
+		// Code after a return or jmp that no jump lands on
+		if ( !reachable ) {
+			continue;
+		}
+
+		auto op = code[ offset ];
+		RegisterOpCode register_op;
+
+		if ( register_binary_op( op, &register_op ) ) {
+			auto next = offset + 1;
+
+			// Comparison feeding a branch becomes a compare-and-branch
+			if ( next < code.size() && code[ next ] == OpCode::op_jz_pop && jump_targets.find( next ) == jump_targets.end()
+				&& register_compare_jump_op( op, &register_op ) ) {
+				compiler.code_offsets[ next ] = compiler.out->code.size();
+				compare_jump( compiler, register_op, jump_target( code, next ) );
+
+				offset = next;
+				continue;
+			}
+
+			binary( compiler, register_op );
+			continue;
+		}
+
+		switch ( op ) {
+		case OpCode::op_load_number: {
+			encoded_value value;
+			value.data.uint32[ 0 ] = code[ offset + 1 ];
+			value.data.uint32[ 1 ] = code[ offset + 2 ];
+
+			push_register( compiler, constant_register( compiler, value.data.dbl ) );
+			break;
+		}
+		case OpCode::op_load_zero: push_register( compiler, constant_register( compiler, 0.0 ) ); break;
+		case OpCode::op_load_slot: load_slot( compiler, code[ offset + 1 ] ); break;
+		case OpCode::op_set_slot: set_slot( compiler, code[ offset + 1 ] ); break;
+		case OpCode::op_store_slot:
+			set_slot( compiler, code[ offset + 1 ] );
+			pop_register( compiler );
+			break;
+		case OpCode::op_pop: pop_register( compiler ); break;
+		case OpCode::op_add_slot_imm:
+		case OpCode::op_sub_slot_imm:
+		case OpCode::op_mul_slot_imm:
+		case OpCode::op_div_slot_imm: {
+			encoded_value value;
+			value.data.uint32[ 0 ] = code[ offset + 2 ];
+			value.data.uint32[ 1 ] = code[ offset + 3 ];
+
+			load_slot( compiler, code[ offset + 1 ] );
+			push_register( compiler, constant_register( compiler, value.data.dbl ) );
+
+			switch ( op ) {
+			case OpCode::op_add_slot_imm: binary( compiler, RegisterOpCode::rop_add ); break;
+			case OpCode::op_sub_slot_imm: binary( compiler, RegisterOpCode::rop_sub ); break;
+			case OpCode::op_mul_slot_imm: binary( compiler, RegisterOpCode::rop_mul ); break;
+			case OpCode::op_div_slot_imm: binary( compiler, RegisterOpCode::rop_div ); break;
+			}
+
+			break;
+		}
+		case OpCode::op_gt_jz:
+		case OpCode::op_lt_jz:
+		case OpCode::op_eq_jz:
+		case OpCode::op_ne_jz:
+			register_compare_jump_op( op, &register_op );
+			compare_jump( compiler, register_op, jump_target( code, offset ) );
+			break;
+		case OpCode::op_jz: {
+			materialize_all( compiler, compiler.stack.size() );
+			emit_jump( compiler, RegisterOpCode::rop_jz, { compiler.stack.back() }, jump_target( code, offset ) );
+			break;
+		}
+		case OpCode::op_jz_pop: {
+			auto condition = pop_register( compiler );
+
+			materialize_all( compiler, compiler.stack.size() );
+			emit_jump( compiler, RegisterOpCode::rop_jz, { condition }, jump_target( code, offset ) );
+			break;
+		}
+		case OpCode::op_jmp:
+			materialize_all( compiler, compiler.stack.size() );
+			emit_jump( compiler, RegisterOpCode::rop_jmp, {}, jump_target( code, offset ) );
+
+			reachable = false;
+			break;
+		case OpCode::op_call:
+		case OpCode::op_tail_call: {
+			auto function_index = code[ offset + 1 ];
+			auto arg_count = code[ offset + 2 ];
+
+			if ( arg_count > compiler.stack.size() ) {
+				throw std::exception( "Stack underflow in register translation" );
+			}
+
+			auto dst = ( uint32_t ) ( compiler.stack.size() - arg_count );
+
+			for ( auto i = dst; i < compiler.stack.size(); ++i ) {
+				materialize( compiler, i );
+			}
+
+			if ( op == OpCode::op_tail_call ) {
+				emit_instruction( compiler, RegisterOpCode::rop_tail_call, { dst, function_index, arg_count } );
+				compiler.stack.resize( dst );
+
+				reachable = false;
+				break;
+			}
+
+			emit_instruction( compiler, RegisterOpCode::rop_call, { dst, function_index, arg_count } );
+
+			compiler.stack.resize( dst );
+			push_register( compiler, dst );
+			break;
+		}
+		case OpCode::op_return: {
+			auto value = pop_register( compiler );
+			emit_instruction( compiler, RegisterOpCode::rop_return, { value } );
+
+			if ( compiler.return_depth < 0 ) {
+				compiler.return_depth = ( int ) compiler.stack.size();
+			}
+
+			reachable = false;
+			break;
+		}
+		default:
+			throw std::exception( ( "Can not translate instruction '" + std::to_string( op ) + "'" ).c_str() );
+		}
+	}
+
+	auto& out_code = compiler.out->code;
+
+	for ( auto& patch : compiler.jump_patches ) {
+		encoded_value value;
+		value.data.int32[ 0 ] = ( int32_t ) compiler.code_offsets.at( patch.second ) - ( int32_t ) ( patch.first + 1 );
+
+		out_code[ patch.first ] = value.data.uint32[ 0 ];
+	}
+
+	// Slots may be addressed beyond the deepest stack position
+	uint32_t frame_positions = compiler.max_depth;
+
+	for ( size_t offset = 0; offset < code.size(); offset += opcode_length( code[ offset ] ) ) {
+		switch ( code[ offset ] ) {
+		case OpCode::op_load_slot:
+		case OpCode::op_set_slot:
+		case OpCode::op_store_slot:
+		case OpCode::op_add_slot_imm:
+		case OpCode::op_sub_slot_imm:
+		case OpCode::op_mul_slot_imm:
+		case OpCode::op_div_slot_imm:
+			frame_positions = std::max( frame_positions, code[ offset + 1 ] + 1 );
+			break;
+		}
+	}
+
+	compiler.out->constant_base = frame_positions;
+	compiler.out->frame_size = frame_positions + ( uint32_t ) compiler.out->constants.size();
+
+	for ( auto operand : compiler.constant_operands ) {
+		out_code[ operand ] = compiler.out->constant_base + ( out_code[ operand ] & ~constant_flag );
+	}
+}
+
+RegisterFunction compile_register_function( const Function& function, int entry_depth, int* return_depth ) {
+	RegisterFunction out;
+
+	RegisterCompiler compiler;
+	compiler.function = &function;
+	compiler.out = &out;
+	compiler.max_depth = 0;
+	compiler.return_depth = -1;
+	compiler.last_result = SIZE_MAX;
+
+	compile_function( compiler, entry_depth );
+
+	if ( return_depth ) {
+		*return_depth = compiler.return_depth;
+	}
+
+	return out;
+}
+
+RegisterProgram compile_registers( const Program& program ) {
+	// The translation trusts slots and stack heights the same way the unchecked stack interpreter does
+	verify_program( program );
+
+	RegisterProgram out;
+	out.global = program.global;
+	out.main = program.main;
+	out.functions.resize( program.functions.size() );
+
+	// Main runs on top of the globals left behind by the global scope
+	int global_count = 0;
+	out.functions[ program.global ] = compile_register_function( program.functions[ program.global ], 0, &global_count );
+
+	for ( auto& function : program.functions ) {
+		if ( function.index == program.global ) {
+			continue;
+		}
+
+		auto entry_depth = function.index == program.main ? std::max( global_count, 0 ) : function.arg_count;
+		out.functions[ function.index ] = compile_register_function( function, entry_depth, NULL );
+	}
+
+	return out;
+}
+
+struct RegisterVM {
+	struct Frame {
+		const RegisterFunction*		function;
+		const uint32_t*				ip;
+		double*						base;
+		uint32_t					dst;
+	};
+
+	const RegisterProgram*			program;
+	std::vector< double >			registers;
+	std::vector< Frame >			frames;
+};
+
+void enter_frame( RegisterVM& vm, const RegisterFunction& function, double* base ) {
+	if ( base + function.frame_size > vm.registers.data() + vm.registers.size() ) {
+		throw std::exception( "Maximum VM register count exceeded" );
+	}
+
+	std::copy( function.constants.begin(), function.constants.end(), base + function.constant_base );
+}
+
+#define register_arit_op( op ) { \
+	base[ ip[ 1 ] ] = base[ ip[ 2 ] ] op base[ ip[ 3 ] ]; \
+	ip += 4; \
+}
+
+#define register_binary_op( op ) { \
+	base[ ip[ 1 ] ] = base[ ip[ 2 ] ] op base[ ip[ 3 ] ] ? 1.0 : 0.0; \
+	ip += 4; \
+}
+
+#define register_compare_jz_op( op ) { \
+	bool condition = base[ ip[ 1 ] ] op base[ ip[ 2 ] ]; \
+	ip += 4; \
+	if ( !condition ) { \
+		ip += ( int32_t ) ip[ -1 ]; \
+	} \
+}
+
+double execute_registers( RegisterVM& vm, const RegisterFunction& fn, double* base ) {
+	const RegisterFunction* function = &fn;
+	const uint32_t* ip = function->code.data();
+
+	enter_frame( vm, fn, base );
+
+	for ( ;; ) {
+		switch ( *ip ) {
+		case RegisterOpCode::rop_add: register_arit_op( + ); break;
+		case RegisterOpCode::rop_sub: register_arit_op( - ); break;
+		case RegisterOpCode::rop_mul: register_arit_op( * ); break;
+		case RegisterOpCode::rop_div: register_arit_op( / ); break;
+		case RegisterOpCode::rop_gt: register_binary_op( > ); break;
+		case RegisterOpCode::rop_lt: register_binary_op( < ); break;
+		case RegisterOpCode::rop_eq: register_binary_op( == ); break;
+		case RegisterOpCode::rop_ne: register_binary_op( != ); break;
+		case RegisterOpCode::rop_gt_jz: register_compare_jz_op( > ); break;
+		case RegisterOpCode::rop_lt_jz: register_compare_jz_op( < ); break;
+		case RegisterOpCode::rop_eq_jz: register_compare_jz_op( == ); break;
+		case RegisterOpCode::rop_ne_jz: register_compare_jz_op( != ); break;
+		case RegisterOpCode::rop_move:
+			base[ ip[ 1 ] ] = base[ ip[ 2 ] ];
+			ip += 3;
+			break;
+		case RegisterOpCode::rop_jmp:
+			ip += 2;
+			ip += ( int32_t ) ip[ -1 ];
+			break;
+		case RegisterOpCode::rop_jz: {
+			bool is_zero = base[ ip[ 1 ] ] == 0.0;
+			ip += 3;
+
+			if ( is_zero ) {
+				ip += ( int32_t ) ip[ -1 ];
+			}
+
+			break;
+		}
+		case RegisterOpCode::rop_call: {
+			auto dst = ip[ 1 ];
+			auto arg_count = ip[ 3 ];
+			auto& callee = vm.program->functions[ ip[ 2 ] ];
+
+			// Callee frame starts after the whole caller frame, the arguments are copied over
+			auto callee_base = base + function->frame_size;
+			enter_frame( vm, callee, callee_base );
+			std::copy( base + dst, base + dst + arg_count, callee_base );
+
+			vm.frames.push_back( RegisterVM::Frame{ function, ip + 4, base, dst } );
+
+			function = &callee;
+			base = callee_base;
+			ip = callee.code.data();
+			break;
+		}
+		case RegisterOpCode::rop_tail_call: {
+			auto dst = ip[ 1 ];
+			auto arg_count = ip[ 3 ];
+			auto& callee = vm.program->functions[ ip[ 2 ] ];
+
+			// The arguments move down to the base, the return frame of the caller stays
+			std::memmove( base, base + dst, arg_count * sizeof( double ) );
+			enter_frame( vm, callee, base );
+
+			function = &callee;
+			ip = callee.code.data();
+			break;
+		}
+		case RegisterOpCode::rop_return: {
+			auto return_value = base[ ip[ 1 ] ];
+
+			if ( vm.frames.size() == 0 ) {
+				return return_value;
+			}
+
+			auto& return_frame = vm.frames[ vm.frames.size() - 1 ];
+
+			function = return_frame.function;
+			ip = return_frame.ip;
+			base = return_frame.base;
+			base[ return_frame.dst ] = return_value;
+
+			vm.frames.pop_back();
+			break;
+		}
+		default:
+			throw std::exception( ( "Invalid register instruction '" + std::to_string( *ip ) + "'" ).c_str() );
+		}
+	}
+}
+
+double run_registers( const RegisterProgram& program, size_t register_count ) {
+	RegisterVM vm;
+	vm.program = &program;
+	vm.registers.resize( register_count );
+
+	// Main shares the frame of the global scope, the globals are its lowest registers
+	execute_registers( vm, program.functions[ program.global ], vm.registers.data() );
+
+	auto time_start = std::chrono::steady_clock::now();
+	auto return_value = execute_registers( vm, program.functions[ program.main ], vm.registers.data() );
+	auto time_end = std::chrono::steady_clock::now();
+
+	auto d_s = std::chrono::duration_cast< std::chrono::milliseconds >( time_end - time_start );
+	std::cout << "Register interpreter took " << d_s.count() << " ms" << std::endl;
+
+	return return_value;
+}
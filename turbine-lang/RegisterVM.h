@@ -0,0 +1,46 @@
+#pragma once
+
+// Three-address bytecode, operands name registers of the current frame
+enum RegisterOpCode : uint32_t {
+	rop_add,		// dst, a, b
+	rop_sub,
+	rop_mul,
+	rop_div,
+	rop_gt,
+	rop_lt,
+	rop_eq,
+	rop_ne,
+	rop_move,		// dst, src
+	rop_jmp,		// offset
+	rop_jz,			// cond, offset
+	rop_gt_jz,		// a, b, offset, jumps when the comparison is false
+	rop_lt_jz,
+	rop_eq_jz,
+	rop_ne_jz,
+	rop_call,		// dst, function, arg count, arguments are in dst and up
+	rop_tail_call,	// dst, function, arg count, the callee takes over the frame
+	rop_return,		// src
+};
+
+// Frame layout: stack positions of the stack bytecode, then the constants
+struct RegisterFunction {
+	std::vector< uint32_t >				code;
+	std::vector< double >				constants;
+	uint32_t							constant_base;
+	uint32_t							frame_size;
+};
+
+struct RegisterProgram {
+	int									global;
+	int									main;
+	std::vector< RegisterFunction >		functions;
+};
+
+// Number of code words taken by a register instruction, including its operands
+uint32_t register_opcode_length( uint32_t op );
+
+// Verifies the stack bytecode like the stack VM does, then translates every function
+RegisterProgram compile_registers( const Program& program );
+
+// 'register_count' bounds the registers of all frames on the call stack together
+double run_registers( const RegisterProgram& program, size_t register_count = 65536 );
@@ -0,0 +1,218 @@
+#include <cstdint>
+#include <cstddef>
+
+#include "SimdScan.h"
+
+#if defined( _M_X64 ) || defined( _M_IX86 ) || defined( __x86_64__ ) || defined( __i386__ )
+#define SIMD_SCAN_X86 1
+#else
+#define SIMD_SCAN_X86 0
+#endif
+
+#if SIMD_SCAN_X86
+
+#include <immintrin.h>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#define TARGET_SSE2
+#define TARGET_AVX2
+#else
+#include <cpuid.h>
+#define TARGET_SSE2 __attribute__(( target( "sse2" ) ))
+#define TARGET_AVX2 __attribute__(( target( "avx2" ) ))
+#endif
+
+static void cpuid( int leaf, int subleaf, uint32_t registers[ 4 ] ) {
+#ifdef _MSC_VER
+	int info[ 4 ];
+	__cpuidex( info, leaf, subleaf );
+
+	for ( int i = 0; i < 4; ++i )
+		registers[ i ] = ( uint32_t ) info[ i ];
+#else
+	__cpuid_count( leaf, subleaf, registers[ 0 ], registers[ 1 ], registers[ 2 ], registers[ 3 ] );
+#endif
+}
+
+static uint64_t read_xcr0() {
+#ifdef _MSC_VER
+	return _xgetbv( 0 );
+#else
+	uint32_t eax, edx;
+	__asm__( "xgetbv" : "=a" ( eax ), "=d" ( edx ) : "c" ( 0 ) );
+	return ( ( uint64_t ) edx << 32 ) | eax;
+#endif
+}
+
+static uint32_t count_trailing_zeros( uint32_t value ) {
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanForward( &index, value );
+	return index;
+#else
+	return __builtin_ctz( value );
+#endif
+}
+
+SimdLevel simd_detect() {
+	uint32_t registers[ 4 ];
+
+	cpuid( 0, 0, registers );
+	auto max_leaf = registers[ 0 ];
+
+	cpuid( 1, 0, registers );
+
+	bool has_sse2 = ( registers[ 3 ] & ( 1 << 26 ) ) != 0;
+	bool has_osxsave = ( registers[ 2 ] & ( 1 << 27 ) ) != 0;
+	bool has_avx = ( registers[ 2 ] & ( 1 << 28 ) ) != 0;
+
+	if ( !has_sse2 )
+		return SimdLevel::simd_none;
+
+	// AVX2 also needs the OS to save the ymm registers
+	if ( max_leaf >= 7 && has_osxsave && has_avx && ( read_xcr0() & 0x6 ) == 0x6 ) {
+		cpuid( 7, 0, registers );
+
+		if ( registers[ 1 ] & ( 1 << 5 ) )
+			return SimdLevel::simd_avx2;
+	}
+
+	return SimdLevel::simd_sse2;
+}
+
+// Byte classification, each returns 0xFF for bytes inside the class
+struct WhitespaceSse2 {
+	TARGET_SSE2 static __m128i classify( __m128i c ) {
+		return _mm_or_si128(
+			_mm_cmpeq_epi8( c, _mm_set1_epi8( ' ' ) ),
+			_mm_or_si128( _mm_cmpeq_epi8( c, _mm_set1_epi8( '\t' ) ), _mm_cmpeq_epi8( c, _mm_set1_epi8( '\n' ) ) )
+		);
+	}
+};
+
+TARGET_SSE2 inline __m128i in_range_sse2( __m128i c, char low, char high ) {
+	// Signed compares, bytes >= 0x80 are negative and never in range
+	return _mm_and_si128( _mm_cmpgt_epi8( c, _mm_set1_epi8( low - 1 ) ), _mm_cmplt_epi8( c, _mm_set1_epi8( high + 1 ) ) );
+}
+
+struct NumberSse2 {
+	TARGET_SSE2 static __m128i classify( __m128i c ) {
+		return _mm_or_si128( in_range_sse2( c, '0', '9' ), _mm_cmpeq_epi8( c, _mm_set1_epi8( '.' ) ) );
+	}
+};
+
+struct IdentifierSse2 {
+	TARGET_SSE2 static __m128i classify( __m128i c ) {
+		auto lower = _mm_or_si128( c, _mm_set1_epi8( 0x20 ) );
+
+		return _mm_or_si128(
+			_mm_or_si128( in_range_sse2( c, '0', '9' ), in_range_sse2( lower, 'a', 'z' ) ),
+			_mm_cmpeq_epi8( c, _mm_set1_epi8( '_' ) )
+		);
+	}
+};
+
+struct WhitespaceAvx2 {
+	TARGET_AVX2 static __m256i classify( __m256i c ) {
+		return _mm256_or_si256(
+			_mm256_cmpeq_epi8( c, _mm256_set1_epi8( ' ' ) ),
+			_mm256_or_si256( _mm256_cmpeq_epi8( c, _mm256_set1_epi8( '\t' ) ), _mm256_cmpeq_epi8( c, _mm256_set1_epi8( '\n' ) ) )
+		);
+	}
+};
+
+TARGET_AVX2 inline __m256i in_range_avx2( __m256i c, char low, char high ) {
+	return _mm256_and_si256( _mm256_cmpgt_epi8( c, _mm256_set1_epi8( low - 1 ) ), _mm256_cmpgt_epi8( _mm256_set1_epi8( high + 1 ), c ) );
+}
+
+struct NumberAvx2 {
+	TARGET_AVX2 static __m256i classify( __m256i c ) {
+		return _mm256_or_si256( in_range_avx2( c, '0', '9' ), _mm256_cmpeq_epi8( c, _mm256_set1_epi8( '.' ) ) );
+	}
+};
+
+struct IdentifierAvx2 {
+	TARGET_AVX2 static __m256i classify( __m256i c ) {
+		auto lower = _mm256_or_si256( c, _mm256_set1_epi8( 0x20 ) );
+
+		return _mm256_or_si256(
+			_mm256_or_si256( in_range_avx2( c, '0', '9' ), in_range_avx2( lower, 'a', 'z' ) ),
+			_mm256_cmpeq_epi8( c, _mm256_set1_epi8( '_' ) )
+		);
+	}
+};
+
+template < typename Class >
+TARGET_SSE2 size_t skip_sse2( const char* data, size_t from, size_t length ) {
+	size_t i = from;
+
+	while ( i + 16 <= length ) {
+		auto chunk = _mm_loadu_si128( ( const __m128i* ) ( data + i ) );
+		auto mask = ( uint32_t ) _mm_movemask_epi8( Class::classify( chunk ) );
+
+		if ( mask != 0xFFFF )
+			return i + count_trailing_zeros( ~mask );
+
+		i += 16;
+	}
+
+	return i;
+}
+
+template < typename Class >
+TARGET_AVX2 size_t skip_avx2( const char* data, size_t from, size_t length ) {
+	size_t i = from;
+
+	while ( i + 32 <= length ) {
+		auto chunk = _mm256_loadu_si256( ( const __m256i* ) ( data + i ) );
+		auto mask = ( uint32_t ) _mm256_movemask_epi8( Class::classify( chunk ) );
+
+		if ( mask != 0xFFFFFFFF )
+			return i + count_trailing_zeros( ~mask );
+
+		i += 32;
+	}
+
+	return i;
+}
+
+size_t simd_skip_whitespace_sse2( const char* data, size_t from, size_t length ) {
+	return skip_sse2< WhitespaceSse2 >( data, from, length );
+}
+
+size_t simd_skip_identifier_sse2( const char* data, size_t from, size_t length ) {
+	return skip_sse2< IdentifierSse2 >( data, from, length );
+}
+
+size_t simd_skip_number_sse2( const char* data, size_t from, size_t length ) {
+	return skip_sse2< NumberSse2 >( data, from, length );
+}
+
+size_t simd_skip_whitespace_avx2( const char* data, size_t from, size_t length ) {
+	return skip_avx2< WhitespaceAvx2 >( data, from, length );
+}
+
+size_t simd_skip_identifier_avx2( const char* data, size_t from, size_t length ) {
+	return skip_avx2< IdentifierAvx2 >( data, from, length );
+}
+
+size_t simd_skip_number_avx2( const char* data, size_t from, size_t length ) {
+	return skip_avx2< NumberAvx2 >( data, from, length );
+}
+
+#else
+
+// Non-x86 builds only have the scalar scanner, the kernels leave all work to the scalar tail
+SimdLevel simd_detect() {
+	return SimdLevel::simd_none;
+}
+
+size_t simd_skip_whitespace_sse2( const char* /* data */, size_t from, size_t /* length */ ) { return from; }
+size_t simd_skip_identifier_sse2( const char* /* data */, size_t from, size_t /* length */ ) { return from; }
+size_t simd_skip_number_sse2( const char* /* data */, size_t from, size_t /* length */ ) { return from; }
+size_t simd_skip_whitespace_avx2( const char* /* data */, size_t from, size_t /* length */ ) { return from; }
+size_t simd_skip_identifier_avx2( const char* /* data */, size_t from, size_t /* length */ ) { return from; }
+size_t simd_skip_number_avx2( const char* /* data */, size_t from, size_t /* length */ ) { return from; }
+
+#endif
@@ -0,0 +1,20 @@
+#pragma once
+
+enum SimdLevel : int {
+	simd_none,
+	simd_sse2,
+	simd_avx2,
+};
+
+// Highest level supported by both the build and the CPU
+SimdLevel simd_detect();
+
+// Skip a run of characters 16/32 bytes at a time. Returns the index of the first character
+// outside the run, or the index where less than one full block is left for a scalar tail.
+size_t simd_skip_whitespace_sse2( const char* data, size_t from, size_t length );
+size_t simd_skip_identifier_sse2( const char* data, size_t from, size_t length );
+size_t simd_skip_number_sse2( const char* data, size_t from, size_t length );
+
+size_t simd_skip_whitespace_avx2( const char* data, size_t from, size_t length );
+size_t simd_skip_identifier_avx2( const char* data, size_t from, size_t length );
+size_t simd_skip_number_avx2( const char* data, size_t from, size_t length );
@@ -9,13 +9,14 @@
 #include <map>
 #include <stack>
 #include <iomanip>
+#include <memory>
 
-#include "Decompiler.h"
 #include "../Main.h"
+#include "Decompiler.h"
 
 struct StackValue {
-	std::string						var_id;
-	std::string						node_id;
+	NodeId							var_id;
+	NodeId							node_id;
 };
 
 struct Block {
@@ -74,24 +75,20 @@ struct NodeAllocator {
 	}
 
 	std::vector< AstNode* >			allocated_nodes;
+	NodeId							next_id = node_id_none + 1;		// See gen_node_id()
 };
 
-std::string gen_node_id() {
-	static int s_node_counter = 0;
-	return "node_" + std::to_string( s_node_counter++ );
-}
-
-std::string gen_var_id() {
-	static int s_var_counter = 0;
-	return "var_" + std::to_string( s_var_counter++ );
+// Node and value ids only have to differ from each other within one decompilation, so they are
+// numbered per allocator rather than interned as names into the global symbol table
+NodeId gen_node_id( NodeAllocator& allocator ) {
+	return allocator.next_id++;
 }
 
-std::string gen_var_copy_id( const std::string& original_id ) {
-	static int s_var_counter = 0;
-	return original_id + "_copy_" + std::to_string( s_var_counter++ );
+NodeId gen_var_id( NodeAllocator& allocator ) {
+	return allocator.next_id++;
 }
 
-AstNode* alloc_simple_node( NodeAllocator& allocator, const std::string& node_id, AstNodeType node_type, AstNode* child ) {
+AstNode* alloc_simple_node( NodeAllocator& allocator, NodeId node_id, AstNodeType node_type, AstNode* child ) {
 	auto node = allocator.alloc_node();
 	node->node_id = node_id;
 	node->node_type = node_type;
@@ -102,8 +99,8 @@ AstNode* alloc_simple_node( NodeAllocator& allocator, const std::string& node_id
 	return node;
 }
 
-AstNode* alloc_complex_node( NodeAllocator& allocator, const std::string& node_id, AstNodeType node_type,
-	const std::string& var_id_to, AstNode* lhs_child, AstNode* rhs_child ) {
+AstNode* alloc_complex_node( NodeAllocator& allocator, NodeId node_id, AstNodeType node_type,
+	NodeId var_id_to, AstNode* lhs_child, AstNode* rhs_child ) {
 	auto node = allocator.alloc_node();
 	node->node_id = node_id;
 	node->node_type = node_type;
@@ -115,7 +112,7 @@ AstNode* alloc_complex_node( NodeAllocator& allocator, const std::string& node_i
 	return node;
 }
 
-AstNode* alloc_list_node( NodeAllocator& allocator, const std::string& node_id,
+AstNode* alloc_list_node( NodeAllocator& allocator, NodeId node_id,
 	AstNodeType node_type, const std::vector< AstNode* >& children ) {
 	auto node = allocator.alloc_node();
 	node->node_id = node_id;
@@ -127,8 +124,8 @@ AstNode* alloc_list_node( NodeAllocator& allocator, const std::string& node_id,
 	return node;
 }
 
-AstNode* alloc_const_node( NodeAllocator& allocator, const std::string& node_id,
-	AstNodeType node_type, const std::string& var_id_to, double constant ) {
+AstNode* alloc_const_node( NodeAllocator& allocator, NodeId node_id,
+	AstNodeType node_type, NodeId var_id_to, double constant ) {
 	auto node = allocator.alloc_node();
 	node->node_id = node_id;
 	node->node_type = node_type;
@@ -140,8 +137,8 @@ AstNode* alloc_const_node( NodeAllocator& allocator, const std::string& node_id,
 	return node;
 }
 
-AstNode* alloc_identifier_node( NodeAllocator& allocator, const std::string& node_id,
-	const std::string& var_id_from, const std::string& var_id_to ) {
+AstNode* alloc_identifier_node( NodeAllocator& allocator, NodeId node_id,
+	NodeId var_id_from, NodeId var_id_to ) {
 	auto node = allocator.alloc_node();
 	node->node_id = node_id;
 	node->node_type = AstNodeType::node_identifier;
@@ -153,8 +150,8 @@ AstNode* alloc_identifier_node( NodeAllocator& allocator, const std::string& nod
 	return node;
 }
 
-AstNode* alloc_assign_node( NodeAllocator& allocator, const std::string& node_id,
-	const std::string& var_id_from, const std::string& var_id_to ) {
+AstNode* alloc_assign_node( NodeAllocator& allocator, NodeId node_id,
+	NodeId var_id_from, NodeId var_id_to ) {
 	auto node = allocator.alloc_node();
 	node->node_id = node_id;
 	node->node_type = AstNodeType::node_assign;
@@ -167,7 +164,7 @@ AstNode* alloc_assign_node( NodeAllocator& allocator, const std::string& node_id
 	return node;
 }
 
-void nodes_with_dependency( const std::vector< AstNode* >& nodes, const std::string& var_id, std::vector< AstNode* >* out_dep_nodes ) {
+void nodes_with_dependency( const std::vector< AstNode* >& nodes, NodeId var_id, std::vector< AstNode* >* out_dep_nodes ) {
 	std::deque< AstNode* > queue;
 
 	for ( auto node : nodes ) {
@@ -191,23 +188,23 @@ void nodes_with_dependency( const std::vector< AstNode* >& nodes, const std::str
 	} while ( !queue.empty() );
 }
 
-std::vector< AstNode* >::iterator find_node( std::vector< AstNode* >& mutable_nodes, const std::string& node_id ) {
-	auto find_result = std::find_if( mutable_nodes.begin(), mutable_nodes.end(), [ &node_id ]( const AstNode* node ) {
+std::vector< AstNode* >::iterator find_node( std::vector< AstNode* >& mutable_nodes, NodeId node_id ) {
+	auto find_result = std::find_if( mutable_nodes.begin(), mutable_nodes.end(), [ node_id ]( const AstNode* node ) {
 		return node->node_id == node_id;
 	} );
 
 	if ( find_result == mutable_nodes.end() ) {
-		throw new std::exception( ( "Node \"" + node_id + "\" not found" ).c_str() );
+		throw std::exception( ( "Node " + std::to_string( node_id ) + " not found" ).c_str() );
 	}
 
 	return find_result;
 }
 
-AstNode* find_and_remove_node( std::vector< AstNode* >& mutable_nodes, const std::string& node_id ) {
+AstNode* find_and_remove_node( std::vector< AstNode* >& mutable_nodes, NodeId node_id ) {
 	auto find_result = find_node( mutable_nodes, node_id );
 	auto find_node = *find_result;
 
-	if ( find_node->var_id_to.length() > 0 ) {
+	if ( find_node->var_id_to != node_id_none ) {
 		// Check dependency graph for nodes that depend on the value produced by this (found) node
 		std::vector< AstNode* > dependent_nodes;
 		nodes_with_dependency( mutable_nodes, find_node->var_id_to, &dependent_nodes );
@@ -223,7 +220,7 @@ AstNode* find_and_remove_node( std::vector< AstNode* >& mutable_nodes, const std
 
 void stack_pop( std::vector< AstNode* >& mutable_nodes, std::vector< StackValue >& mutable_stack, StackValue* out_value = NULL, AstNode** out_node = NULL ) {
 	if ( mutable_stack.size() == 0 ) {
-		throw new std::exception( "Invalid stack pop" );
+		throw std::exception( "Invalid stack pop" );
 	}
 
 	auto stack_value = mutable_stack[ mutable_stack.size() - 1 ];
@@ -240,6 +237,90 @@ void stack_pop( std::vector< AstNode* >& mutable_nodes, std::vector< StackValue
 	}
 }
 
+void decompile_load_number( NodeAllocator& allocator, std::vector< StackValue >& stack, std::vector< AstNode* >& nodes, double number ) {
+	auto node_id = gen_node_id( allocator );
+	auto var_id = gen_var_id( allocator );
+
+	nodes.push_back( alloc_const_node( allocator, node_id, AstNodeType::node_const, var_id, number ) );
+	stack.push_back( StackValue{ var_id, node_id } );
+}
+
+void decompile_load_slot( NodeAllocator& allocator, std::vector< StackValue >& stack, std::vector< AstNode* >& nodes, uint32_t slot ) {
+	auto& current = stack[ slot ];
+
+	auto node_id = gen_node_id( allocator );
+	auto var_id = gen_var_id( allocator );
+
+	nodes.push_back( alloc_identifier_node( allocator, node_id, current.var_id, var_id ) );
+	stack.push_back( StackValue{ var_id, node_id } );
+}
+
+void decompile_set_slot( NodeAllocator& allocator, std::vector< StackValue >& stack, std::vector< AstNode* >& nodes, uint32_t slot ) {
+	auto& assign_dst = stack[ slot ];
+	auto& assign_src = stack[ stack.size() - 1 ];
+
+	// Var gets re-assigned, remove static flag
+	auto dst_node = find_node( nodes, assign_dst.node_id );
+	( *dst_node )->static_var = false;
+
+	auto node_id = gen_node_id( allocator );
+
+	auto node = alloc_assign_node(
+		allocator,
+		node_id,
+		assign_src.var_id,
+		assign_dst.var_id
+	);
+
+	nodes.push_back( node );
+}
+
+void decompile_binary( NodeAllocator& allocator, std::vector< StackValue >& stack, std::vector< AstNode* >& nodes, uint32_t inst ) {
+	AstNodeType node_type;
+	switch ( inst ) {
+	case OpCode::op_ne: node_type = AstNodeType::node_ne; break;
+	case OpCode::op_eq: node_type = AstNodeType::node_eq; break;
+	case OpCode::op_gt: node_type = AstNodeType::node_gt; break;
+	case OpCode::op_lt: node_type = AstNodeType::node_lt; break;
+	case OpCode::op_div: node_type = AstNodeType::node_div; break;
+	case OpCode::op_mul: node_type = AstNodeType::node_mul; break;
+	case OpCode::op_sub: node_type = AstNodeType::node_sub; break;
+	case OpCode::op_add: node_type = AstNodeType::node_add; break;
+	default:
+		throw std::exception( "Unknown instruction" );
+	}
+
+	AstNode* right_node = NULL;
+	AstNode* left_node = NULL;
+
+	stack_pop( nodes, stack, NULL, &right_node );
+	stack_pop( nodes, stack, NULL, &left_node );
+
+	auto node_id = gen_node_id( allocator );
+	auto var_id = gen_var_id( allocator );
+
+	nodes.push_back( alloc_complex_node( allocator, node_id, node_type, var_id, left_node, right_node ) );
+	stack.push_back( StackValue{ var_id, node_id } );
+}
+
+void decompile_call( NodeAllocator& allocator, std::vector< StackValue >& stack, std::vector< AstNode* >& nodes, uint32_t function_index, uint32_t arg_count ) {
+	std::vector< AstNode* > arg_nodes( arg_count );
+
+	for ( auto i = arg_count; i > 0; --i ) {
+		stack_pop( nodes, stack, NULL, &arg_nodes[ i - 1 ] );
+	}
+
+	auto node_id = gen_node_id( allocator );
+	auto var_id = gen_var_id( allocator );
+
+	auto node = alloc_list_node( allocator, node_id, AstNodeType::node_call, arg_nodes );
+	node->function_index = function_index;
+	node->var_id_to = var_id;
+
+	nodes.push_back( node );
+	stack.push_back( StackValue{ var_id, node_id } );
+}
+
 void parse_block(
 	NodeAllocator& allocator,
 	const Block& block,
@@ -265,93 +346,86 @@ void parse_block(
 			value.data.uint32[ 0 ] = block.code.at( cursor++ );
 			value.data.uint32[ 1 ] = block.code.at( cursor++ );
 
-			auto node_id = gen_node_id();
-			auto var_id = gen_var_id();
-
-			nodes.push_back( alloc_const_node( allocator, node_id, AstNodeType::node_const, var_id, value.data.dbl ) );
-			stack.push_back( StackValue{ var_id, node_id } );
+			decompile_load_number( allocator, stack, nodes, value.data.dbl );
 			break;
 		}
 		case OpCode::op_load_slot: {
-			auto slot = block.code.at( cursor++ );
-			auto& current = stack[ slot ];
-
-			auto node_id = gen_node_id();
-			auto var_id = gen_var_copy_id( current.var_id );
-
-			nodes.push_back( alloc_identifier_node( allocator, node_id, current.var_id, var_id ) );
-			stack.push_back( StackValue{ var_id, node_id } );
+			decompile_load_slot( allocator, stack, nodes, block.code.at( cursor++ ) );
 			break;
 		}
 		case OpCode::op_load_zero: {
-			auto node_id = gen_node_id();
-			auto var_id = gen_var_id();
-
-			nodes.push_back( alloc_const_node( allocator, node_id, AstNodeType::node_const, var_id, 0.0 ) );
-			stack.push_back( StackValue{ var_id, node_id } );
+			decompile_load_number( allocator, stack, nodes, 0.0 );
 			break;
 		}
 		case OpCode::op_set_slot: {
-			auto slot = block.code.at( cursor++ );
-
-			auto& assign_dst = stack[ slot ];
-			auto& assign_src = stack[ stack.size() - 1 ];
-
-			// Var gets re-assigned, remove static flag
-			auto dst_node = find_node( nodes, assign_dst.node_id );
-			( *dst_node )->static_var = false;
-
-			auto node_id = gen_node_id();
-
-			auto node = alloc_assign_node(
-				allocator,
-				node_id,
-				assign_src.var_id,
-				assign_dst.var_id
-			);
-
-			nodes.push_back( node );
+			decompile_set_slot( allocator, stack, nodes, block.code.at( cursor++ ) );
+			break;
+		}
+		case OpCode::op_store_slot: {
+			decompile_set_slot( allocator, stack, nodes, block.code.at( cursor++ ) );
+			stack_pop( nodes, stack );
 			break;
 		}
 		case OpCode::op_ne:
 		case OpCode::op_eq:
+		case OpCode::op_gt:
+		case OpCode::op_lt:
 		case OpCode::op_div:
 		case OpCode::op_mul:
 		case OpCode::op_sub:
 		case OpCode::op_add: {
-			AstNode* right_node = NULL;
-			AstNode* left_node = NULL;
+			decompile_binary( allocator, stack, nodes, inst );
+			break;
+		}
+		case OpCode::op_add_slot_imm:
+		case OpCode::op_sub_slot_imm:
+		case OpCode::op_mul_slot_imm:
+		case OpCode::op_div_slot_imm: {
+			decompile_load_slot( allocator, stack, nodes, block.code.at( cursor++ ) );
 
-			stack_pop( nodes, stack, NULL, &right_node );
-			stack_pop( nodes, stack, NULL, &left_node );
+			encoded_value value;
+			value.data.uint32[ 0 ] = block.code.at( cursor++ );
+			value.data.uint32[ 1 ] = block.code.at( cursor++ );
 
-			auto node_id = gen_node_id();
-			auto var_id = gen_var_id();
+			decompile_load_number( allocator, stack, nodes, value.data.dbl );
 
-			AstNodeType node_type;
+			uint32_t op = OpCode::op_add;
 			switch ( inst ) {
-			case OpCode::op_ne: node_type = AstNodeType::node_ne; break;
-			case OpCode::op_eq: node_type = AstNodeType::node_eq; break;
-			case OpCode::op_div: node_type = AstNodeType::node_div; break;
-			case OpCode::op_mul: node_type = AstNodeType::node_mul; break;
-			case OpCode::op_sub: node_type = AstNodeType::node_sub; break;
-			case OpCode::op_add: node_type = AstNodeType::node_add; break;
-			default: break;
+			case OpCode::op_sub_slot_imm: op = OpCode::op_sub; break;
+			case OpCode::op_mul_slot_imm: op = OpCode::op_mul; break;
+			case OpCode::op_div_slot_imm: op = OpCode::op_div; break;
 			}
 
-			nodes.push_back( alloc_complex_node( allocator, node_id, node_type, var_id, left_node, right_node ) );
-			stack.push_back( StackValue{ var_id, node_id } );
+			decompile_binary( allocator, stack, nodes, op );
 			break;
 		}
 		case OpCode::op_pop: {
 			stack_pop( nodes, stack );
 			break;
 		}
+		case OpCode::op_call:
+		case OpCode::op_tail_call: {
+			auto function_index = block.code.at( cursor++ );
+			auto arg_count = block.code.at( cursor++ );
+
+			decompile_call( allocator, stack, nodes, function_index, arg_count );
+
+			if ( inst == OpCode::op_call ) {
+				break;
+			}
+
+			// A tail call returns the callee's result
+			AstNode* call_node = NULL;
+			stack_pop( nodes, stack, NULL, &call_node );
+
+			nodes.push_back( alloc_simple_node( allocator, gen_node_id( allocator ), AstNodeType::node_return, call_node ) );
+			break;
+		}
 		case OpCode::op_return: {
 			AstNode* return_value_node = NULL;
 			stack_pop( nodes, stack, NULL, &return_value_node );
 
-			nodes.push_back( alloc_simple_node( allocator, gen_node_id(), AstNodeType::node_return, return_value_node ) );
+			nodes.push_back( alloc_simple_node( allocator, gen_node_id( allocator ), AstNodeType::node_return, return_value_node ) );
 			break;
 		}
 		case OpCode::op_jmp: {
@@ -376,7 +450,22 @@ void parse_block(
 			cursor += offset;
 			break;
 		}
-		case OpCode::op_jz: {
+		case OpCode::op_gt_jz:
+		case OpCode::op_lt_jz:
+		case OpCode::op_eq_jz:
+		case OpCode::op_ne_jz:
+			// Compare, then branch like op_jz_pop
+			switch ( inst ) {
+			case OpCode::op_gt_jz: decompile_binary( allocator, stack, nodes, OpCode::op_gt ); break;
+			case OpCode::op_lt_jz: decompile_binary( allocator, stack, nodes, OpCode::op_lt ); break;
+			case OpCode::op_eq_jz: decompile_binary( allocator, stack, nodes, OpCode::op_eq ); break;
+			case OpCode::op_ne_jz: decompile_binary( allocator, stack, nodes, OpCode::op_ne ); break;
+			}
+
+			inst = OpCode::op_jz_pop;
+			// fallthrough
+		case OpCode::op_jz:
+		case OpCode::op_jz_pop: {
 			int32_t offset = ( int32_t ) block.code.at( cursor++ );
 
 			if ( offset < 0 ) {
@@ -392,7 +481,14 @@ void parse_block(
 				throw std::exception( "Cond node not found" );
 			}
 
-			std::unordered_map< std::string, bool > current_node_ids;
+			auto cond = *cond_node;
+
+			// op_jz_pop consumes the condition before either branch runs
+			if ( inst == OpCode::op_jz_pop ) {
+				stack_pop( nodes, stack );
+			}
+
+			std::unordered_map< NodeId, bool > current_node_ids;
 			std::transform( nodes.begin(), nodes.end(), std::inserter( current_node_ids, current_node_ids.end() ), []( const AstNode* node ) {
 				return std::make_pair( node->node_id, true );
 			} );
@@ -418,13 +514,17 @@ void parse_block(
 			);
 
 			std::vector< AstNode* > body_nodes;
-			body_nodes.push_back( *cond_node );
+			body_nodes.push_back( cond );
 			std::copy( then_new_nodes.begin(), then_new_nodes.end(), std::back_inserter( body_nodes ) );
 
-			nodes.push_back( alloc_list_node( allocator, gen_node_id(), backjump ? AstNodeType::node_while : AstNodeType::node_if, body_nodes ) );
+			nodes.push_back( alloc_list_node( allocator, gen_node_id( allocator ), backjump ? AstNodeType::node_while : AstNodeType::node_if, body_nodes ) );
 
 			cursor += offset;
 
+			if ( inst == OpCode::op_jz_pop ) {
+				break;
+			}
+
 			// TODO: Else-branch
 			if ( block.code[ cursor++ ] != OpCode::op_pop ) {
 				throw std::exception( "Pop not found in else block" );
@@ -437,7 +537,7 @@ void parse_block(
 			throw std::exception( "Unknown instruction" );
 		}
 
-		if ( inst == OpCode::op_return ) {
+		if ( inst == OpCode::op_return || inst == OpCode::op_tail_call ) {
 			break;
 		}
 	}
@@ -5,6 +5,8 @@ struct Function;
 enum AstNodeType {
 	node_eq,
 	node_ne,
+	node_gt,
+	node_lt,
 	node_div,
 	node_mul,
 	node_sub,
@@ -15,6 +17,7 @@ enum AstNodeType {
 	node_return,
 	node_if,
 	node_while,
+	node_call,
 };
 
 enum AstNodeGroup {
@@ -25,17 +28,23 @@ enum AstNodeGroup {
 	node_name,
 };
 
+// Ids of nodes and of the values they produce, numbered per decompilation
+typedef uint32_t NodeId;
+
+const NodeId node_id_none = 0;
+
 struct AstNode {
-	AstNode() { }
+	AstNode() : node_id( node_id_none ), var_id_from( node_id_none ), var_id_to( node_id_none ), function_index( 0 ) { }
 
-	std::string						node_id;
+	NodeId							node_id;
 	AstNodeType						node_type;
 	AstNodeGroup					node_group;
 
 	std::vector< AstNode* >			children;
-	std::string						var_id_from;
-	std::string						var_id_to;
+	NodeId							var_id_from;
+	NodeId							var_id_to;
 	double							constant;
+	uint32_t						function_index;		// Callee of a node_call, its children are the arguments
 
 	bool							static_var;
 };
@@ -5,10 +5,11 @@
 #include <assert.h>
 #include <algorithm>
 #include <iostream>
+#include <memory>
 
+#include "../Main.h"
 #include "Decompiler.h"
 #include "x86_64Compiler.h"
-#include "../Main.h"
 
 #define REG_RAX 0
 #define REG_RCX 1
@@ -38,7 +39,7 @@ enum LocationType {
 };
 
 struct Identifier {
-	Identifier( const std::string& name, LocationType loc_type, uint32_t loc, uint32_t hydr_count, bool static_var ) {
+	Identifier( NodeId name, LocationType loc_type, uint32_t loc, uint32_t hydr_count, bool static_var ) {
 		static int s_identifier_uuid = 0;
 
 		names.push_back( name );
@@ -49,12 +50,12 @@ struct Identifier {
 		is_static = static_var;
 	}
 
-	bool has_name( const std::string& name ) const {
+	bool has_name( NodeId name ) const {
 		return std::find( names.begin(), names.end(), name ) != names.end();
 	}
 
 	std::string uuid;
-	std::vector< std::string > names;
+	std::vector< NodeId > names;
 	LocationType location_type;
 	uint32_t location;
 	uint32_t hydrate_count;
@@ -97,6 +98,7 @@ void asm_jmp_rel32( JitContext* context, uint32_t rel32 );
 void asm_jz_rel32( JitContext* context, uint32_t rel32 );
 void asm_jmp_rel8( JitContext* context, uint8_t rel8 );
 void asm_jz_rel8( JitContext* context, uint8_t rel8 );
+void asm_ja_rel8( JitContext* context, uint8_t rel8 );
 void asm_ret( JitContext* context );
 
 struct Label {
@@ -154,7 +156,7 @@ void label_patch_byte( JitContext* context, Label* label ) {
 	}
 }
 
-void create_identifier( JitContext* context, uint32_t xmm_location, const std::string& name, bool is_static ) {
+void create_identifier( JitContext* context, uint32_t xmm_location, NodeId name, bool is_static ) {
 	context->identifiers.emplace_back(
 		name,
 		LocationType::location_xmm,
@@ -164,8 +166,8 @@ void create_identifier( JitContext* context, uint32_t xmm_location, const std::s
 	);
 }
 
-Identifier* find_identifier_by_name( JitContext* context, const std::string& name ) {
-	auto find_result = std::find_if( context->identifiers.begin(), context->identifiers.end(), [ &name ]( const Identifier& id ) {
+Identifier* find_identifier_by_name( JitContext* context, NodeId name ) {
+	auto find_result = std::find_if( context->identifiers.begin(), context->identifiers.end(), [ name ]( const Identifier& id ) {
 		return id.has_name( name );
 	} );
 
@@ -174,8 +176,8 @@ Identifier* find_identifier_by_name( JitContext* context, const std::string& nam
 	return &*find_result;
 }
 
-void remove_identifier_by_name( JitContext* context, const std::string& name ) {
-	auto find_result = std::find_if( context->identifiers.begin(), context->identifiers.end(), [ &name ]( const Identifier& id ) {
+void remove_identifier_by_name( JitContext* context, NodeId name ) {
+	auto find_result = std::find_if( context->identifiers.begin(), context->identifiers.end(), [ name ]( const Identifier& id ) {
 		return id.has_name( name );
 	} );
 
@@ -272,7 +274,7 @@ void hydrate_identifier( JitContext* context, Identifier* identifier ) {
 void jit_recursive( JitContext* context, AstNode* node ) {
 	switch ( node->node_type ) {
 	case AstNodeType::node_const: {
-		assert( node->var_id_to.length() > 0 );
+		assert( node->var_id_to != node_id_none );
 
 		auto constant_index = jit_add_constant( context, node->constant );
 		auto xmm = jit_alloc_xmm( context );
@@ -298,6 +300,8 @@ void jit_recursive( JitContext* context, AstNode* node ) {
 	}
 	case AstNodeType::node_ne:
 	case AstNodeType::node_eq:
+	case AstNodeType::node_gt:
+	case AstNodeType::node_lt:
 	case AstNodeType::node_div:
 	case AstNodeType::node_mul:
 	case AstNodeType::node_sub:
@@ -351,6 +355,37 @@ void jit_recursive( JitContext* context, AstNode* node ) {
 			label_patch_byte( context, &jmp_label );
 			break;
 		}
+		case AstNodeType::node_gt:
+		case AstNodeType::node_lt: {
+			Label ja_label;
+			Label jmp_label;
+
+			auto one_constant = jit_add_constant( context, 1.0 );
+
+			// ja is not taken when either side is NaN, so both comparisons are false for it
+			if ( node->node_type == AstNodeType::node_gt ) {
+				asm_ucomisd_xmm_xmm( context, left_identifier->location, right_identifier->location );
+			} else {
+				asm_ucomisd_xmm_xmm( context, right_identifier->location, left_identifier->location );
+			}
+
+			asm_ja_rel8( context, 0xFF );
+			label_emplace( context, &ja_label, 0x1 );
+
+			asm_pxor_xmm( context, target_xmm, target_xmm );
+
+			asm_jmp_rel8( context, 0xFF );
+			label_emplace( context, &jmp_label, 0x1 );
+
+			label_target( context, &ja_label );
+			label_patch_byte( context, &ja_label );
+
+			asm_mov_xmm_const( context, target_xmm, one_constant );
+
+			label_target( context, &jmp_label );
+			label_patch_byte( context, &jmp_label );
+			break;
+		}
 		case AstNodeType::node_add: asm_add_xmm_xmm( context, target_xmm, right_identifier->location ); break;
 		case AstNodeType::node_sub: asm_sub_xmm_xmm( context, target_xmm, right_identifier->location ); break;
 		case AstNodeType::node_mul: asm_mul_xmm_xmm( context, target_xmm, right_identifier->location ); break;
@@ -501,7 +536,20 @@ void jit_build( std::vector< AstNode* >& ast, JitContext* context ) {
 	);
 }
 
+// The backend has no lowering for node_call yet
+bool contains_call( const AstNode* node ) {
+	if ( node->node_type == AstNodeType::node_call ) {
+		return true;
+	}
+
+	return std::any_of( node->children.begin(), node->children.end(), contains_call );
+}
+
 bool jit_compile( std::vector< AstNode* >& ast, JitFunction* function ) {
+	if ( std::any_of( ast.begin(), ast.end(), contains_call ) ) {
+		throw std::exception( "The JIT can not compile functions that make calls" );
+	}
+
 	unsigned char* memory = ( unsigned char* ) VirtualAllocEx( ( HANDLE ) -1, NULL, 4098, MEM_COMMIT, PAGE_EXECUTE_READWRITE );
 
 	JitContext context;
@@ -771,6 +819,10 @@ void asm_jz_rel8( JitContext* context, uint8_t rel8 ) {
 	context->dst = asm_write_bytes( context->dst, 2, 0x74, rel8 );
 }
 
+void asm_ja_rel8( JitContext* context, uint8_t rel8 ) {
+	context->dst = asm_write_bytes( context->dst, 2, 0x77, rel8 );
+}
+
 void asm_ret( JitContext* context ) {
 	// ret
 	context->dst = asm_write_bytes( context->dst, 1, 0xC3 );